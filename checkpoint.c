@@ -19,6 +19,7 @@
 #include "node.h"
 #include "segment.h"
 #include "iostat.h"
+#include "dedup.h"
 #include <trace/events/f2fs.h>
 
 #define DEFAULT_CHECKPOINT_IOPRIO (IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, 3))
@@ -182,6 +183,11 @@ bool f2fs_is_valid_blkaddr(struct f2fs_sb_info *sbi,
 			blkaddr < MAIN_BLKADDR(sbi)))
 			return false;
 		break;
+	case META_DEDUP:
+		if (unlikely(!DEDUP_I(sbi) ||
+			blkaddr >= DEDUP_I(sbi)->table_blocks))
+			return false;
+		break;
 	case DATA_GENERIC:
 	case DATA_GENERIC_ENHANCE:
 	case DATA_GENERIC_ENHANCE_READ:
@@ -209,7 +215,7 @@ bool f2fs_is_valid_blkaddr(struct f2fs_sb_info *sbi,
 }
 
 /*
- * Readahead CP/NAT/SIT/SSA/POR pages
+ * Readahead CP/NAT/SIT/SSA/POR/DEDUP pages
  */
 int f2fs_ra_meta_pages(struct f2fs_sb_info *sbi, block_t start, int nrpages,
 							int type, bool sync)
@@ -253,6 +259,10 @@ int f2fs_ra_meta_pages(struct f2fs_sb_info *sbi, block_t start, int nrpages,
 			fio.new_blkaddr = current_sit_addr(sbi,
 					blkno * SIT_ENTRY_PER_BLOCK);
 			break;
+		case META_DEDUP:
+			/* get live copy of dedup table block */
+			fio.new_blkaddr = current_dedup_addr(sbi, blkno);
+			break;
 		case META_SSA:
 		case META_CP:
 		case META_POR:
@@ -1350,6 +1360,9 @@ static void update_ckpt_flags(struct f2fs_sb_info *sbi, struct cp_control *cpc)
 	else
 		__clear_ckpt_flags(ckpt, CP_RESIZEFS_FLAG);
 
+	if (f2fs_dedup_enabled(sbi))
+		__set_ckpt_flags(ckpt, CP_DEDUP_AREA_FLAG);
+
 	if (is_sbi_flag_set(sbi, SBI_CP_DISABLED))
 		__set_ckpt_flags(ckpt, CP_DISABLED_FLAG);
 	else
@@ -1675,6 +1688,9 @@ int f2fs_write_checkpoint(struct f2fs_sb_info *sbi, struct cp_control *cpc)
 
 	f2fs_flush_sit_entries(sbi, cpc);
 
+	/* write dedup table entries changed since the last checkpoint */
+	f2fs_flush_dedup_entries(sbi, cpc);
+
 	/* save inmem log status */
 	f2fs_save_inmem_curseg(sbi);
 
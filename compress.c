@@ -18,6 +18,7 @@
 #include "f2fs.h"
 #include "node.h"
 #include "segment.h"
+#include "dedup.h"
 #include <trace/events/f2fs.h>
 
 static struct kmem_cache *cic_entry_slab;
@@ -1226,7 +1227,8 @@ int f2fs_truncate_partial_cluster(struct inode *inode, u64 from, bool lock)
 static int f2fs_write_compressed_pages(struct compress_ctx *cc,
 					int *submitted,
 					struct writeback_control *wbc,
-					enum iostat_type io_type)
+					enum iostat_type io_type,
+					const u8 *dedup_fp)
 {
 	struct inode *inode = cc->inode;
 	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
@@ -1251,6 +1253,7 @@ static int f2fs_write_compressed_pages(struct compress_ctx *cc,
 	struct compress_io_ctx *cic;
 	pgoff_t start_idx = start_idx_of_cluster(cc);
 	unsigned int last_index = cc->cluster_size - 1;
+	block_t first_blkaddr = NULL_ADDR;
 	loff_t psize;
 	int i, err;
 
@@ -1367,11 +1370,21 @@ static int f2fs_write_compressed_pages(struct compress_ctx *cc,
 		cc->cpages[i - 1] = NULL;
 		f2fs_outplace_write_data(&dn, &fio);
 		(*submitted)++;
+
+		/* only consecutive blocks are found again by a hit */
+		if (i == 1)
+			first_blkaddr = fio.new_blkaddr;
+		else if (fio.new_blkaddr != first_blkaddr + i - 1)
+			dedup_fp = NULL;
 unlock_continue:
 		inode_dec_dirty_pages(cc->inode);
 		unlock_page(fio.page);
 	}
 
+	if (dedup_fp)
+		f2fs_dedup_insert_cluster(sbi, dedup_fp, first_blkaddr,
+						cc->valid_nr_cpages);
+
 	if (fio.compr_blocks)
 		f2fs_i_compr_blocks_update(inode, fio.compr_blocks - 1, false);
 	f2fs_i_compr_blocks_update(inode, cc->valid_nr_cpages, true);
@@ -1422,6 +1435,125 @@ out_free:
 	return -EAGAIN;
 }
 
+/* whole clusters are shared only in plain files, and by strong hashes */
+static bool cluster_may_dedup(struct compress_ctx *cc,
+					enum iostat_type io_type)
+{
+	struct f2fs_sb_info *sbi = F2FS_I_SB(cc->inode);
+
+	if (io_type != FS_DATA_IO || !f2fs_dedup_inline(sbi))
+		return false;
+	if (!f2fs_dedup_file(cc->inode) || IS_NOQUOTA(cc->inode))
+		return false;
+	/* a weak match would have to be decompressed to be confirmed */
+	if (fscrypt_inode_uses_fs_layer_crypto(cc->inode) ||
+			DEDUP_I(sbi)->fp_weak)
+		return false;
+	return !f2fs_dedup_bypass(sbi, cc->inode);
+}
+
+/*
+ * Map the cluster of @cc to the compressed blocks of an identical one
+ * found by @fp, without compressing it.  Return -EAGAIN if there is none,
+ * and the cluster is to be compressed and written as usual.
+ */
+static int f2fs_write_dedup_cluster(struct compress_ctx *cc, const u8 *fp)
+{
+	struct inode *inode = cc->inode;
+	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
+	struct f2fs_inode_info *fi = F2FS_I(inode);
+	pgoff_t start_idx = start_idx_of_cluster(cc);
+	unsigned int nr_cpages, compr_blocks = 0;
+	struct dnode_of_data dn;
+	block_t blkaddr;
+	loff_t psize;
+	int i, err;
+
+	if (!f2fs_trylock_op(sbi))
+		return -EAGAIN;
+
+	set_new_dnode(&dn, inode, NULL, NULL, 0);
+	err = f2fs_get_dnode_of_data(&dn, start_idx, LOOKUP_NODE);
+	if (err)
+		goto out_unlock_op;
+
+	err = -EAGAIN;
+	for (i = 0; i < cc->cluster_size; i++) {
+		if (data_blkaddr(dn.inode, dn.node_page,
+					dn.ofs_in_node + i) == NULL_ADDR)
+			goto out_put_dnode;
+	}
+
+	nr_cpages = f2fs_dedup_share_cluster(sbi, fp, cc->cluster_size - 1,
+								&blkaddr);
+	if (!nr_cpages)
+		goto out_put_dnode;
+
+	for (i = 0; i < cc->cluster_size; i++, dn.ofs_in_node++) {
+		block_t old_blkaddr = f2fs_data_blkaddr(&dn);
+
+		/* cluster header */
+		if (i == 0) {
+			if (old_blkaddr == COMPRESS_ADDR)
+				compr_blocks++;
+			if (__is_valid_data_blkaddr(old_blkaddr))
+				f2fs_invalidate_blocks(sbi, old_blkaddr);
+			f2fs_update_data_blkaddr(&dn, COMPRESS_ADDR);
+			continue;
+		}
+
+		if (compr_blocks && __is_valid_data_blkaddr(old_blkaddr))
+			compr_blocks++;
+
+		if (i > nr_cpages) {
+			if (__is_valid_data_blkaddr(old_blkaddr)) {
+				f2fs_invalidate_blocks(sbi, old_blkaddr);
+				f2fs_update_data_blkaddr(&dn, NEW_ADDR);
+			}
+			continue;
+		}
+
+		f2fs_dedup_add_owner(sbi, blkaddr + i - 1, dn.nid,
+							dn.ofs_in_node);
+		f2fs_dedup_release_block(sbi, old_blkaddr);
+		f2fs_update_data_blkaddr(&dn, blkaddr + i - 1);
+		f2fs_update_iostat(sbi, FS_DEDUP_IO, F2FS_BLKSIZE);
+	}
+
+	if (compr_blocks)
+		f2fs_i_compr_blocks_update(inode, compr_blocks - 1, false);
+	f2fs_i_compr_blocks_update(inode, nr_cpages, true);
+	add_compr_block_stat(inode, nr_cpages);
+
+	set_inode_flag(inode, FI_APPEND_WRITE);
+	if (cc->cluster_idx == 0)
+		set_inode_flag(inode, FI_FIRST_BLOCK_WRITTEN);
+
+	f2fs_put_dnode(&dn);
+	f2fs_unlock_op(sbi);
+
+	psize = (loff_t)(cc->rpages[cc->cluster_size - 1]->index + 1)
+							<< PAGE_SHIFT;
+	spin_lock(&fi->i_size_lock);
+	if (fi->last_disk_size < psize)
+		fi->last_disk_size = psize;
+	spin_unlock(&fi->i_size_lock);
+
+	for (i = 0; i < cc->cluster_size; i++) {
+		inode_dec_dirty_pages(inode);
+		unlock_page(cc->rpages[i]);
+	}
+	f2fs_put_rpages(cc);
+	f2fs_destroy_compress_ctx(cc, false);
+	return 0;
+
+out_put_dnode:
+	f2fs_put_dnode(&dn);
+out_unlock_op:
+	f2fs_unlock_op(sbi);
+	return err;
+}
+
 void f2fs_compress_write_end_io(struct bio *bio, struct page *page)
 {
 	struct f2fs_sb_info *sbi = bio->bi_private;
@@ -1490,7 +1622,7 @@ continue_unlock:
 
 		ret = f2fs_write_single_data_page(cc->rpages[i], &_submitted,
 						NULL, NULL, wbc, io_type,
-						compr_blocks, false);
+						compr_blocks, false, NULL, false);
 		if (ret) {
 			if (ret == AOP_WRITEPAGE_ACTIVATE) {
 				unlock_page(cc->rpages[i]);
@@ -1527,6 +1659,20 @@ int f2fs_write_multi_pages(struct compress_ctx *cc,
 
 	*submitted = 0;
 	if (cluster_may_compress(cc)) {
+		struct inode *inode = cc->inode;
+		u8 digest[DEDUP_FP_SIZE];
+		bool dedup = cluster_may_dedup(cc, io_type) &&
+			!f2fs_dedup_fingerprint_cluster(inode, cc->rpages,
+						cc->cluster_size, digest);
+
+		if (dedup) {
+			bool shared = !f2fs_write_dedup_cluster(cc, digest);
+
+			f2fs_dedup_account(F2FS_I_SB(inode), inode, shared);
+			if (shared)
+				return 0;
+		}
+
 		err = f2fs_compress_pages(cc);
 		if (err == -EAGAIN) {
 			add_compr_block_stat(cc->inode, cc->cluster_size);
@@ -1537,7 +1683,7 @@ int f2fs_write_multi_pages(struct compress_ctx *cc,
 		}
 
 		err = f2fs_write_compressed_pages(cc, submitted,
-							wbc, io_type);
+					wbc, io_type, dedup ? digest : NULL);
 		if (!err)
 			return 0;
 		f2fs_bug_on(F2FS_I_SB(cc->inode), err != -EAGAIN);
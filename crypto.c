@@ -28,103 +28,6 @@
 #include <crypto/skcipher.h>
 #include "fscrypt_private.h"
 
-#define DEDUP_TABLE_SIZE 1024*1024
-extern struct Fingeritem *hashArray[DEDUP_TABLE_SIZE];
-extern struct Fingercryptitem *hashcryptArray[DEDUP_TABLE_SIZE];
-extern struct Blkrefitem *blkArray[DEDUP_TABLE_SIZE];
-
-struct Cryptitem {
-	char fingerprint_crypt[16];
-	unsigned long ino;
-};
-struct Fingeritem {
-	char fingerprint[16];
-	size_t blk_addr;
-};
-struct Fingercryptitem {
-	// 用于解密时获得数据块原本的lblk_num
-	char fingerprint_crypt[16];
-	u64 lblk_num;
-};
-struct Blkrefitem {
-	size_t blk_addr;
-	size_t ref;
-};
-
-extern struct file *finger_table;
-extern struct file *finger_crypt_table;
-extern struct file *block_table;
-
-
-struct Cryptitem *cryptArray[DEDUP_TABLE_SIZE];
-
-size_t hashCrypt(char *finger){
-	size_t hash = 0;
-	for (size_t i = 0; i < 16; i++)
-		hash += (size_t)finger[i];
-	hash = hash % DEDUP_TABLE_SIZE;
-	return hash;
-}
-
-struct Cryptitem *crypt_search(char *finger)
-{
-	//get the hash
-	size_t hashIndex = hashCrypt(finger);
-	int loop = 0;
-	//move in array until an empty
-	while (cryptArray[hashIndex] != NULL) {
-		int ret =
-			strncmp(cryptArray[hashIndex]->fingerprint_crypt, finger, 16);
-		if (!ret)
-			return cryptArray[hashIndex];
-
-		//go to next cell
-		++hashIndex;
-		loop++;
-		if (loop > DEDUP_TABLE_SIZE)
-			return NULL;
-
-		//wrap around the table
-		hashIndex %= DEDUP_TABLE_SIZE;
-	}
-	return NULL;
-}
-
-int crypttable_insert(char *finger, unsigned long ino) {
-	int loop;
-	int hashIndex;
-	struct Cryptitem *crypt_item = (struct Cryptitem *)kmalloc(sizeof(struct Cryptitem), GFP_KERNEL);
-	strncpy(crypt_item->fingerprint_crypt, finger, 16);
-	crypt_item->ino = ino;
-
-	hashIndex = hashCrypt(finger);
-	loop = 0;
-	while (cryptArray[hashIndex] != NULL && cryptArray[hashIndex]->ino > 0) {
-		//go to next cell
-		++hashIndex;
-
-		//wrap around the table
-		hashIndex %= DEDUP_TABLE_SIZE;
-		loop++;
-		if (loop > DEDUP_TABLE_SIZE)
-			return 1;
-	}
-	kfree(cryptArray[hashIndex]);
-	cryptArray[hashIndex] = crypt_item;
-	return 0;
-}
-
-void read_finger_blk_table_from_file(void);
-void write_finger_blk_table_to_file(void);
-size_t hashFinger(char *finger);
-size_t hashBlk(size_t blk_addr);
-struct Fingercryptitem *finger_crypt_search(char *finger);
-struct Fingeritem *finger_search(char *finger);
-struct Blkrefitem *block_search(size_t blk_addr);
-void __attribute__((optimize("O0"))) hash_page_data(struct page* page, char* digest);
-struct inode *f2fs_iget(struct super_block *sb, unsigned long ino);
-
-
 static unsigned int num_prealloc_crypto_pages = 32;
 
 module_param(num_prealloc_crypto_pages, uint, 0444);
@@ -208,19 +111,6 @@ int fscrypt_crypt_block(const struct inode *inode, fscrypt_direction_t rw,
 	struct crypto_skcipher *tfm = ci->ci_enc_key.tfm;
 	int res = 0;
 
-	char digest[16];
-	struct Fingercryptitem *finger_crypt_item;
-	struct Cryptitem *crypt_item;
-	// 解密时读取hashtable，获取lblk_num
-	if (rw == FS_DECRYPT) {
-		read_finger_blk_table_from_file();
-		hash_page_data(src_page, digest);
-		finger_crypt_item = finger_crypt_search(digest);
-		if (finger_crypt_item) {
-			lblk_num = finger_crypt_item->lblk_num;
-		}
-	}
-
 	if (WARN_ON_ONCE(len <= 0))
 		return -EINVAL;
 	if (WARN_ON_ONCE(len % FSCRYPT_CONTENTS_ALIGNMENT != 0))
@@ -251,29 +141,6 @@ int fscrypt_crypt_block(const struct inode *inode, fscrypt_direction_t rw,
 			    (rw == FS_DECRYPT ? "De" : "En"), lblk_num, res);
 		return res;
 	}
-	// 加密完成之后， destpage存储着密文，计算密文的finger，存储ino
-	if (rw == FS_ENCRYPT) {
-		loff_t pos_ci;
-		int hashIndex = 0;
-		struct file *ci_table = filp_open("/citable", O_RDWR | O_CREAT, 0);
-		for (hashIndex = 0; hashIndex < DEDUP_TABLE_SIZE; hashIndex++) {
-			if (cryptArray[hashIndex] == NULL) {
-				cryptArray[hashIndex] = (struct Cryptitem *)kmalloc(sizeof(struct Cryptitem), GFP_KERNEL);
-				cryptArray[hashIndex]->ino = 0;
-			}
-		}
-		for (hashIndex = 0, pos_ci = 0; hashIndex < DEDUP_TABLE_SIZE; hashIndex++) {
-			kernel_read(ci_table, cryptArray[hashIndex], sizeof(struct Cryptitem), &pos_ci);
-		}
-		hash_page_data(dest_page, digest);
-		if (!crypt_search(digest)) {
-			crypttable_insert(digest, inode->i_ino);
-		}
-		for (hashIndex = 0, pos_ci = 0; hashIndex < DEDUP_TABLE_SIZE; hashIndex++) {
-			kernel_write(ci_table, cryptArray[hashIndex], sizeof(struct Cryptitem), &pos_ci);
-		}
-		filp_close(ci_table, NULL);
-	}
 	return 0;
 }
 
@@ -388,8 +255,7 @@ EXPORT_SYMBOL(fscrypt_encrypt_block_inplace);
 int fscrypt_decrypt_pagecache_blocks(struct page *page, unsigned int len,
 				     unsigned int offs)
 {
-	// 这里的inode删掉了const关键字
-	struct inode *inode = page->mapping->host;
+	const struct inode *inode = page->mapping->host;
 	const unsigned int blockbits = inode->i_blkbits;
 	const unsigned int blocksize = 1 << blockbits;
 	u64 lblk_num = ((u64)page->index << (PAGE_SHIFT - blockbits)) +
@@ -397,36 +263,12 @@ int fscrypt_decrypt_pagecache_blocks(struct page *page, unsigned int len,
 	unsigned int i;
 	int err;
 
-	char digest_c[16];
-	loff_t pos_ci;
-	int hashIndex = 0;
-	struct Cryptitem *crypt_item;
-	struct file *ci_table = filp_open("/citable", O_RDWR | O_CREAT, 0);
-
 	if (WARN_ON_ONCE(!PageLocked(page)))
 		return -EINVAL;
 
 	if (WARN_ON_ONCE(len <= 0 || !IS_ALIGNED(len | offs, blocksize)))
 		return -EINVAL;
 
-	// 从文件中恢复hashtable，读取加密page对应的ino
-	for (hashIndex = 0; hashIndex < DEDUP_TABLE_SIZE; hashIndex++) {
-		if (cryptArray[hashIndex] == NULL) {
-			cryptArray[hashIndex] = (struct Cryptitem *)kmalloc(sizeof(struct Cryptitem), GFP_KERNEL);
-			cryptArray[hashIndex]->ino = 0;
-		}
-	}
-	for (hashIndex = 0, pos_ci = 0; hashIndex < DEDUP_TABLE_SIZE; hashIndex++) {
-		kernel_read(ci_table, cryptArray[hashIndex], sizeof(struct Cryptitem), &pos_ci);
-	}
-	hash_page_data(page, digest_c);
-	crypt_item = crypt_search(digest_c);
-	if (crypt_item) {
-		int err;
-		inode = f2fs_iget(inode->i_sb, crypt_item->ino);
-		err = fscrypt_require_key(inode);
-	}
-
 	for (i = offs; i < offs + len; i += blocksize, lblk_num++) {
 		err = fscrypt_crypt_block(inode, FS_DECRYPT, lblk_num, page,
 					  page, blocksize, i, GFP_NOFS);
@@ -437,6 +279,43 @@ int fscrypt_decrypt_pagecache_blocks(struct page *page, unsigned int len,
 }
 EXPORT_SYMBOL(fscrypt_decrypt_pagecache_blocks);
 
+/**
+ * fscrypt_decrypt_shared_block() - Decrypt a block shared with another file
+ * @owner:     The inode the block was encrypted for
+ * @page:      The locked pagecache page containing the block to decrypt
+ * @len:       Size of the block to decrypt.  Must be the filesystem's block
+ *		size.
+ * @offs:      Byte offset within @page of the block to decrypt
+ * @lblk_num:  Logical block number in @owner the block was encrypted for
+ *
+ * A filesystem that deduplicates ciphertext maps one encrypted block into
+ * several files.  The block keeps the key and IV of the file block it was
+ * written for, so decrypt it in-place with those instead of the page's own.
+ *
+ * Return: 0 on success; -errno on failure
+ */
+int fscrypt_decrypt_shared_block(struct inode *owner, struct page *page,
+				 unsigned int len, unsigned int offs,
+				 u64 lblk_num)
+{
+	int err;
+
+	if (WARN_ON_ONCE(!PageLocked(page)))
+		return -EINVAL;
+
+	if (WARN_ON_ONCE(len != i_blocksize(owner) ||
+			 !IS_ALIGNED(offs, len)))
+		return -EINVAL;
+
+	err = fscrypt_require_key(owner);
+	if (err)
+		return err;
+
+	return fscrypt_crypt_block(owner, FS_DECRYPT, lblk_num, page, page,
+				   len, offs, GFP_NOFS);
+}
+EXPORT_SYMBOL(fscrypt_decrypt_shared_block);
+
 /**
  * fscrypt_decrypt_block_inplace() - Decrypt a filesystem block in-place
  * @inode:     The inode to which this block belongs
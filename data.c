@@ -26,6 +26,7 @@
 #include "node.h"
 #include "segment.h"
 #include "iostat.h"
+#include "dedup.h"
 #include <trace/events/f2fs.h>
 
 #define NUM_PREALLOC_POST_READ_CTXS	128
@@ -253,13 +254,54 @@ static void f2fs_handle_step_decompress(struct bio_post_read_ctx *ctx)
 		ctx->enabled_steps &= ~STEP_VERITY;
 }
 
+/*
+ * Decrypt the bio's pages.  A block dedup shares with another file is
+ * ciphertext of that file, so it is decrypted with the key and IV of the
+ * file block it was written for, which the dedup index keeps by address.
+ */
+static void f2fs_decrypt_bio(struct bio_post_read_ctx *ctx)
+{
+	struct f2fs_sb_info *sbi = ctx->sbi;
+	struct bio_vec *bv;
+	struct bvec_iter_all iter_all;
+	block_t blkaddr = ctx->fs_blkaddr;
+
+	if (!f2fs_dedup_enabled(sbi)) {
+		fscrypt_decrypt_bio(ctx->bio);
+		return;
+	}
+
+	bio_for_each_segment_all(bv, ctx->bio, iter_all) {
+		struct page *page = bv->bv_page;
+		struct inode *owner;
+		u64 lblk = page->index;
+		int err;
+
+		owner = f2fs_dedup_crypt_owner(sbi, blkaddr,
+					page->mapping->host, &lblk);
+		if (!owner) {
+			err = fscrypt_decrypt_pagecache_blocks(page,
+						bv->bv_len, bv->bv_offset);
+		} else if (IS_ERR(owner)) {
+			err = PTR_ERR(owner);
+		} else {
+			err = fscrypt_decrypt_shared_block(owner, page,
+					bv->bv_len, bv->bv_offset, lblk);
+			iput(owner);
+		}
+		if (err)
+			SetPageError(page);
+		blkaddr++;
+	}
+}
+
 static void f2fs_post_read_work(struct work_struct *work)
 {
 	struct bio_post_read_ctx *ctx =
 		container_of(work, struct bio_post_read_ctx, work);
 
 	if (ctx->enabled_steps & STEP_DECRYPT)
-		fscrypt_decrypt_bio(ctx->bio);
+		f2fs_decrypt_bio(ctx);
 
 	if (ctx->enabled_steps & STEP_DECOMPRESS)
 		f2fs_handle_step_decompress(ctx);
@@ -1241,6 +1283,12 @@ got_it:
 		return page;
 	}
 
+	if (f2fs_dedup_load_cached_block(inode, page, dn.data_blkaddr)) {
+		SetPageUptodate(page);
+		unlock_page(page);
+		return page;
+	}
+
 	err = f2fs_submit_page_read(inode, page, dn.data_blkaddr,
 						op_flags, for_write);
 	if (err)
@@ -1452,8 +1500,9 @@ int f2fs_map_blocks(struct inode *inode, struct f2fs_map_blocks *map,
 	end = pgofs + maxblocks;
 
 	if (!create && f2fs_lookup_extent_cache(inode, pgofs, &ei)) {
-		if (f2fs_lfs_mode(sbi) && flag == F2FS_GET_BLOCK_DIO &&
-							map->m_may_create)
+		/* out-place-update below, under LFS mode or over shared blocks */
+		if ((f2fs_lfs_mode(sbi) || f2fs_dedup_enabled(sbi)) &&
+			flag == F2FS_GET_BLOCK_DIO && map->m_may_create)
 			goto next_dnode;
 
 		map->m_pblk = ei.blk + pgofs - ei.fofs;
@@ -1535,9 +1584,13 @@ next_block:
 	}
 
 	if (__is_valid_data_blkaddr(blkaddr)) {
-		/* use out-place-update for driect IO under LFS mode */
-		if (f2fs_lfs_mode(sbi) && flag == F2FS_GET_BLOCK_DIO &&
-							map->m_may_create) {
+		/*
+		 * use out-place-update for driect IO under LFS mode, and
+		 * for blocks other files share
+		 */
+		if ((f2fs_lfs_mode(sbi) ||
+			f2fs_dedup_block_shared(sbi, blkaddr)) &&
+			flag == F2FS_GET_BLOCK_DIO && map->m_may_create) {
 			err = __allocate_data_block(&dn, map->m_seg_type);
 			if (err)
 				goto sync_out;
@@ -2061,6 +2114,13 @@ got_it:
 			ret = -EFSCORRUPTED;
 			goto out;
 		}
+
+		/* a block shared with other files may be cached already */
+		if (f2fs_dedup_load_cached_block(inode, page, block_nr)) {
+			SetPageUptodate(page);
+			unlock_page(page);
+			goto out;
+		}
 	} else {
 zero_out:
 		zero_user_segment(page, 0, PAGE_SIZE);
@@ -2560,6 +2620,9 @@ bool f2fs_should_update_outplace(struct inode *inode, struct f2fs_io_info *fio)
 		return true;
 
 	if (fio) {
+		/* the block is other files' data too */
+		if (f2fs_dedup_block_shared(sbi, fio->old_blkaddr))
+			return true;
 		if (page_private_gcing(fio->page))
 			return true;
 		if (page_private_dummy(fio->page))
@@ -2605,9 +2668,12 @@ int f2fs_do_write_data_page(struct f2fs_io_info *fio)
 						DATA_GENERIC_ENHANCE))
 			return -EFSCORRUPTED;
 
-		ipu_force = true;
-		fio->need_lock = LOCK_DONE;
-		goto got_it;
+		/* a shared block goes out of place, as decided below */
+		if (!f2fs_dedup_block_shared(fio->sbi, fio->old_blkaddr)) {
+			ipu_force = true;
+			fio->need_lock = LOCK_DONE;
+			goto got_it;
+		}
 	}
 
 	/* Deadlock due to between page->lock and f2fs_lock_op */
@@ -2707,7 +2773,9 @@ int f2fs_write_single_data_page(struct page *page, int *submitted,
 				struct writeback_control *wbc,
 				enum iostat_type io_type,
 				int compr_blocks,
-				bool allow_balance)
+				bool allow_balance,
+				const u8 *dedup_fp,
+				bool dedup_noshare)
 {
 	struct inode *inode = page->mapping->host;
 	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
@@ -2729,6 +2797,8 @@ int f2fs_write_single_data_page(struct page *page, int *submitted,
 		.encrypted_page = NULL,
 		.submitted = false,
 		.compr_blocks = compr_blocks,
+		.dedup_fp = dedup_fp,
+		.dedup_noshare = dedup_noshare,
 		.need_lock = LOCK_RETRY,
 		.io_type = io_type,
 		.io_wbc = wbc,
@@ -2887,7 +2957,84 @@ out:
 #endif
 
 	return f2fs_write_single_data_page(page, NULL, NULL, NULL,
-						wbc, FS_DATA_IO, 0, true);
+					wbc, FS_DATA_IO, 0, true, NULL, false);
+}
+
+/*
+ * Write out the pages gathered by f2fs_write_cache_pages(), which are
+ * locked and cleared for io, once their fingerprints are computed in one
+ * go.  On failure, the pages left are redirtied, and the error is returned
+ * with @done_index past the page which failed.
+ */
+static int f2fs_write_dedup_batch(struct address_space *mapping,
+				struct f2fs_dedup_batch *batch,
+				int *nwritten, struct bio **bio,
+				sector_t *last_block,
+				struct writeback_control *wbc,
+				enum iostat_type io_type, pgoff_t *done_index)
+{
+	struct inode *inode = mapping->host;
+	struct page *page;
+	int submitted;
+	unsigned int i;
+	int ret = 0;
+
+	f2fs_dedup_hash_batch(F2FS_I_SB(inode), batch);
+
+	for (i = 0; i < batch->nr; i++) {
+		const u8 *fp = batch->hashed[i] ? batch->digests[i] : NULL;
+		bool noshare = batch->noshare[i];
+
+		page = batch->pages[i];
+		if (ret) {
+			redirty_page_for_writepage(wbc, page);
+			unlock_page(page);
+			continue;
+		}
+retry_write:
+		submitted = 0;
+		ret = f2fs_write_single_data_page(page, &submitted,
+					bio, last_block, wbc, io_type,
+					0, false, fp, noshare);
+		*nwritten += submitted;
+		wbc->nr_to_write -= submitted;
+
+		if (ret == AOP_WRITEPAGE_ACTIVATE) {
+			unlock_page(page);
+			ret = 0;
+		} else if (ret == -EAGAIN) {
+			ret = 0;
+			if (wbc->sync_mode != WB_SYNC_ALL)
+				continue;
+
+			/* the page was redirtied and unlocked, take it again */
+			f2fs_io_schedule_timeout(DEFAULT_IO_TIMEOUT);
+			lock_page(page);
+			if (unlikely(page->mapping != mapping) ||
+					!PageDirty(page)) {
+				unlock_page(page);
+				continue;
+			}
+			f2fs_wait_on_page_writeback(page, DATA, true, true);
+			if (!clear_page_dirty_for_io(page)) {
+				unlock_page(page);
+				continue;
+			}
+			/* the data may have changed meanwhile */
+			fp = NULL;
+			noshare = false;
+			goto retry_write;
+		} else if (ret) {
+			*done_index = page->index + 1;
+		}
+	}
+	batch->nr = 0;
+
+	/* balance once all the pages are unlocked, not with some still held */
+	if (!S_ISDIR(inode->i_mode) && !IS_NOQUOTA(inode) &&
+			!F2FS_I(inode)->cp_task)
+		f2fs_balance_fs(F2FS_I_SB(inode), !wbc->for_reclaim);
+	return ret;
 }
 
 /*
@@ -2930,10 +3077,19 @@ static int f2fs_write_cache_pages(struct address_space *mapping,
 	xa_mark_t tag;
 	int nwritten = 0;
 	int submitted = 0;
+	struct f2fs_dedup_batch *batch = NULL;
 	int i;
 
 	pagevec_init(&pvec);
 
+	/* fingerprint the pages of a pagevec together, not one by one */
+	if (io_type == FS_DATA_IO && f2fs_dedup_inline(sbi) &&
+			f2fs_dedup_file(mapping->host) &&
+			!READ_ONCE(F2FS_I(mapping->host)->i_dedup_skip) &&
+			!f2fs_compressed_file(mapping->host) &&
+			!f2fs_has_inline_data(mapping->host))
+		batch = f2fs_dedup_alloc_batch(sbi);
+
 	if (get_dirty_pages(mapping->host) <=
 				SM_I(F2FS_M_SB(mapping))->min_hot_blocks)
 		set_inode_flag(mapping->host, FI_HOT_DATA);
@@ -3055,9 +3211,14 @@ continue_unlock:
 				continue;
 			}
 #endif
+			if (batch) {
+				batch->pages[batch->nr++] = page;
+				continue;
+			}
+
 			ret = f2fs_write_single_data_page(page, &submitted,
 					&bio, &last_block, wbc, io_type,
-					0, true);
+					0, true, NULL, false);
 			if (ret == AOP_WRITEPAGE_ACTIVATE)
 				unlock_page(page);
 #ifdef CONFIG_F2FS_FS_COMPRESSION
@@ -3097,6 +3258,20 @@ next:
 			if (need_readd)
 				goto readd;
 		}
+		if (batch && batch->nr) {
+			int err = f2fs_write_dedup_batch(mapping, batch, &nwritten,
+					&bio, &last_block, wbc, io_type,
+					&done_index);
+
+			if (err) {
+				if (!ret)
+					ret = err;
+				done = 1;
+			} else if (wbc->nr_to_write <= 0 &&
+					wbc->sync_mode == WB_SYNC_NONE) {
+				done = 1;
+			}
+		}
 		pagevec_release(&pvec);
 		cond_resched();
 	}
@@ -3119,6 +3294,7 @@ next:
 		end = -1;
 		goto retry;
 	}
+	f2fs_dedup_free_batch(batch);
 	if (wbc->range_cyclic && !done)
 		done_index = 0;
 	if (wbc->range_cyclic || (range_whole && wbc->nr_to_write > 0))
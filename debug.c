@@ -19,6 +19,7 @@
 #include "node.h"
 #include "segment.h"
 #include "gc.h"
+#include "dedup.h"
 
 static LIST_HEAD(f2fs_stat_list);
 static DEFINE_RAW_SPINLOCK(f2fs_stat_lock);
@@ -164,6 +165,26 @@ static void update_general_status(struct f2fs_sb_info *sbi)
 	si->alloc_nids = NM_I(sbi)->nid_cnt[PREALLOC_NID];
 	si->io_skip_bggc = sbi->io_skip_bggc;
 	si->other_skip_bggc = sbi->other_skip_bggc;
+	si->dedup_enabled = f2fs_dedup_enabled(sbi);
+	if (si->dedup_enabled) {
+		struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+		struct dedup_table *ft = &dm->tables[DEDUP_FP_TABLE];
+		struct dedup_table *rt = &dm->tables[DEDUP_REF_TABLE];
+
+		for (i = 0; i < NR_DEDUP_STATS; i++)
+			si->dedup_stat[i] = f2fs_dedup_stat(sbi, i);
+		si->dedup_saved_blks = f2fs_dedup_ref_histogram(sbi,
+							si->dedup_refs);
+		si->dedup_fp_entries = atomic_read(&ft->nr_entries);
+		si->dedup_fp_slots = READ_ONCE(ft->nr_pages) *
+					DEDUP_BUCKETS_PER_BLOCK * ft->slots;
+		si->dedup_ref_entries = atomic_read(&rt->nr_entries);
+		si->dedup_ref_slots = READ_ONCE(rt->nr_pages) *
+					DEDUP_BUCKETS_PER_BLOCK * rt->slots;
+		si->dedup_fp_pages = READ_ONCE(ft->nr_pages);
+		si->dedup_fp_evicted = atomic_read(&dm->fp_evicted);
+		si->dedup_fp_unread = atomic_read(&dm->fp_nr_unread);
+	}
 	si->util_free = (int)(free_user_blocks(sbi) >> sbi->log_blocks_per_seg)
 		* 100 / (int)(sbi->user_block_count >> sbi->log_blocks_per_seg)
 		/ 2;
@@ -497,6 +518,64 @@ static int stat_show(struct seq_file *s, void *v)
 				si->hit_total, si->total_ext);
 		seq_printf(s, "  - Inner Struct Count: tree: %d(%d), node: %d\n",
 				si->ext_tree, si->zombie_tree, si->ext_node);
+		if (si->dedup_enabled) {
+			unsigned long long *ds = si->dedup_stat;
+
+			seq_puts(s, "\nDedup:\n");
+			seq_printf(s, "  - FP Lookup: %llu, Hit: %llu, Miss: %llu, Hit Ratio: %llu%%\n",
+				ds[DEDUP_STAT_LOOKUP], ds[DEDUP_STAT_HIT],
+				ds[DEDUP_STAT_LOOKUP] - ds[DEDUP_STAT_HIT],
+				!ds[DEDUP_STAT_LOOKUP] ? 0 :
+				div64_u64(ds[DEDUP_STAT_HIT] * 100,
+						ds[DEDUP_STAT_LOOKUP]));
+			seq_printf(s, "  - Avg. Probe: %llu.%02llu buckets\n",
+				!ds[DEDUP_STAT_LOOKUP] ? 0 :
+				div64_u64(ds[DEDUP_STAT_PROBE],
+						ds[DEDUP_STAT_LOOKUP]),
+				!ds[DEDUP_STAT_LOOKUP] ? 0 :
+				div64_u64(ds[DEDUP_STAT_PROBE] * 100,
+					ds[DEDUP_STAT_LOOKUP]) % 100);
+			seq_printf(s, "  - Confirm: %llu, Collision: %llu, Clusters: %llu, Cloned: %llu, GC merged: %llu\n",
+				ds[DEDUP_STAT_CONFIRM],
+				ds[DEDUP_STAT_COLLISION],
+				ds[DEDUP_STAT_CLUSTER],
+				ds[DEDUP_STAT_CLONED],
+				ds[DEDUP_STAT_GC_MERGED]);
+			seq_printf(s, "  - Shared: %llu, Zero: %llu, Pattern: %llu, Bypass: %llu, Unshared: %llu, Saved: %llu blocks (%llu MB)\n",
+				ds[DEDUP_STAT_SHARED], ds[DEDUP_STAT_ZERO],
+				ds[DEDUP_STAT_PATTERN],
+				ds[DEDUP_STAT_BYPASS], ds[DEDUP_STAT_UNSHARED],
+				si->dedup_saved_blks,
+				si->dedup_saved_blks >>
+					(20 - F2FS_BLKSIZE_BITS));
+			seq_printf(s, "  - Refcount: 1: %llu, 2: %llu, 3-4: %llu, 5-8: %llu, 9-16: %llu, 17+: %llu\n",
+				si->dedup_refs[0], si->dedup_refs[1],
+				si->dedup_refs[2], si->dedup_refs[3],
+				si->dedup_refs[4], si->dedup_refs[5]);
+			seq_printf(s, "  - Load: FP: %u%% (%u / %u), REF: %u%% (%u / %u)\n",
+				!si->dedup_fp_slots ? 0 :
+				si->dedup_fp_entries * 100ULL /
+						si->dedup_fp_slots,
+				si->dedup_fp_entries, si->dedup_fp_slots,
+				!si->dedup_ref_slots ? 0 :
+				si->dedup_ref_entries * 100ULL /
+						si->dedup_ref_slots,
+				si->dedup_ref_entries, si->dedup_ref_slots);
+			seq_printf(s, "  - FP Pages: %u (Evicted: %u, Unread: %u), Filtered: %llu misses\n",
+				si->dedup_fp_pages, si->dedup_fp_evicted,
+				si->dedup_fp_unread,
+				ds[DEDUP_STAT_FILTERED]);
+			seq_printf(s, "  - Hash: %llu blocks, avg. %llu ns\n",
+				ds[DEDUP_STAT_HASH],
+				!ds[DEDUP_STAT_HASH] ? 0 :
+				div64_u64(ds[DEDUP_STAT_HASH_NS],
+						ds[DEDUP_STAT_HASH]));
+			seq_printf(s, "  - Flush: %llu times, %llu blocks, avg. %llu us\n",
+				ds[DEDUP_STAT_FLUSH], ds[DEDUP_STAT_FLUSH_BLK],
+				!ds[DEDUP_STAT_FLUSH] ? 0 :
+				div64_u64(ds[DEDUP_STAT_FLUSH_NS],
+					ds[DEDUP_STAT_FLUSH] * NSEC_PER_USEC));
+		}
 		seq_puts(s, "\nBalancing F2FS Async:\n");
 		seq_printf(s, "  - DIO (R: %4d, W: %4d)\n",
 			   si->nr_dio_read, si->nr_dio_write);
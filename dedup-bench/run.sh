@@ -0,0 +1,105 @@
+#!/bin/bash
+# SPDX-License-Identifier: GPL-2.0
+#
+# Write throughput, latency and space saved of f2fs dedup, over a range of
+# duplicate ratios, with mount time of the resulting volume and a check
+# that a reflinked file survives an O_DIRECT overwrite of its clone.
+#
+# usage: run.sh <device> <mountpoint> [mount options]
+#
+# The device is reformatted.  Needs fio and jq; debugfs on
+# /sys/kernel/debug for the dedup counters.
+
+set -eu
+
+DEV=${1:?device}
+MNT=${2:?mountpoint}
+OPTS=${3:-dedup=inline,dedup_hash=sha256}
+
+JOB=$(dirname "$0")/dedup.fio
+RATIOS=${RATIOS:-"0 25 50 75 90"}
+export SIZE=${SIZE:-1g}
+export BSSPLIT=${BSSPLIT:-4k/60:16k/30:64k/10}
+export DIR=$MNT
+
+status() {
+	grep -A12 '^Dedup:' /sys/kernel/debug/f2fs/status || true
+}
+
+saved_blocks() {
+	status | sed -n 's/.*Saved: \([0-9]*\) blocks.*/\1/p' | head -1
+}
+
+used_kb() {
+	df -k --output=used "$MNT" | tail -1
+}
+
+fresh_mount() {
+	umount "$MNT" 2>/dev/null || true
+	mkfs.f2fs -f -q "$DEV"
+	mount -t f2fs -o "$OPTS" "$DEV" "$MNT"
+}
+
+# bandwidth, iops and write or read latency percentiles of a job, in json
+run_job() {
+	local out
+	out=$(fio --section="$1" --output-format=json "$JOB")
+	echo "$out" | jq -r --arg job "$1" --arg ratio "$DEDUP_PCT" '
+		.jobs[0] as $j |
+		(if $j.write.io_bytes > 0 then $j.write else $j.read end) as $io |
+		[$job, $ratio, ($io.bw / 1024 | floor), ($io.iops | floor),
+		 ($io.clat_ns.percentile["50.000000"] / 1000 | floor),
+		 ($io.clat_ns.percentile["99.000000"] / 1000 | floor),
+		 ($io.clat_ns.percentile["99.900000"] / 1000 | floor)] | @tsv'
+}
+
+# mount time is dominated by reading the dedup index back
+mount_time() {
+	local start end
+
+	umount "$MNT"
+	sync
+	echo 3 > /proc/sys/vm/drop_caches
+	start=$(date +%s%N)
+	mount -t f2fs -o "$OPTS" "$DEV" "$MNT"
+	end=$(date +%s%N)
+	echo $(((end - start) / 1000000))
+}
+
+printf "job\tdup%%\tMB/s\tiops\tp50us\tp99us\tp99.9us\n"
+for ratio in $RATIOS; do
+	export DEDUP_PCT=$ratio
+	fresh_mount
+	before=$(used_kb)
+	for job in seqwrite randwrite zero pattern; do
+		run_job $job
+	done
+	sync
+	after=$(used_kb)
+	ms=$(mount_time)
+	run_job seqread
+	echo "# dup $ratio%: used $(((after - before) / 1024)) MB," \
+		"saved $(saved_blocks) blocks, mount $ms ms"
+done
+status
+
+# a clone shares every block of its source; overwriting the clone with
+# O_DIRECT must leave the source as it was
+fresh_mount
+export DEDUP_PCT=0
+fio --section=seqwrite --output=/dev/null "$JOB"
+sum=$(sha256sum < "$MNT/seqwrite.dat")
+cp --reflink=always "$MNT/seqwrite.dat" "$MNT/clone.dat"
+run_job dio_overwrite
+sync
+echo 3 > /proc/sys/vm/drop_caches
+if [ "$(sha256sum < "$MNT/seqwrite.dat")" != "$sum" ]; then
+	echo "FAIL: source changed by an O_DIRECT overwrite of its clone"
+	exit 1
+fi
+if cmp -s "$MNT/seqwrite.dat" "$MNT/clone.dat"; then
+	echo "FAIL: clone not overwritten"
+	exit 1
+fi
+echo "clone check: ok"
+umount "$MNT"
@@ -0,0 +1,691 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * KUnit tests of the in-memory dedup index: bucket hashing and probing,
+ * growing, page filters and refcounts.  The tables are built on a bare
+ * f2fs_sb_info without a dedup area, so nothing here may read or write
+ * table blocks: no cap is set and no page is evicted unless it is clean.
+ */
+
+#include <kunit/test.h>
+
+#define DEDUP_TEST_MAX_PAGES	64	/* of the fingerprint and ref tables */
+#define DEDUP_TEST_ENTRIES	8192	/* grow the tables up to 64 pages */
+#define DEDUP_TEST_READERS	4
+#define DEDUP_TEST_WRITERS	4
+#define DEDUP_TEST_ROUNDS	4
+
+static const unsigned int dedup_test_slots[NR_DEDUP_TABLES] = {
+	[DEDUP_FP_TABLE]	= DEDUP_FP_SLOTS,
+	[DEDUP_CRYPT_TABLE]	= DEDUP_CRYPT_SLOTS,
+	[DEDUP_REF_TABLE]	= DEDUP_REF_SLOTS,
+	[DEDUP_OWNER_TABLE]	= DEDUP_OWNER_SLOTS,
+};
+
+static const unsigned int dedup_test_max_pages[NR_DEDUP_TABLES] = {
+	[DEDUP_FP_TABLE]	= DEDUP_TEST_MAX_PAGES,
+	[DEDUP_CRYPT_TABLE]	= DEDUP_MIN_TABLE_PAGES,
+	[DEDUP_REF_TABLE]	= DEDUP_TEST_MAX_PAGES,
+	[DEDUP_OWNER_TABLE]	= DEDUP_MIN_TABLE_PAGES,
+};
+
+/* a distinct fingerprint for each @i, homed anywhere */
+static void dedup_test_fp(u8 *fp, u64 i)
+{
+	put_unaligned_le64(i * GOLDEN_RATIO_64, fp);
+	put_unaligned_le64(~i, fp + sizeof(u64));
+}
+
+/* a distinct fingerprint for each @i, all homed at bucket @idx */
+static void dedup_test_fp_at(u8 *fp, unsigned int idx, u64 i)
+{
+	put_unaligned_le64(idx | 0x5aULL << 56, fp);
+	put_unaligned_le64(i, fp + sizeof(u64));
+}
+
+/* the same setup as f2fs_build_dedup_manager(), without the dedup area */
+static int dedup_test_init(struct kunit *test)
+{
+	struct f2fs_sb_info *sbi;
+	struct f2fs_dedup_info *dm;
+	unsigned int nr_pages[NR_DEDUP_TABLES];
+	int i, err;
+
+	sbi = kunit_kzalloc(test, sizeof(struct f2fs_sb_info), GFP_KERNEL);
+	if (!sbi)
+		return -ENOMEM;
+	test->priv = sbi;
+
+	dm = f2fs_kzalloc(sbi, sizeof(struct f2fs_dedup_info), GFP_KERNEL);
+	if (!dm)
+		return -ENOMEM;
+	sbi->dedup_info = dm;
+
+	err = init_dedup_locks(dm);
+	if (err)
+		return err;
+
+	for (i = 0; i < NR_DEDUP_TABLES; i++) {
+		struct dedup_table *t = &dm->tables[i];
+
+		t->slots = dedup_test_slots[i];
+		t->max_pages = dedup_test_max_pages[i];
+		t->start_blk = dm->table_blocks;
+		dm->table_blocks += t->max_pages;
+		nr_pages[i] = DEDUP_MIN_TABLE_PAGES;
+	}
+
+	dm->stats = alloc_percpu(struct f2fs_dedup_stat);
+	dm->dirty_bitmap = f2fs_kvzalloc(sbi,
+			f2fs_bitmap_size(dm->table_blocks), GFP_KERNEL);
+	dm->staged_bitmap = f2fs_kvzalloc(sbi,
+			f2fs_bitmap_size(dm->table_blocks), GFP_KERNEL);
+	dm->fp_accessed = f2fs_kvzalloc(sbi,
+			f2fs_bitmap_size(DEDUP_TEST_MAX_PAGES), GFP_KERNEL);
+	dm->fp_unread = f2fs_kvzalloc(sbi,
+			f2fs_bitmap_size(DEDUP_TEST_MAX_PAGES), GFP_KERNEL);
+	if (!dm->stats || !dm->dirty_bitmap || !dm->staged_bitmap ||
+				!dm->fp_accessed || !dm->fp_unread)
+		return -ENOMEM;
+
+	return init_dedup_tables(sbi, nr_pages, false);
+}
+
+/* also undoes a setup which failed halfway */
+static void dedup_test_exit(struct kunit *test)
+{
+	if (test->priv)
+		f2fs_destroy_dedup_manager(test->priv);
+}
+
+static void dedup_test_buckets(struct kunit *test)
+{
+	struct f2fs_sb_info *sbi = test->priv;
+	struct dedup_page_map *map = dedup_map(
+				&DEDUP_I(sbi)->tables[DEDUP_FP_TABLE]);
+	unsigned int nr = DEDUP_MIN_TABLE_PAGES * DEDUP_BUCKETS_PER_BLOCK;
+	u8 fp[DEDUP_FP_SIZE];
+
+	/* probes never leave the page of their home bucket */
+	KUNIT_EXPECT_EQ(test, dedup_next_bucket(0), 1U);
+	KUNIT_EXPECT_EQ(test, dedup_next_bucket(DEDUP_BUCKETS_PER_BLOCK - 1), 0U);
+	KUNIT_EXPECT_EQ(test, dedup_next_bucket(2 * DEDUP_BUCKETS_PER_BLOCK - 1),
+			DEDUP_BUCKETS_PER_BLOCK);
+	KUNIT_EXPECT_EQ(test, dedup_next_bucket(nr - 1),
+			nr - DEDUP_BUCKETS_PER_BLOCK);
+
+	/* the home bucket takes the low bits, the tag the top ones */
+	KUNIT_EXPECT_EQ(test, dedup_home_bucket(map, nr + 5), 5U);
+	dedup_test_fp_at(fp, 7, 0);
+	KUNIT_EXPECT_EQ(test, dedup_home_bucket(map, dedup_fp_hash(fp)), 7U);
+	KUNIT_EXPECT_EQ(test, dedup_fp_tag(fp), 0xdaU);
+
+	/* an empty slot has tag 0, no fingerprint gets it */
+	memset(fp, 0, sizeof(fp));
+	KUNIT_EXPECT_NE(test, dedup_fp_tag(fp), 0U);
+
+	/* a probe touches a single cache line per bucket */
+	KUNIT_EXPECT_LE(test, sizeof(struct f2fs_dedup_fp_bucket),
+			(size_t)DEDUP_BUCKET_SIZE);
+	KUNIT_EXPECT_LE(test, sizeof(struct f2fs_dedup_ref_bucket),
+			(size_t)DEDUP_BUCKET_SIZE);
+}
+
+static void dedup_test_probe(struct kunit *test)
+{
+	struct f2fs_sb_info *sbi = test->priv;
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct dedup_table *t = &dm->tables[DEDUP_FP_TABLE];
+	struct dedup_page_map *map = dedup_map(t);
+	unsigned int home = DEDUP_BUCKETS_PER_BLOCK - 1;
+	struct f2fs_dedup_fp_bucket *hb = dedup_bucket(map, home);
+	struct f2fs_dedup_fp_bucket *nb = dedup_bucket(map, 0);
+	unsigned int probes, i;
+	u8 fp[DEDUP_FP_SIZE];
+
+	/* the last bucket of a page overflows to the first one */
+	for (i = 0; i <= DEDUP_FP_SLOTS; i++) {
+		dedup_test_fp_at(fp, home, i);
+		KUNIT_ASSERT_EQ(test, __insert_fp(dm, t, map, fp, i), 0);
+	}
+	KUNIT_EXPECT_EQ(test, hb->overflow, 1);
+	KUNIT_EXPECT_EQ(test, nb->overflow, 0);
+	KUNIT_EXPECT_EQ(test, atomic_read(&t->nr_entries), DEDUP_FP_SLOTS + 1);
+	KUNIT_EXPECT_TRUE(test, test_bit(t->start_blk, dm->dirty_bitmap));
+
+	KUNIT_EXPECT_PTR_EQ(test, __lookup_fp(map, home, fp, &probes),
+			&nb->entries[0]);
+	KUNIT_EXPECT_EQ(test, probes, 2U);
+	dedup_test_fp_at(fp, home, 0);
+	KUNIT_EXPECT_PTR_EQ(test, __lookup_fp(map, home, fp, &probes),
+			&hb->entries[0]);
+	KUNIT_EXPECT_EQ(test, probes, 1U);
+
+	/* a miss stops at the first bucket nothing went past */
+	dedup_test_fp_at(fp, home, DEDUP_FP_SLOTS + 1);
+	KUNIT_EXPECT_NULL(test, __lookup_fp(map, home, fp, &probes));
+	KUNIT_EXPECT_EQ(test, probes, 2U);
+
+	/* deleting the overflowed entry shortens the chain again */
+	KUNIT_EXPECT_TRUE(test, __delete_fp_val(dm, t, map, home,
+						DEDUP_FP_SLOTS));
+	KUNIT_EXPECT_EQ(test, hb->overflow, 0);
+	KUNIT_EXPECT_EQ(test, atomic_read(&t->nr_entries), DEDUP_FP_SLOTS);
+	KUNIT_EXPECT_NULL(test, __lookup_fp(map, home, fp, &probes));
+	KUNIT_EXPECT_EQ(test, probes, 1U);
+	KUNIT_EXPECT_FALSE(test, __delete_fp_val(dm, t, map, home,
+						DEDUP_FP_SLOTS));
+
+	/* a freed slot of the home bucket is taken first */
+	KUNIT_EXPECT_TRUE(test, __delete_fp_val(dm, t, map, home, 1));
+	dedup_test_fp_at(fp, home, 100);
+	KUNIT_ASSERT_EQ(test, __insert_fp(dm, t, map, fp, 100), 0);
+	KUNIT_EXPECT_EQ(test, le32_to_cpu(hb->entries[1].val), 100U);
+	KUNIT_EXPECT_EQ(test, hb->overflow, 0);
+}
+
+static void dedup_test_page_full(struct kunit *test)
+{
+	struct f2fs_sb_info *sbi = test->priv;
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct dedup_table *t = &dm->tables[DEDUP_FP_TABLE];
+	struct dedup_page_map *map = dedup_map(t);
+	unsigned int nr = DEDUP_BUCKETS_PER_BLOCK * DEDUP_FP_SLOTS;
+	unsigned int idx, i;
+	u8 fp[DEDUP_FP_SIZE];
+
+	for (i = 0; i < nr; i++) {
+		dedup_test_fp_at(fp, 0, i);
+		KUNIT_ASSERT_EQ(test, __insert_fp(dm, t, map, fp, i), 0);
+	}
+	dedup_test_fp_at(fp, 0, nr);
+	KUNIT_EXPECT_EQ(test, __insert_fp(dm, t, map, fp, nr), -ENOSPC);
+
+	/* the other pages are left alone */
+	for (idx = DEDUP_BUCKETS_PER_BLOCK;
+	     idx < map->nr_pages * DEDUP_BUCKETS_PER_BLOCK; idx++) {
+		struct f2fs_dedup_fp_bucket *b = dedup_bucket(map, idx);
+
+		KUNIT_ASSERT_EQ(test, b->overflow, 0);
+		KUNIT_ASSERT_EQ(test, b->tags[0], 0);
+	}
+	KUNIT_EXPECT_FALSE(test, test_bit(t->start_blk + 1, dm->dirty_bitmap));
+
+	/* every entry is still found, whatever its distance from home */
+	for (i = 0; i < nr; i++) {
+		dedup_test_fp_at(fp, 0, i);
+		KUNIT_ASSERT_NOT_NULL(test, __lookup_fp(map, 0, fp, NULL));
+	}
+}
+
+static void dedup_test_lookup(struct kunit *test)
+{
+	struct f2fs_sb_info *sbi = test->priv;
+	struct dedup_table *t = &DEDUP_I(sbi)->tables[DEDUP_FP_TABLE];
+	unsigned int nr = 256, i;
+	u8 fp[DEDUP_FP_SIZE];
+	u32 val;
+
+	for (i = 0; i < nr; i++) {
+		dedup_test_fp(fp, i);
+		KUNIT_ASSERT_EQ(test, dedup_insert_fp(sbi, t, fp, i + 1), 0);
+	}
+	dedup_test_fp(fp, 0);
+	KUNIT_EXPECT_EQ(test, dedup_insert_fp(sbi, t, fp, 1000), -EEXIST);
+
+	for (i = 0; i < nr; i++) {
+		dedup_test_fp(fp, i);
+		KUNIT_ASSERT_TRUE(test, dedup_lookup_fp(sbi, t, fp, &val));
+		KUNIT_ASSERT_EQ(test, val, i + 1);
+	}
+	for (i = nr; i < 2 * nr; i++) {
+		dedup_test_fp(fp, i);
+		KUNIT_ASSERT_FALSE(test, dedup_lookup_fp(sbi, t, fp, &val));
+	}
+
+	KUNIT_EXPECT_EQ(test, atomic_read(&t->nr_entries), nr);
+	KUNIT_EXPECT_EQ(test, f2fs_dedup_stat(sbi, DEDUP_STAT_LOOKUP), 2ULL * nr);
+	KUNIT_EXPECT_EQ(test, f2fs_dedup_stat(sbi, DEDUP_STAT_HIT), (u64)nr);
+	KUNIT_EXPECT_GE(test, f2fs_dedup_stat(sbi, DEDUP_STAT_PROBE), 2ULL * nr);
+}
+
+static void dedup_test_grow_fp(struct kunit *test)
+{
+	struct f2fs_sb_info *sbi = test->priv;
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct dedup_table *t = &dm->tables[DEDUP_FP_TABLE];
+	unsigned int i;
+	u8 fp[DEDUP_FP_SIZE];
+	u32 val;
+
+	for (i = 0; i < DEDUP_TEST_ENTRIES; i++) {
+		dedup_test_fp(fp, i);
+		KUNIT_ASSERT_EQ(test, dedup_insert_fp(sbi, t, fp, i), 0);
+	}
+	KUNIT_EXPECT_GT(test, t->nr_pages, (unsigned int)DEDUP_MIN_TABLE_PAGES);
+	KUNIT_EXPECT_LE(test, t->nr_pages, t->max_pages);
+	KUNIT_EXPECT_EQ(test, dedup_map(t)->nr_pages, t->nr_pages);
+	KUNIT_EXPECT_EQ(test, atomic_read(&t->nr_entries), DEDUP_TEST_ENTRIES);
+	KUNIT_EXPECT_FALSE(test, dedup_table_loaded(t, t->nr_pages));
+
+	/* every page of the grown table is written at the next checkpoint */
+	for (i = 0; i < t->nr_pages; i++)
+		KUNIT_EXPECT_TRUE(test, test_bit(t->start_blk + i,
+						dm->dirty_bitmap));
+	KUNIT_EXPECT_EQ(test, atomic_read(&dm->fp_evicted), 0);
+	KUNIT_EXPECT_EQ(test, find_first_bit(dm->staged_bitmap,
+				dm->table_blocks), (unsigned long)dm->table_blocks);
+
+	for (i = 0; i < DEDUP_TEST_ENTRIES; i++) {
+		dedup_test_fp(fp, i);
+		KUNIT_ASSERT_TRUE(test, dedup_lookup_fp(sbi, t, fp, &val));
+		KUNIT_ASSERT_EQ(test, val, i);
+	}
+
+	/* a table grown to its reserved size refuses to grow any more */
+	while (t->nr_pages < t->max_pages)
+		KUNIT_ASSERT_EQ(test, grow_dedup_table(sbi, t, t->nr_pages), 0);
+	KUNIT_EXPECT_EQ(test, grow_dedup_table(sbi, t, t->nr_pages), -ENOSPC);
+	KUNIT_EXPECT_EQ(test, atomic_read(&t->nr_entries), DEDUP_TEST_ENTRIES);
+	for (i = 0; i < DEDUP_TEST_ENTRIES; i++) {
+		dedup_test_fp(fp, i);
+		KUNIT_ASSERT_TRUE(test, dedup_lookup_fp(sbi, t, fp, &val));
+	}
+}
+
+static void dedup_test_grow_ref(struct kunit *test)
+{
+	struct f2fs_sb_info *sbi = test->priv;
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct dedup_table *rt = &dm->tables[DEDUP_REF_TABLE];
+	unsigned int i;
+
+	for (i = 1; i <= DEDUP_TEST_ENTRIES; i++)
+		dedup_insert_ref(sbi, i, i);
+	KUNIT_EXPECT_GT(test, rt->nr_pages, (unsigned int)DEDUP_MIN_TABLE_PAGES);
+	KUNIT_EXPECT_EQ(test, atomic_read(&rt->nr_entries), DEDUP_TEST_ENTRIES);
+
+	for (i = 1; i <= DEDUP_TEST_ENTRIES; i++)
+		KUNIT_ASSERT_EQ(test, dedup_lookup_ref(rt, i), 1U);
+	KUNIT_EXPECT_EQ(test, dedup_lookup_ref(rt, DEDUP_TEST_ENTRIES + 1), 0U);
+	KUNIT_EXPECT_EQ(test, dedup_lookup_ref(rt, NULL_ADDR), 0U);
+}
+
+static void dedup_test_filter(struct kunit *test)
+{
+	struct f2fs_sb_info *sbi = test->priv;
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct dedup_table *t = &dm->tables[DEDUP_FP_TABLE];
+	struct dedup_page_map *map;
+	unsigned int nr = 2048, miss = 0, pg, i;
+	u8 fp[DEDUP_FP_SIZE];
+	u32 val;
+
+	for (i = 0; i < nr; i++) {
+		dedup_test_fp(fp, i);
+		KUNIT_ASSERT_EQ(test, dedup_insert_fp(sbi, t, fp, i), 0);
+	}
+	map = dedup_map(t);
+
+	/* no false negatives, few false positives */
+	for (pg = 0; pg < map->nr_pages; pg++)
+		dedup_build_filter(map, pg, map->pages[pg]);
+	for (i = 0; i < nr; i++) {
+		dedup_test_fp(fp, i);
+		pg = dedup_home_bucket(map, dedup_fp_hash(fp)) /
+						DEDUP_BUCKETS_PER_BLOCK;
+		KUNIT_ASSERT_TRUE(test, dedup_filter_may_hold(dm, map, pg, fp));
+	}
+	for (i = nr; i < 11 * nr; i++) {
+		dedup_test_fp(fp, i);
+		pg = dedup_home_bucket(map, dedup_fp_hash(fp)) /
+						DEDUP_BUCKETS_PER_BLOCK;
+		if (!dedup_filter_may_hold(dm, map, pg, fp))
+			miss++;
+	}
+	kunit_info(test, "filter false positives: %u of %u\n",
+					10 * nr - miss, 10 * nr);
+	KUNIT_EXPECT_GE(test, miss, 10 * nr * 95 / 100);
+
+	/* a page not read yet has no filter to tell */
+	set_bit(0, dm->fp_unread);
+	dedup_test_fp_at(fp, 0, U64_MAX);
+	KUNIT_EXPECT_TRUE(test, dedup_filter_may_hold(dm, map, 0, fp));
+	clear_bit(0, dm->fp_unread);
+
+	/*
+	 * Once clean, every page can be evicted, and misses are then told
+	 * by their filter without reading the page back.
+	 */
+	bitmap_clear(dm->dirty_bitmap, t->start_blk, map->nr_pages);
+	dm->enabled = true;
+	KUNIT_EXPECT_EQ(test, f2fs_dedup_shrink(sbi, map->nr_pages),
+					(unsigned long)map->nr_pages);
+	dm->enabled = false;
+	KUNIT_EXPECT_EQ(test, atomic_read(&dm->fp_evicted), map->nr_pages);
+	for (pg = 0; pg < map->nr_pages; pg++)
+		KUNIT_ASSERT_PTR_EQ(test, map->pages[pg], (void *)dedup_evicted);
+
+	for (i = nr; i < 2 * nr; i++) {
+		dedup_test_fp(fp, i);
+		pg = dedup_home_bucket(map, dedup_fp_hash(fp)) /
+						DEDUP_BUCKETS_PER_BLOCK;
+		if (dedup_filter_may_hold(dm, map, pg, fp))
+			continue;
+		KUNIT_ASSERT_FALSE(test, dedup_lookup_fp(sbi, t, fp, &val));
+	}
+	KUNIT_EXPECT_GT(test, f2fs_dedup_stat(sbi, DEDUP_STAT_FILTERED), 0ULL);
+	KUNIT_EXPECT_EQ(test, atomic_read(&dm->fp_evicted), map->nr_pages);
+}
+
+static void dedup_test_refcount(struct kunit *test)
+{
+	struct f2fs_sb_info *sbi = test->priv;
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct dedup_table *rt = &dm->tables[DEDUP_REF_TABLE];
+	unsigned long long hist[DEDUP_REF_HIST_SIZE];
+	unsigned int nr = 100, i;
+
+	for (i = 1; i <= nr; i++)
+		dedup_insert_ref(sbi, i, i);
+	KUNIT_EXPECT_EQ(test, f2fs_dedup_ref_histogram(sbi, hist), 0ULL);
+	KUNIT_EXPECT_EQ(test, hist[0], (unsigned long long)nr);
+
+	/* as sharing accounts it: one block gets to 3 references, one to 1000 */
+	dedup_ref_stat(dm, 1, 2);
+	dedup_ref_stat(dm, 2, 3);
+	dedup_ref_stat(dm, 1, 1000);
+	KUNIT_EXPECT_EQ(test, f2fs_dedup_ref_histogram(sbi, hist), 2ULL + 999);
+	KUNIT_EXPECT_EQ(test, hist[0], (unsigned long long)nr - 2);
+	KUNIT_EXPECT_EQ(test, hist[2], 1ULL);
+	KUNIT_EXPECT_EQ(test, hist[DEDUP_REF_HIST_SIZE - 1], 1ULL);
+
+	/* an address indexed in an earlier life starts over at 1 */
+	dedup_insert_ref(sbi, 1, 12345);
+	KUNIT_EXPECT_EQ(test, dedup_lookup_ref(rt, 1), 1U);
+	KUNIT_EXPECT_EQ(test, atomic_read(&rt->nr_entries), nr);
+
+	/* the last reference dropped leaves no trace in the histogram */
+	dedup_ref_stat(dm, 3, 1);
+	dedup_ref_stat(dm, 1000, 0);
+	KUNIT_EXPECT_EQ(test, f2fs_dedup_ref_histogram(sbi, hist), 0ULL);
+	KUNIT_EXPECT_EQ(test, hist[0], (unsigned long long)nr - 1);
+	for (i = 1; i < DEDUP_REF_HIST_SIZE; i++)
+		KUNIT_EXPECT_EQ(test, hist[i], 0ULL);
+
+	KUNIT_EXPECT_EQ(test, dedup_ref_hist(1), 0U);
+	KUNIT_EXPECT_EQ(test, dedup_ref_hist(2), 1U);
+	KUNIT_EXPECT_EQ(test, dedup_ref_hist(3), 2U);
+	KUNIT_EXPECT_EQ(test, dedup_ref_hist(U32_MAX),
+			(unsigned int)DEDUP_REF_HIST_SIZE - 1);
+}
+
+struct dedup_test_reader {
+	struct f2fs_sb_info *sbi;
+	unsigned int nr;		/* fingerprints 0..nr-1 are indexed */
+	atomic_t missed;
+	unsigned long lookups;
+};
+
+static int dedup_test_reader_fn(void *data)
+{
+	struct dedup_test_reader *r = data;
+	struct dedup_table *t = &DEDUP_I(r->sbi)->tables[DEDUP_FP_TABLE];
+	u8 fp[DEDUP_FP_SIZE];
+	unsigned int i;
+	u32 val;
+
+	while (!kthread_should_stop()) {
+		for (i = 0; i < r->nr; i++) {
+			dedup_test_fp(fp, i);
+			if (!dedup_lookup_fp(r->sbi, t, fp, &val) || val != i)
+				atomic_inc(&r->missed);
+		}
+		r->lookups += r->nr;
+		cond_resched();
+	}
+	return 0;
+}
+
+/* lockless lookups keep finding every entry while the table grows */
+static void dedup_test_concurrent(struct kunit *test)
+{
+	struct f2fs_sb_info *sbi = test->priv;
+	struct dedup_table *t = &DEDUP_I(sbi)->tables[DEDUP_FP_TABLE];
+	struct task_struct *tasks[DEDUP_TEST_READERS];
+	struct dedup_test_reader *r;
+	unsigned int nr = 512, i;
+	u8 fp[DEDUP_FP_SIZE];
+
+	r = kunit_kzalloc(test, sizeof(*r) * DEDUP_TEST_READERS, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, r);
+
+	for (i = 0; i < nr; i++) {
+		dedup_test_fp(fp, i);
+		KUNIT_ASSERT_EQ(test, dedup_insert_fp(sbi, t, fp, i), 0);
+	}
+
+	for (i = 0; i < DEDUP_TEST_READERS; i++) {
+		r[i].sbi = sbi;
+		r[i].nr = nr;
+		atomic_set(&r[i].missed, 0);
+		tasks[i] = kthread_run(dedup_test_reader_fn, &r[i],
+						"dedup_test/%u", i);
+		if (IS_ERR(tasks[i])) {
+			while (i--)
+				kthread_stop(tasks[i]);
+			KUNIT_FAIL(test, "no reader thread");
+			return;
+		}
+	}
+
+	for (i = nr; i < DEDUP_TEST_ENTRIES; i++) {
+		dedup_test_fp(fp, i);
+		if (dedup_insert_fp(sbi, t, fp, i))
+			break;
+	}
+
+	for (i = 0; i < DEDUP_TEST_READERS; i++) {
+		kthread_stop(tasks[i]);
+		KUNIT_EXPECT_EQ(test, atomic_read(&r[i].missed), 0);
+		kunit_info(test, "reader %u: %lu lookups\n", i, r[i].lookups);
+	}
+	KUNIT_EXPECT_EQ(test, atomic_read(&t->nr_entries), DEDUP_TEST_ENTRIES);
+	KUNIT_EXPECT_GT(test, t->nr_pages, (unsigned int)DEDUP_MIN_TABLE_PAGES);
+}
+
+/* drop the fingerprint of @i under its stripe, as a last reference does */
+static bool dedup_test_delete_fp(struct f2fs_sb_info *sbi, u64 i)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct dedup_table *t = &dm->tables[DEDUP_FP_TABLE];
+	struct dedup_page_map *map;
+	u32 hash;
+	unsigned int idx;
+	bool found = false;
+	u8 fp[DEDUP_FP_SIZE];
+
+	dedup_test_fp(fp, i);
+	hash = (u32)dedup_fp_hash(fp);
+
+	percpu_down_read(&t->resize_sem);
+	map = dedup_map(t);
+	idx = dedup_home_bucket(map, hash);
+	if (!dedup_lock_fp(sbi, t, map, idx)) {
+		found = __delete_fp_val(dm, t, map, hash, i);
+		dedup_stripe_unlock(dedup_stripe(t, idx));
+	}
+	dedup_table_put(t);
+	return found;
+}
+
+struct dedup_test_writer {
+	struct work_struct work;
+	struct f2fs_sb_info *sbi;
+	unsigned int id;
+	int err;
+};
+
+/*
+ * Writer @id owns the fingerprints i with i % DEDUP_TEST_WRITERS == id,
+ * which home all over the table.  Each round inserts them all and drops
+ * every other one again, so inserts, deletes and grows of all writers
+ * race on the same stripes and pages.
+ */
+static void dedup_test_writer_fn(struct work_struct *work)
+{
+	struct dedup_test_writer *w = container_of(work,
+					struct dedup_test_writer, work);
+	struct dedup_table *t = &DEDUP_I(w->sbi)->tables[DEDUP_FP_TABLE];
+	unsigned int round, i;
+	u8 fp[DEDUP_FP_SIZE];
+	int err;
+
+	for (round = 0; round < DEDUP_TEST_ROUNDS; round++) {
+		for (i = w->id; i < DEDUP_TEST_ENTRIES;
+					i += DEDUP_TEST_WRITERS) {
+			dedup_test_fp(fp, i);
+			err = dedup_insert_fp(w->sbi, t, fp, i);
+			/* the half kept by the last round is there already */
+			if (err && (err != -EEXIST || !round)) {
+				w->err = err;
+				return;
+			}
+		}
+		for (i = w->id + DEDUP_TEST_WRITERS; i < DEDUP_TEST_ENTRIES;
+					i += 2 * DEDUP_TEST_WRITERS) {
+			if (!dedup_test_delete_fp(w->sbi, i)) {
+				w->err = -ENOENT;
+				return;
+			}
+		}
+		cond_resched();
+	}
+}
+
+/* writers inserting and deleting at once leave consistent chains behind */
+static void dedup_test_writers(struct kunit *test)
+{
+	struct f2fs_sb_info *sbi = test->priv;
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct dedup_table *t = &dm->tables[DEDUP_FP_TABLE];
+	struct dedup_test_writer *w;
+	struct dedup_page_map *map;
+	unsigned int idx, i;
+	u8 fp[DEDUP_FP_SIZE];
+	u32 val;
+
+	w = kunit_kzalloc(test, sizeof(*w) * DEDUP_TEST_WRITERS, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, w);
+
+	for (i = 0; i < DEDUP_TEST_WRITERS; i++) {
+		INIT_WORK(&w[i].work, dedup_test_writer_fn);
+		w[i].sbi = sbi;
+		w[i].id = i;
+		queue_work(system_unbound_wq, &w[i].work);
+	}
+	for (i = 0; i < DEDUP_TEST_WRITERS; i++) {
+		flush_work(&w[i].work);
+		KUNIT_EXPECT_EQ(test, w[i].err, 0);
+	}
+	KUNIT_EXPECT_GT(test, t->nr_pages, (unsigned int)DEDUP_MIN_TABLE_PAGES);
+
+	/* what every writer kept is found, what it dropped is gone */
+	for (i = 0; i < DEDUP_TEST_ENTRIES; i++) {
+		bool kept = !((i / DEDUP_TEST_WRITERS) & 1);
+
+		dedup_test_fp(fp, i);
+		KUNIT_ASSERT_EQ(test, dedup_lookup_fp(sbi, t, fp, &val), kept);
+		if (kept)
+			KUNIT_ASSERT_EQ(test, val, i);
+	}
+	KUNIT_EXPECT_EQ(test, atomic_read(&t->nr_entries),
+					DEDUP_TEST_ENTRIES / 2);
+
+	/* once all is dropped, no overflow count is left over */
+	for (i = 0; i < DEDUP_TEST_ENTRIES; i += DEDUP_TEST_WRITERS * 2) {
+		unsigned int j;
+
+		for (j = i; j < i + DEDUP_TEST_WRITERS; j++)
+			KUNIT_ASSERT_TRUE(test, dedup_test_delete_fp(sbi, j));
+	}
+	KUNIT_EXPECT_EQ(test, atomic_read(&t->nr_entries), 0);
+	map = dedup_map(t);
+	for (idx = 0; idx < map->nr_pages * DEDUP_BUCKETS_PER_BLOCK; idx++) {
+		struct f2fs_dedup_fp_bucket *b = dedup_bucket(map, idx);
+
+		KUNIT_ASSERT_EQ(test, b->overflow, 0);
+		for (i = 0; i < DEDUP_FP_SLOTS; i++)
+			KUNIT_ASSERT_EQ(test, b->tags[i], 0);
+	}
+}
+
+/* not a pass/fail test: the cost of the index operations, for the log */
+static void dedup_test_bench(struct kunit *test)
+{
+	struct f2fs_sb_info *sbi = test->priv;
+	struct dedup_table *t = &DEDUP_I(sbi)->tables[DEDUP_FP_TABLE];
+	struct dedup_table *rt = &DEDUP_I(sbi)->tables[DEDUP_REF_TABLE];
+	unsigned int nr = DEDUP_TEST_ENTRIES, i;
+	u64 insert, hit, miss, ref;
+	u8 fp[DEDUP_FP_SIZE];
+	u32 val;
+
+	insert = ktime_get_ns();
+	for (i = 0; i < nr; i++) {
+		dedup_test_fp(fp, i);
+		KUNIT_ASSERT_EQ(test, dedup_insert_fp(sbi, t, fp, i), 0);
+	}
+	insert = ktime_get_ns() - insert;
+
+	hit = ktime_get_ns();
+	for (i = 0; i < nr; i++) {
+		dedup_test_fp(fp, i);
+		KUNIT_ASSERT_TRUE(test, dedup_lookup_fp(sbi, t, fp, &val));
+	}
+	hit = ktime_get_ns() - hit;
+
+	miss = ktime_get_ns();
+	for (i = nr; i < 2 * nr; i++) {
+		dedup_test_fp(fp, i);
+		KUNIT_ASSERT_FALSE(test, dedup_lookup_fp(sbi, t, fp, &val));
+	}
+	miss = ktime_get_ns() - miss;
+
+	for (i = 1; i <= nr; i++)
+		dedup_insert_ref(sbi, i, i);
+	ref = ktime_get_ns();
+	for (i = 1; i <= nr; i++)
+		KUNIT_ASSERT_EQ(test, dedup_lookup_ref(rt, i), 1U);
+	ref = ktime_get_ns() - ref;
+
+	kunit_info(test, "%u entries in %u pages, %llu probes per lookup\n",
+			nr, t->nr_pages, div_u64(f2fs_dedup_stat(sbi,
+				DEDUP_STAT_PROBE), 2 * nr));
+	kunit_info(test, "ns/op: insert %llu (with grows), hit %llu, miss %llu, ref %llu\n",
+			div_u64(insert, nr), div_u64(hit, nr),
+			div_u64(miss, nr), div_u64(ref, nr));
+}
+
+static struct kunit_case dedup_test_cases[] = {
+	KUNIT_CASE(dedup_test_buckets),
+	KUNIT_CASE(dedup_test_probe),
+	KUNIT_CASE(dedup_test_page_full),
+	KUNIT_CASE(dedup_test_lookup),
+	KUNIT_CASE(dedup_test_grow_fp),
+	KUNIT_CASE(dedup_test_grow_ref),
+	KUNIT_CASE(dedup_test_filter),
+	KUNIT_CASE(dedup_test_refcount),
+	KUNIT_CASE(dedup_test_concurrent),
+	KUNIT_CASE(dedup_test_writers),
+	KUNIT_CASE(dedup_test_bench),
+	{}
+};
+
+static struct kunit_suite dedup_test_suite = {
+	.name = "f2fs_dedup",
+	.init = dedup_test_init,
+	.exit = dedup_test_exit,
+	.test_cases = dedup_test_cases,
+};
+
+kunit_test_suites(&dedup_test_suite);
@@ -0,0 +1,4136 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * fs/f2fs/dedup.c
+ *
+ * Block-level data deduplication: fingerprint and refcount index.
+ *
+ * The index is loaded from the dedup area once at mount and then lives
+ * in memory.  Every table block modified by the write path is marked in a
+ * dirty bitmap, and only those blocks are written back to the dedup area
+ * by f2fs_flush_dedup_entries() as part of a checkpoint, so the on-disk
+ * tables stay consistent with the checkpointed block addresses.
+ */
+#include <linux/fs.h>
+#include <linux/f2fs_fs.h>
+#include <linux/hash.h>
+#include <linux/kthread.h>
+#include <linux/freezer.h>
+#include <asm/unaligned.h>
+#include <crypto/blake2s.h>
+
+#include "f2fs.h"
+#include "node.h"
+#include "segment.h"
+#include "iostat.h"
+#include "dedup.h"
+
+/*
+ * A weak hash is a cheap filter: only a hit costs more, reading the
+ * candidate block to compare it.  MD5 is weak too, as collisions can be
+ * crafted.  blake2s has no shash, the library is called directly.
+ */
+static const struct {
+	const char *name;		/* as given by dedup_hash= */
+	const char *driver;		/* shash computing it, or NULL */
+	bool weak;			/* a match needs to be confirmed */
+} dedup_hash_algos[DEDUP_HASH_MAX] = {
+	[DEDUP_HASH_MD5]	= { "md5",	"md5",		true },
+	[DEDUP_HASH_SHA256]	= { "sha256",	"sha256",	false },
+	[DEDUP_HASH_BLAKE2S]	= { "blake2s",	NULL,		false },
+	[DEDUP_HASH_XXHASH64]	= { "xxhash64",	"xxhash64",	true },
+};
+
+const char *f2fs_dedup_hash_name(unsigned int type)
+{
+	if (type >= DEDUP_HASH_MAX)
+		return "unknown";
+	return dedup_hash_algos[type].name;
+}
+
+/* fingerprints are uniformly distributed already, use their bits as is */
+static inline u64 dedup_fp_hash(const u8 *fp)
+{
+	return get_unaligned_le64(fp);
+}
+
+/*
+ * Bits which never select the bucket, within the first 8 bytes so that a
+ * 64-bit digest has them too; the top bit marks the slot in use.
+ */
+static inline u8 dedup_fp_tag(const u8 *fp)
+{
+	return fp[sizeof(u64) - 1] | 0x80;
+}
+
+static inline u32 dedup_blk_hash(block_t blkaddr)
+{
+	return hash_32(blkaddr, 32);
+}
+
+static inline void dedup_stat_add(struct f2fs_dedup_info *dm, int type,
+								u64 val)
+{
+	this_cpu_add(dm->stats->count[type], val);
+}
+
+static inline unsigned int dedup_ref_hist(u32 ref)
+{
+	return min_t(unsigned int, order_base_2(ref), DEDUP_REF_HIST_SIZE - 1);
+}
+
+/* the refcount of an indexed block went from @old to @new, 0 for none */
+static inline void dedup_ref_stat(struct f2fs_dedup_info *dm, u32 old,
+								u32 new)
+{
+	if (old) {
+		this_cpu_dec(dm->stats->refs[dedup_ref_hist(old)]);
+		this_cpu_sub(dm->stats->saved, old - 1);
+	}
+	if (new) {
+		this_cpu_inc(dm->stats->refs[dedup_ref_hist(new)]);
+		this_cpu_add(dm->stats->saved, new - 1);
+	}
+}
+
+/*
+ * Stands for an evicted fingerprint page.  It reads as a page of empty
+ * buckets, so a lockless lookup racing with eviction ends its probe
+ * there and retries on the seqcount; updaters never write to it.
+ */
+static char dedup_evicted[F2FS_BLKSIZE] __aligned(DEDUP_BUCKET_SIZE);
+
+/* an evicted page is freed after a grace period, in place */
+struct dedup_dead_page {
+	struct rcu_head rcu;
+};
+
+/* bucket pages are grown into and read back from writeback, under NOFS */
+static struct kmem_cache *dedup_page_slab;
+static struct kmem_cache *dedup_batch_slab;
+
+static void dedup_free_page_rcu(struct rcu_head *head)
+{
+	kmem_cache_free(dedup_page_slab,
+			container_of(head, struct dedup_dead_page, rcu));
+}
+
+/* updaters hold resize_sem, or own the table during mount and umount */
+static inline struct dedup_page_map *dedup_map(struct dedup_table *t)
+{
+	return rcu_dereference_protected(t->map, true);
+}
+
+static inline unsigned int dedup_home_bucket(struct dedup_page_map *map,
+								u64 hash)
+{
+	return hash & (map->nr_pages * DEDUP_BUCKETS_PER_BLOCK - 1);
+}
+
+/* probes wrap around within the page of the home bucket */
+static inline unsigned int dedup_next_bucket(unsigned int idx)
+{
+	return (idx & ~(DEDUP_BUCKETS_PER_BLOCK - 1)) |
+			((idx + 1) & (DEDUP_BUCKETS_PER_BLOCK - 1));
+}
+
+/* fingerprint pages may be swapped for dedup_evicted under a lookup */
+static inline void *dedup_bucket(struct dedup_page_map *map,
+						unsigned int idx)
+{
+	return READ_ONCE(map->pages[idx / DEDUP_BUCKETS_PER_BLOCK]) +
+			(idx % DEDUP_BUCKETS_PER_BLOCK) * DEDUP_BUCKET_SIZE;
+}
+
+static inline struct dedup_stripe *dedup_stripe(struct dedup_table *t,
+							unsigned int idx)
+{
+	return &t->stripes[(idx / DEDUP_BUCKETS_PER_BLOCK) % DEDUP_STRIPES];
+}
+
+static inline void dedup_stripe_lock(struct dedup_stripe *s)
+{
+	spin_lock(&s->lock);
+	write_seqcount_begin(&s->seq);
+}
+
+static inline void dedup_stripe_unlock(struct dedup_stripe *s)
+{
+	write_seqcount_end(&s->seq);
+	spin_unlock(&s->lock);
+}
+
+static inline void mark_bucket_dirty(struct f2fs_dedup_info *dm,
+				struct dedup_table *t, unsigned int idx)
+{
+	set_bit(t->start_blk + idx / DEDUP_BUCKETS_PER_BLOCK,
+							dm->dirty_bitmap);
+}
+
+static inline void inc_bucket_overflow(__u8 *overflow)
+{
+	if (*overflow < DEDUP_OVERFLOW_MAX)
+		(*overflow)++;
+}
+
+/* a saturated count can't tell how many inserts passed, keep it */
+static inline void dec_bucket_overflow(__u8 *overflow)
+{
+	if (*overflow && *overflow < DEDUP_OVERFLOW_MAX)
+		(*overflow)--;
+}
+
+/* bitmask of the slots in @b whose tag is @tag */
+static inline unsigned int fp_tag_match(struct f2fs_dedup_fp_bucket *b,
+								u8 tag)
+{
+	unsigned int i, match = 0;
+
+	for (i = 0; i < DEDUP_FP_SLOTS; i++)
+		if (b->tags[i] == tag)
+			match |= 1 << i;
+	return match;
+}
+
+/* look up @fp from bucket @idx, @nr_probes gets the buckets visited */
+static struct f2fs_dedup_fp_entry *__lookup_fp(struct dedup_page_map *map,
+		unsigned int idx, const u8 *fp, unsigned int *nr_probes)
+{
+	struct f2fs_dedup_fp_entry *fe = NULL;
+	u8 tag = dedup_fp_tag(fp);
+	unsigned int probe;
+
+	for (probe = 0; probe < DEDUP_BUCKETS_PER_BLOCK; probe++) {
+		struct f2fs_dedup_fp_bucket *b = dedup_bucket(map, idx);
+		unsigned int match = fp_tag_match(b, tag);
+
+		while (match) {
+			unsigned int i = __ffs(match);
+
+			if (!memcmp(b->entries[i].fingerprint, fp,
+							DEDUP_FP_SIZE)) {
+				fe = &b->entries[i];
+				goto out;
+			}
+			match &= match - 1;
+		}
+
+		/* no insert ever went past this bucket */
+		if (!b->overflow)
+			break;
+		idx = dedup_next_bucket(idx);
+	}
+out:
+	if (nr_probes)
+		*nr_probes = min_t(unsigned int, probe + 1,
+						DEDUP_BUCKETS_PER_BLOCK);
+	return fe;
+}
+
+static int __insert_fp(struct f2fs_dedup_info *dm, struct dedup_table *t,
+			struct dedup_page_map *map, const u8 *fp, u32 val)
+{
+	unsigned int idx = dedup_home_bucket(map, dedup_fp_hash(fp));
+	unsigned int probe, i;
+
+	for (probe = 0; probe < DEDUP_BUCKETS_PER_BLOCK; probe++) {
+		struct f2fs_dedup_fp_bucket *b = dedup_bucket(map, idx);
+
+		for (i = 0; i < DEDUP_FP_SLOTS; i++) {
+			if (b->tags[i])
+				continue;
+			memcpy(b->entries[i].fingerprint, fp, DEDUP_FP_SIZE);
+			b->entries[i].val = cpu_to_le32(val);
+			b->tags[i] = dedup_fp_tag(fp);
+			atomic_inc(&t->nr_entries);
+			mark_bucket_dirty(dm, t, idx);
+			return 0;
+		}
+		inc_bucket_overflow(&b->overflow);
+		mark_bucket_dirty(dm, t, idx);
+		idx = dedup_next_bucket(idx);
+	}
+	return -ENOSPC;
+}
+
+/*
+ * Remove the fingerprint entry of @b in @slot, found by probing from @home.
+ * The buckets passed by its insert get their overflow count back, so
+ * probe chains shrink again as entries go away, without tombstones.
+ */
+static void __delete_fp(struct f2fs_dedup_info *dm, struct dedup_table *t,
+		struct dedup_page_map *map, unsigned int home,
+		unsigned int idx, unsigned int slot)
+{
+	struct f2fs_dedup_fp_bucket *b = dedup_bucket(map, idx);
+
+	b->tags[slot] = 0;
+	memset(&b->entries[slot], 0, sizeof(struct f2fs_dedup_fp_entry));
+	atomic_dec(&t->nr_entries);
+
+	for (; home != idx; home = dedup_next_bucket(home))
+		dec_bucket_overflow(&((struct f2fs_dedup_fp_bucket *)
+					dedup_bucket(map, home))->overflow);
+	mark_bucket_dirty(dm, t, idx);
+}
+
+/*
+ * Find the fingerprint entry homed at @hash and pointing to @val, and
+ * leave its bucket in @idx and its slot in @slot.
+ */
+static struct f2fs_dedup_fp_entry *__lookup_fp_val(struct dedup_page_map *map,
+		u32 hash, u32 val, unsigned int *idx, unsigned int *slot)
+{
+	__le32 key = cpu_to_le32(val);
+	unsigned int probe, i;
+
+	*idx = dedup_home_bucket(map, hash);
+	for (probe = 0; probe < DEDUP_BUCKETS_PER_BLOCK; probe++) {
+		struct f2fs_dedup_fp_bucket *b = dedup_bucket(map, *idx);
+
+		for (i = 0; i < DEDUP_FP_SLOTS; i++) {
+			if (!b->tags[i] || b->entries[i].val != key)
+				continue;
+			*slot = i;
+			return &b->entries[i];
+		}
+
+		if (!b->overflow)
+			break;
+		*idx = dedup_next_bucket(*idx);
+	}
+	return NULL;
+}
+
+/* remove the fingerprint entry homed at @hash and pointing to @val */
+static bool __delete_fp_val(struct f2fs_dedup_info *dm, struct dedup_table *t,
+			struct dedup_page_map *map, u32 hash, u32 val)
+{
+	unsigned int idx, slot;
+
+	if (!__lookup_fp_val(map, hash, val, &idx, &slot))
+		return false;
+	__delete_fp(dm, t, map, dedup_home_bucket(map, hash), idx, slot);
+	return true;
+}
+
+/* look up @blkaddr probing from *@idx, which is left at its bucket */
+static struct f2fs_dedup_ref_entry *__lookup_ref(struct dedup_page_map *map,
+					unsigned int *idx, block_t blkaddr)
+{
+	__le32 key = cpu_to_le32(blkaddr);
+	unsigned int probe, i;
+
+	for (probe = 0; probe < DEDUP_BUCKETS_PER_BLOCK; probe++) {
+		struct f2fs_dedup_ref_bucket *b = dedup_bucket(map, *idx);
+
+		for (i = 0; i < DEDUP_REF_SLOTS; i++)
+			if (b->entries[i].blkaddr == key)
+				return &b->entries[i];
+
+		if (!b->overflow)
+			break;
+		*idx = dedup_next_bucket(*idx);
+	}
+	return NULL;
+}
+
+/* remove @re, found in bucket @idx by probing from @home */
+static void __delete_ref(struct f2fs_dedup_info *dm, struct dedup_table *t,
+		struct dedup_page_map *map, unsigned int home,
+		unsigned int idx, struct f2fs_dedup_ref_entry *re)
+{
+	memset(re, 0, sizeof(struct f2fs_dedup_ref_entry));
+	atomic_dec(&t->nr_entries);
+
+	for (; home != idx; home = dedup_next_bucket(home))
+		dec_bucket_overflow(&((struct f2fs_dedup_ref_bucket *)
+					dedup_bucket(map, home))->overflow);
+	mark_bucket_dirty(dm, t, idx);
+}
+
+static int __insert_ref(struct f2fs_dedup_info *dm, struct dedup_table *t,
+			struct dedup_page_map *map, block_t blkaddr,
+			u32 ref, u32 fphash)
+{
+	unsigned int idx = dedup_home_bucket(map, dedup_blk_hash(blkaddr));
+	unsigned int probe, i;
+
+	for (probe = 0; probe < DEDUP_BUCKETS_PER_BLOCK; probe++) {
+		struct f2fs_dedup_ref_bucket *b = dedup_bucket(map, idx);
+
+		for (i = 0; i < DEDUP_REF_SLOTS; i++) {
+			struct f2fs_dedup_ref_entry *re = &b->entries[i];
+
+			if (re->blkaddr != cpu_to_le32(NULL_ADDR))
+				continue;
+			re->blkaddr = cpu_to_le32(blkaddr);
+			re->ref = cpu_to_le32(ref);
+			re->fphash = cpu_to_le32(fphash);
+			atomic_inc(&t->nr_entries);
+			mark_bucket_dirty(dm, t, idx);
+			return 0;
+		}
+		inc_bucket_overflow(&b->overflow);
+		mark_bucket_dirty(dm, t, idx);
+		idx = dedup_next_bucket(idx);
+	}
+	return -ENOSPC;
+}
+
+/* look up the crypt context of @blkaddr probing from *@idx, left at it */
+static struct f2fs_dedup_crypt_entry *__lookup_crypt(
+		struct dedup_page_map *map, unsigned int *idx, block_t blkaddr)
+{
+	__le32 key = cpu_to_le32(blkaddr);
+	unsigned int probe, i;
+
+	for (probe = 0; probe < DEDUP_BUCKETS_PER_BLOCK; probe++) {
+		struct f2fs_dedup_crypt_bucket *b = dedup_bucket(map, *idx);
+
+		for (i = 0; i < DEDUP_CRYPT_SLOTS; i++)
+			if (b->entries[i].blkaddr == key)
+				return &b->entries[i];
+
+		if (!b->overflow)
+			break;
+		*idx = dedup_next_bucket(*idx);
+	}
+	return NULL;
+}
+
+static int __insert_crypt(struct f2fs_dedup_info *dm, struct dedup_table *t,
+			struct dedup_page_map *map, block_t blkaddr,
+			nid_t ino, u32 lblk)
+{
+	unsigned int idx = dedup_home_bucket(map, dedup_blk_hash(blkaddr));
+	unsigned int probe, i;
+
+	for (probe = 0; probe < DEDUP_BUCKETS_PER_BLOCK; probe++) {
+		struct f2fs_dedup_crypt_bucket *b = dedup_bucket(map, idx);
+
+		for (i = 0; i < DEDUP_CRYPT_SLOTS; i++) {
+			struct f2fs_dedup_crypt_entry *ce = &b->entries[i];
+
+			if (ce->blkaddr != cpu_to_le32(NULL_ADDR))
+				continue;
+			ce->blkaddr = cpu_to_le32(blkaddr);
+			ce->ino = cpu_to_le32(ino);
+			ce->lblk = cpu_to_le32(lblk);
+			atomic_inc(&t->nr_entries);
+			mark_bucket_dirty(dm, t, idx);
+			return 0;
+		}
+		inc_bucket_overflow(&b->overflow);
+		mark_bucket_dirty(dm, t, idx);
+		idx = dedup_next_bucket(idx);
+	}
+	return -ENOSPC;
+}
+
+/* remove @ce, found in bucket @idx by probing from @home */
+static void __delete_crypt(struct f2fs_dedup_info *dm, struct dedup_table *t,
+		struct dedup_page_map *map, unsigned int home,
+		unsigned int idx, struct f2fs_dedup_crypt_entry *ce)
+{
+	memset(ce, 0, sizeof(struct f2fs_dedup_crypt_entry));
+	atomic_dec(&t->nr_entries);
+
+	for (; home != idx; home = dedup_next_bucket(home))
+		dec_bucket_overflow(&((struct f2fs_dedup_crypt_bucket *)
+					dedup_bucket(map, home))->overflow);
+	mark_bucket_dirty(dm, t, idx);
+}
+
+/*
+ * Return the next owner entry of @blkaddr after slot *@slot of bucket
+ * *@idx, and leave both at the entry found.  A walk starts with *@idx at
+ * the home bucket @home and *@slot at -1.
+ */
+static struct f2fs_dedup_owner_entry *__next_owner(struct dedup_page_map *map,
+		unsigned int home, unsigned int *idx, int *slot,
+		block_t blkaddr)
+{
+	__le32 key = cpu_to_le32(blkaddr);
+	int i = *slot + 1;
+
+	for (;;) {
+		struct f2fs_dedup_owner_bucket *b = dedup_bucket(map, *idx);
+
+		for (; i < DEDUP_OWNER_SLOTS; i++) {
+			if (b->entries[i].blkaddr == key) {
+				*slot = i;
+				return &b->entries[i];
+			}
+		}
+
+		if (!b->overflow)
+			return NULL;
+		*idx = dedup_next_bucket(*idx);
+		if (*idx == home)
+			return NULL;
+		i = 0;
+	}
+}
+
+/* look up an owner of @blkaddr probing from *@idx, left at its bucket */
+static struct f2fs_dedup_owner_entry *__lookup_owner(
+		struct dedup_page_map *map, unsigned int *idx,
+		block_t blkaddr, nid_t nid, unsigned int ofs_in_node)
+{
+	struct f2fs_dedup_owner_entry *oe;
+	unsigned int home = *idx;
+	int slot = -1;
+
+	while ((oe = __next_owner(map, home, idx, &slot, blkaddr)))
+		if (le32_to_cpu(oe->nid) == nid &&
+				le16_to_cpu(oe->ofs_in_node) == ofs_in_node)
+			return oe;
+	return NULL;
+}
+
+static int __insert_owner(struct f2fs_dedup_info *dm, struct dedup_table *t,
+			struct dedup_page_map *map, block_t blkaddr,
+			nid_t nid, unsigned int ofs_in_node)
+{
+	unsigned int idx = dedup_home_bucket(map, dedup_blk_hash(blkaddr));
+	unsigned int probe, i;
+
+	for (probe = 0; probe < DEDUP_BUCKETS_PER_BLOCK; probe++) {
+		struct f2fs_dedup_owner_bucket *b = dedup_bucket(map, idx);
+
+		for (i = 0; i < DEDUP_OWNER_SLOTS; i++) {
+			struct f2fs_dedup_owner_entry *oe = &b->entries[i];
+
+			if (oe->blkaddr != cpu_to_le32(NULL_ADDR))
+				continue;
+			oe->blkaddr = cpu_to_le32(blkaddr);
+			oe->nid = cpu_to_le32(nid);
+			oe->ofs_in_node = cpu_to_le16(ofs_in_node);
+			atomic_inc(&t->nr_entries);
+			mark_bucket_dirty(dm, t, idx);
+			return 0;
+		}
+		inc_bucket_overflow(&b->overflow);
+		mark_bucket_dirty(dm, t, idx);
+		idx = dedup_next_bucket(idx);
+	}
+	return -ENOSPC;
+}
+
+/* remove @oe, found in bucket @idx by probing from @home */
+static void __delete_owner(struct f2fs_dedup_info *dm, struct dedup_table *t,
+		struct dedup_page_map *map, unsigned int home,
+		unsigned int idx, struct f2fs_dedup_owner_entry *oe)
+{
+	memset(oe, 0, sizeof(struct f2fs_dedup_owner_entry));
+	atomic_dec(&t->nr_entries);
+
+	for (; home != idx; home = dedup_next_bucket(home))
+		dec_bucket_overflow(&((struct f2fs_dedup_owner_bucket *)
+					dedup_bucket(map, home))->overflow);
+	mark_bucket_dirty(dm, t, idx);
+}
+
+static unsigned int count_page_entries(struct f2fs_dedup_info *dm,
+		struct dedup_table *t, struct dedup_page_map *map,
+		unsigned int page)
+{
+	unsigned int idx = page * DEDUP_BUCKETS_PER_BLOCK;
+	unsigned int end = idx + DEDUP_BUCKETS_PER_BLOCK;
+	unsigned int i, count = 0;
+
+	for (; idx < end; idx++) {
+		if (t == &dm->tables[DEDUP_REF_TABLE]) {
+			struct f2fs_dedup_ref_bucket *b = dedup_bucket(map, idx);
+
+			for (i = 0; i < DEDUP_REF_SLOTS; i++)
+				if (b->entries[i].blkaddr !=
+						cpu_to_le32(NULL_ADDR))
+					count++;
+		} else if (t == &dm->tables[DEDUP_OWNER_TABLE]) {
+			struct f2fs_dedup_owner_bucket *b = dedup_bucket(map, idx);
+
+			for (i = 0; i < DEDUP_OWNER_SLOTS; i++)
+				if (b->entries[i].blkaddr !=
+						cpu_to_le32(NULL_ADDR))
+					count++;
+		} else if (t == &dm->tables[DEDUP_CRYPT_TABLE]) {
+			struct f2fs_dedup_crypt_bucket *b = dedup_bucket(map, idx);
+
+			for (i = 0; i < DEDUP_CRYPT_SLOTS; i++)
+				if (b->entries[i].blkaddr !=
+						cpu_to_le32(NULL_ADDR))
+					count++;
+		} else {
+			struct f2fs_dedup_fp_bucket *b = dedup_bucket(map, idx);
+
+			for (i = 0; i < DEDUP_FP_SLOTS; i++)
+				if (b->tags[i])
+					count++;
+		}
+	}
+	return count;
+}
+
+/* the bits of the filter hash all depend on every bit of the fingerprint's */
+static inline u64 dedup_filter_hash(const u8 *fp)
+{
+	return dedup_fp_hash(fp) * GOLDEN_RATIO_64;
+}
+
+static inline unsigned long *dedup_filter_line(struct dedup_page_map *map,
+						unsigned int pg, u64 h)
+{
+	return map->filter + (pg * DEDUP_FILTER_LINES +
+			(h >> (64 - ilog2(DEDUP_FILTER_LINES)))) *
+			DEDUP_BUCKET_SIZE / sizeof(unsigned long);
+}
+
+static inline unsigned int dedup_filter_bit(u64 h, int i)
+{
+	return (h >> (64 - ilog2(DEDUP_FILTER_LINES) -
+			(i + 1) * ilog2(DEDUP_FILTER_LINE_BITS))) &
+			(DEDUP_FILTER_LINE_BITS - 1);
+}
+
+/*
+ * Build the filter of page @pg of the fingerprint table from its buckets
+ * in @buf, and return the number of entries in it.
+ */
+static unsigned int dedup_build_filter(struct dedup_page_map *map,
+					unsigned int pg, void *buf)
+{
+	unsigned int idx, i, j, count = 0;
+
+	memset(dedup_filter_line(map, pg, 0), 0, DEDUP_FILTER_SIZE);
+	for (idx = 0; idx < DEDUP_BUCKETS_PER_BLOCK; idx++) {
+		struct f2fs_dedup_fp_bucket *b = buf + idx * DEDUP_BUCKET_SIZE;
+
+		for (i = 0; i < DEDUP_FP_SLOTS; i++) {
+			unsigned long *line;
+			u64 h;
+
+			if (!b->tags[i])
+				continue;
+			h = dedup_filter_hash(b->entries[i].fingerprint);
+			line = dedup_filter_line(map, pg, h);
+			for (j = 0; j < DEDUP_FILTER_HASHES; j++)
+				__set_bit(dedup_filter_bit(h, j), line);
+			count++;
+		}
+	}
+	return count;
+}
+
+/*
+ * Tell whether @fp may be in evicted page @pg of the fingerprint table.
+ * Only a page with a filter can tell it isn't.  Called under RCU.
+ */
+static bool dedup_filter_may_hold(struct f2fs_dedup_info *dm,
+		struct dedup_page_map *map, unsigned int pg, const u8 *fp)
+{
+	u64 h = dedup_filter_hash(fp);
+	unsigned long *line = dedup_filter_line(map, pg, h);
+	int i;
+
+	if (test_bit(pg, dm->fp_unread))
+		return true;
+	/* pairs with the barrier in dedup_scan_fp_page() */
+	smp_rmb();
+
+	for (i = 0; i < DEDUP_FILTER_HASHES; i++)
+		if (!test_bit(dedup_filter_bit(h, i), line))
+			return false;
+	return true;
+}
+
+static inline void dedup_touch_fp(struct f2fs_dedup_info *dm,
+						unsigned int pg)
+{
+	if (!test_bit(pg, dm->fp_accessed))
+		set_bit(pg, dm->fp_accessed);
+}
+
+/*
+ * Copy the clean page @pg of @t into @buf: from its current copy, or from
+ * the next one if a grow staged it there.  The checkpoint makes a staged
+ * copy the current one under the stripe lock, which leaves its address
+ * as it was.
+ */
+static int dedup_read_table_page(struct f2fs_sb_info *sbi,
+		struct dedup_table *t, unsigned int pg, void *buf)
+{
+	struct dedup_stripe *s = dedup_stripe(t, pg * DEDUP_BUCKETS_PER_BLOCK);
+	unsigned int blkno = t->start_blk + pg;
+	struct page *page;
+	block_t blkaddr;
+
+	spin_lock(&s->lock);
+	if (test_bit(blkno, DEDUP_I(sbi)->staged_bitmap))
+		blkaddr = next_dedup_addr(sbi, blkno);
+	else
+		blkaddr = current_dedup_addr(sbi, blkno);
+	spin_unlock(&s->lock);
+
+	page = f2fs_get_meta_page(sbi, blkaddr);
+	if (IS_ERR(page))
+		return PTR_ERR(page);
+	memcpy(buf, page_address(page), F2FS_BLKSIZE);
+	f2fs_put_page(page, 1);
+	return 0;
+}
+
+/*
+ * Read page @pg of the fingerprint table back from the dedup area.  An
+ * evicted or unread page is clean, so its latest copy is the one on disk,
+ * or in meta mapping if it was written lately.  Called with resize_sem.
+ */
+static int dedup_load_fp_page(struct f2fs_sb_info *sbi, struct dedup_table *t,
+			struct dedup_page_map *map, unsigned int pg)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct dedup_stripe *s = dedup_stripe(t, pg * DEDUP_BUCKETS_PER_BLOCK);
+	void *buf;
+	int err;
+
+	buf = f2fs_kmem_cache_alloc(dedup_page_slab, GFP_NOFS, false, sbi);
+	if (!buf)
+		return -ENOMEM;
+
+	err = dedup_read_table_page(sbi, t, pg, buf);
+	if (err) {
+		kmem_cache_free(dedup_page_slab, buf);
+		return err;
+	}
+
+	dedup_stripe_lock(s);
+	if (map->pages[pg] == dedup_evicted) {
+		WRITE_ONCE(map->pages[pg], buf);
+		atomic_dec(&dm->fp_evicted);
+		buf = NULL;
+
+		/* entries of a page read for the first time are new to us */
+		if (test_and_clear_bit(pg, dm->fp_unread)) {
+			atomic_add(count_page_entries(dm, t, map, pg),
+							&t->nr_entries);
+			atomic_dec(&dm->fp_nr_unread);
+		}
+	}
+	dedup_stripe_unlock(s);
+	if (buf)
+		kmem_cache_free(dedup_page_slab, buf);
+
+	/* don't let it go again before it is used */
+	dedup_touch_fp(dm, pg);
+	return 0;
+}
+
+/*
+ * Count the entries of unread page @pg of the fingerprint table and build
+ * its filter, leaving the page itself evicted.  Called with resize_sem.
+ */
+static int dedup_scan_fp_page(struct f2fs_sb_info *sbi, struct dedup_table *t,
+			struct dedup_page_map *map, unsigned int pg)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct dedup_stripe *s = dedup_stripe(t, pg * DEDUP_BUCKETS_PER_BLOCK);
+	struct page *page;
+
+	page = f2fs_get_meta_page(sbi, current_dedup_addr(sbi,
+						t->start_blk + pg));
+	if (IS_ERR(page))
+		return PTR_ERR(page);
+
+	dedup_stripe_lock(s);
+	if (map->pages[pg] == dedup_evicted && test_bit(pg, dm->fp_unread)) {
+		atomic_add(dedup_build_filter(map, pg, page_address(page)),
+							&t->nr_entries);
+		/* the filter is complete before lookups use it */
+		smp_mb__before_atomic();
+		clear_bit(pg, dm->fp_unread);
+		atomic_dec(&dm->fp_nr_unread);
+	}
+	dedup_stripe_unlock(s);
+	f2fs_put_page(page, 1);
+	return 0;
+}
+
+/*
+ * Take the stripe lock of bucket @idx of the fingerprint table, with the
+ * page of the bucket in memory.  Called with resize_sem.
+ */
+static int dedup_lock_fp(struct f2fs_sb_info *sbi, struct dedup_table *t,
+			struct dedup_page_map *map, unsigned int idx)
+{
+	struct dedup_stripe *s = dedup_stripe(t, idx);
+	unsigned int pg = idx / DEDUP_BUCKETS_PER_BLOCK;
+	int err;
+
+	dedup_touch_fp(DEDUP_I(sbi), pg);
+	for (;;) {
+		dedup_stripe_lock(s);
+		if (map->pages[pg] != dedup_evicted)
+			return 0;
+		dedup_stripe_unlock(s);
+
+		err = dedup_load_fp_page(sbi, t, map, pg);
+		if (err)
+			return err;
+	}
+}
+
+/*
+ * Evict up to @nr fingerprint pages which are clean and weren't used
+ * since the clock hand last passed them.  Lookups that hit an evicted
+ * page read it back, so only memory is traded for some reads.
+ */
+unsigned long f2fs_dedup_shrink(struct f2fs_sb_info *sbi, unsigned long nr)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct dedup_table *t;
+	struct dedup_page_map *map;
+	unsigned long freed = 0;
+	unsigned int scanned;
+
+	if (!f2fs_dedup_enabled(sbi) || !nr)
+		return 0;
+
+	t = &dm->tables[DEDUP_FP_TABLE];
+	if (!mutex_trylock(&dm->fp_shrink_lock))
+		return 0;
+	if (!percpu_down_read_trylock(&t->resize_sem))
+		goto unlock;
+
+	map = dedup_map(t);
+	for (scanned = 0; scanned < map->nr_pages * 2 && freed < nr;
+							scanned++) {
+		unsigned int pg = dm->fp_clock++ & (map->nr_pages - 1);
+		unsigned int blkno = t->start_blk + pg;
+		struct dedup_stripe *s;
+		void *buf;
+
+		if (test_and_clear_bit(pg, dm->fp_accessed))
+			continue;
+		if (test_bit(blkno, dm->dirty_bitmap))
+			continue;
+
+		s = dedup_stripe(t, pg * DEDUP_BUCKETS_PER_BLOCK);
+		dedup_stripe_lock(s);
+		buf = map->pages[pg];
+		if (buf == dedup_evicted || test_bit(blkno, dm->dirty_bitmap)) {
+			dedup_stripe_unlock(s);
+			continue;
+		}
+		dedup_build_filter(map, pg, buf);
+		WRITE_ONCE(map->pages[pg], dedup_evicted);
+		dedup_stripe_unlock(s);
+
+		/* lookups may still walk it until a grace period passes */
+		call_rcu(&((struct dedup_dead_page *)buf)->rcu,
+						dedup_free_page_rcu);
+		atomic_inc(&dm->fp_evicted);
+		freed++;
+	}
+	percpu_up_read(&t->resize_sem);
+unlock:
+	mutex_unlock(&dm->fp_shrink_lock);
+	return freed;
+}
+
+/* # of fingerprint pages in memory which could be evicted */
+unsigned long f2fs_dedup_shrink_count(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	long count;
+
+	if (!f2fs_dedup_enabled(sbi))
+		return 0;
+
+	count = READ_ONCE(dm->tables[DEDUP_FP_TABLE].nr_pages) -
+			atomic_read(&dm->fp_evicted) - DEDUP_MIN_TABLE_PAGES;
+	return count > 0 ? count : 0;
+}
+
+/* pages of the tables which can't be evicted, counted against the cap */
+static unsigned int dedup_resident_pages(struct f2fs_dedup_info *dm)
+{
+	return READ_ONCE(dm->tables[DEDUP_CRYPT_TABLE].nr_pages) +
+		READ_ONCE(dm->tables[DEDUP_REF_TABLE].nr_pages) +
+		READ_ONCE(dm->tables[DEDUP_OWNER_TABLE].nr_pages);
+}
+
+/*
+ * Fingerprint pages which may stay in memory: what max_fp_pages leaves to
+ * them after the other tables, DEDUP_MIN_TABLE_PAGES at least, or 0 if
+ * there is no cap.
+ */
+static unsigned int dedup_fp_budget(struct f2fs_dedup_info *dm)
+{
+	unsigned int max = READ_ONCE(dm->max_fp_pages);
+	unsigned int resident = dedup_resident_pages(dm);
+
+	if (!max)
+		return 0;
+	if (max < resident + DEDUP_MIN_TABLE_PAGES)
+		return DEDUP_MIN_TABLE_PAGES;
+	return max - resident;
+}
+
+/* keep the table pages in memory within max_fp_pages */
+static void dedup_balance_fp(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	unsigned int budget = dedup_fp_budget(dm);
+	long excess;
+
+	if (!budget)
+		return;
+
+	excess = READ_ONCE(dm->tables[DEDUP_FP_TABLE].nr_pages) -
+			atomic_read(&dm->fp_evicted) - budget;
+	if (excess > 0)
+		f2fs_dedup_shrink(sbi, excess);
+}
+
+static void free_page_map(struct dedup_page_map *map)
+{
+	unsigned int i;
+
+	if (!map)
+		return;
+	for (i = 0; i < map->nr_pages; i++)
+		if (map->pages[i] && map->pages[i] != dedup_evicted)
+			kmem_cache_free(dedup_page_slab, map->pages[i]);
+	kvfree(map->filter);
+	kvfree(map);
+}
+
+/* pages of a map of @t allocated @evicted are read back on first use */
+static struct dedup_page_map *alloc_page_map(struct f2fs_sb_info *sbi,
+		struct dedup_table *t, unsigned int nr_pages, bool evicted)
+{
+	struct dedup_page_map *map;
+	unsigned int i;
+
+	map = f2fs_kvzalloc(sbi, struct_size(map, pages, nr_pages), GFP_NOFS);
+	if (!map)
+		return NULL;
+
+	if (t == &DEDUP_I(sbi)->tables[DEDUP_FP_TABLE]) {
+		map->filter = f2fs_kvzalloc(sbi, array_size(nr_pages,
+					DEDUP_FILTER_SIZE), GFP_NOFS);
+		if (!map->filter) {
+			kvfree(map);
+			return NULL;
+		}
+	}
+
+	/* the slab keeps every bucket within one cache line */
+	for (i = 0; i < nr_pages; i++) {
+		if (evicted) {
+			map->pages[i] = dedup_evicted;
+			continue;
+		}
+		map->pages[i] = f2fs_kmem_cache_alloc(dedup_page_slab,
+					GFP_NOFS | __GFP_ZERO, false, sbi);
+		if (!map->pages[i]) {
+			map->nr_pages = i;
+			free_page_map(map);
+			return NULL;
+		}
+	}
+	map->nr_pages = nr_pages;
+	return map;
+}
+
+static int rehash_dedup_table(struct f2fs_dedup_info *dm,
+		struct dedup_table *t, struct dedup_page_map *old,
+		struct dedup_page_map *new)
+{
+	bool is_ref = t == &dm->tables[DEDUP_REF_TABLE];
+	bool is_owner = t == &dm->tables[DEDUP_OWNER_TABLE];
+	unsigned int idx, i;
+	int err;
+
+	for (idx = 0; idx < old->nr_pages * DEDUP_BUCKETS_PER_BLOCK; idx++) {
+		if (is_ref) {
+			struct f2fs_dedup_ref_bucket *b = dedup_bucket(old, idx);
+
+			for (i = 0; i < DEDUP_REF_SLOTS; i++) {
+				struct f2fs_dedup_ref_entry *re = &b->entries[i];
+
+				if (re->blkaddr == cpu_to_le32(NULL_ADDR))
+					continue;
+				err = __insert_ref(dm, t, new,
+						le32_to_cpu(re->blkaddr),
+						le32_to_cpu(re->ref),
+						le32_to_cpu(re->fphash));
+				if (err)
+					return err;
+			}
+		} else if (is_owner) {
+			struct f2fs_dedup_owner_bucket *b = dedup_bucket(old, idx);
+
+			for (i = 0; i < DEDUP_OWNER_SLOTS; i++) {
+				struct f2fs_dedup_owner_entry *oe = &b->entries[i];
+
+				if (oe->blkaddr == cpu_to_le32(NULL_ADDR))
+					continue;
+				err = __insert_owner(dm, t, new,
+						le32_to_cpu(oe->blkaddr),
+						le32_to_cpu(oe->nid),
+						le16_to_cpu(oe->ofs_in_node));
+				if (err)
+					return err;
+			}
+		} else {
+			struct f2fs_dedup_crypt_bucket *b = dedup_bucket(old, idx);
+
+			for (i = 0; i < DEDUP_CRYPT_SLOTS; i++) {
+				struct f2fs_dedup_crypt_entry *ce = &b->entries[i];
+
+				if (ce->blkaddr == cpu_to_le32(NULL_ADDR))
+					continue;
+				err = __insert_crypt(dm, t, new,
+						le32_to_cpu(ce->blkaddr),
+						le32_to_cpu(ce->ino),
+						le32_to_cpu(ce->lblk));
+				if (err)
+					return err;
+			}
+		}
+	}
+	return 0;
+}
+
+/* move the entries of fingerprint page @buf to their home in @new */
+static int rehash_fp_page(struct f2fs_dedup_info *dm, struct dedup_table *t,
+				void *buf, struct dedup_page_map *new)
+{
+	unsigned int idx, i;
+	int err;
+
+	for (idx = 0; idx < DEDUP_BUCKETS_PER_BLOCK; idx++) {
+		struct f2fs_dedup_fp_bucket *b = buf + idx * DEDUP_BUCKET_SIZE;
+
+		for (i = 0; i < DEDUP_FP_SLOTS; i++) {
+			if (!b->tags[i])
+				continue;
+			err = __insert_fp(dm, t, new, b->entries[i].fingerprint,
+					le32_to_cpu(b->entries[i].val));
+			if (err)
+				return err;
+		}
+	}
+	return 0;
+}
+
+/* push the pages staged so far out of meta mapping, unless cp is on */
+static void dedup_write_staged(struct f2fs_sb_info *sbi)
+{
+	if (!f2fs_down_write_trylock(&sbi->cp_global_sem))
+		return;
+	f2fs_sync_meta_pages(sbi, META, LONG_MAX, FS_META_IO);
+	f2fs_up_write(&sbi->cp_global_sem);
+}
+
+/*
+ * Write page @pg of the grown fingerprint map @new to the next copy of its
+ * block, and leave it evicted with its filter.  The old map is still live
+ * on disk, in the current copies, until the next checkpoint switches.
+ */
+static void dedup_stage_fp_page(struct f2fs_sb_info *sbi,
+		struct dedup_table *t, struct dedup_page_map *new,
+		unsigned int pg)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	unsigned int blkno = t->start_blk + pg;
+	void *buf = new->pages[pg];
+	struct page *page;
+
+	page = f2fs_grab_meta_page(sbi, next_dedup_addr(sbi, blkno));
+	memcpy(page_address(page), buf, F2FS_BLKSIZE);
+	set_page_dirty(page);
+	f2fs_put_page(page, 1);
+
+	dedup_build_filter(new, pg, buf);
+	new->pages[pg] = dedup_evicted;
+	kmem_cache_free(dedup_page_slab, buf);
+	clear_bit(blkno, dm->dirty_bitmap);
+	set_bit(blkno, dm->staged_bitmap);
+}
+
+/*
+ * Rehash the fingerprint table into a map twice the size of @old, a page
+ * at a time: the entries of old page pg only go to new pages pg and
+ * pg + @old->nr_pages.  An evicted page is read into a single buffer, a
+ * clean one is evicted from @old once rehashed, and new pages beyond
+ * dedup_fp_budget() are staged to disk and evicted right away, so that
+ * growing keeps within the cap like lookups do.  The map is returned with
+ * every page dirty or staged.
+ */
+static struct dedup_page_map *rehash_fp_table(struct f2fs_sb_info *sbi,
+		struct dedup_table *t, struct dedup_page_map *old)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	unsigned int n = old->nr_pages, budget = dedup_fp_budget(dm);
+	unsigned int resident = n - atomic_read(&dm->fp_evicted);
+	unsigned int pg, half, kept = 0, staged = 0;
+	struct dedup_page_map *new;
+	void *buf;
+	int err;
+
+	/* staging again would overwrite the only copy of an old page */
+	if (find_next_bit(dm->staged_bitmap, t->start_blk + n, t->start_blk) <
+							t->start_blk + n)
+		return ERR_PTR(-EAGAIN);
+
+	new = alloc_page_map(sbi, t, 2 * n, true);
+	if (!new)
+		return ERR_PTR(-ENOMEM);
+	buf = f2fs_kmem_cache_alloc(dedup_page_slab, GFP_NOFS, false, sbi);
+	if (!buf) {
+		err = -ENOMEM;
+		goto free;
+	}
+
+	for (pg = 0; pg < n; pg++) {
+		bool dirty = test_bit(t->start_blk + pg, dm->dirty_bitmap);
+		void *src = old->pages[pg];
+
+		if (src == dedup_evicted) {
+			err = dedup_read_table_page(sbi, t, pg, buf);
+			if (err)
+				goto free;
+			src = buf;
+		}
+
+		for (half = pg; half < 2 * n; half += n) {
+			void *page = f2fs_kmem_cache_alloc(dedup_page_slab,
+					GFP_NOFS | __GFP_ZERO, false, sbi);
+
+			if (!page) {
+				err = -ENOMEM;
+				goto free;
+			}
+			new->pages[half] = page;
+		}
+
+		err = rehash_fp_page(dm, t, src, new);
+		if (err)
+			goto free;
+
+		/* a clean page can be read back if the grow fails */
+		if (src != buf && !dirty) {
+			struct dedup_stripe *s = dedup_stripe(t,
+					pg * DEDUP_BUCKETS_PER_BLOCK);
+
+			dedup_stripe_lock(s);
+			dedup_build_filter(old, pg, src);
+			WRITE_ONCE(old->pages[pg], dedup_evicted);
+			dedup_stripe_unlock(s);
+			call_rcu(&((struct dedup_dead_page *)src)->rcu,
+						dedup_free_page_rcu);
+			resident--;
+		}
+
+		for (half = pg; half < 2 * n; half += n) {
+			set_bit(t->start_blk + half, dm->dirty_bitmap);
+			if (!budget || kept + resident < budget) {
+				kept++;
+				continue;
+			}
+			dedup_stage_fp_page(sbi, t, new, half);
+			if (++staged % BIO_MAX_VECS == 0)
+				dedup_write_staged(sbi);
+		}
+		cond_resched();
+	}
+	kmem_cache_free(dedup_page_slab, buf);
+	if (staged)
+		dedup_write_staged(sbi);
+
+	/* all entries are counted again, none is left unread */
+	bitmap_clear(dm->fp_unread, 0, n);
+	atomic_set(&dm->fp_nr_unread, 0);
+	atomic_set(&dm->fp_evicted, staged);
+	return new;
+free:
+	if (buf)
+		kmem_cache_free(dedup_page_slab, buf);
+	free_page_map(new);
+
+	/* the old map is the live one again, only its evicted pages clean */
+	for (pg = 0, resident = 0; pg < n; pg++) {
+		if (old->pages[pg] == dedup_evicted) {
+			clear_bit(t->start_blk + pg, dm->dirty_bitmap);
+			continue;
+		}
+		set_bit(t->start_blk + pg, dm->dirty_bitmap);
+		resident++;
+	}
+	atomic_set(&dm->fp_evicted, n - resident);
+	bitmap_clear(dm->dirty_bitmap, t->start_blk + n, n);
+	bitmap_clear(dm->staged_bitmap, t->start_blk, 2 * n);
+	return ERR_PTR(err);
+}
+
+/*
+ * Double @t, unless someone else already grew it from @old_pages, and move
+ * every entry to its new home bucket.  All pages of the grown table get
+ * written at the next checkpoint, or were staged already, together with a
+ * header carrying the new size, so pages in use are always valid on disk.
+ * The fingerprint table grows once at most between checkpoints.
+ */
+static int grow_dedup_table(struct f2fs_sb_info *sbi, struct dedup_table *t,
+						unsigned int old_pages)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct dedup_page_map *old, *new;
+	unsigned int i;
+	int entries, err = 0;
+
+	percpu_down_write(&t->resize_sem);
+	if (t->nr_pages != old_pages)
+		goto out;
+	if (t->nr_pages >= t->max_pages) {
+		err = -ENOSPC;
+		goto out;
+	}
+
+	old = dedup_map(t);
+	entries = atomic_read(&t->nr_entries);
+	atomic_set(&t->nr_entries, 0);
+
+	if (t == &dm->tables[DEDUP_FP_TABLE]) {
+		new = rehash_fp_table(sbi, t, old);
+		err = PTR_ERR_OR_ZERO(new);
+	} else {
+		new = alloc_page_map(sbi, t, t->nr_pages * 2, false);
+		err = new ? rehash_dedup_table(dm, t, old, new) : -ENOMEM;
+		if (err) {
+			free_page_map(new);
+		} else {
+			for (i = 0; i < new->nr_pages; i++)
+				set_bit(t->start_blk + i, dm->dirty_bitmap);
+		}
+	}
+	if (err) {
+		/* a page of the new map filled up, keep the old one */
+		atomic_set(&t->nr_entries, entries);
+		goto out;
+	}
+
+	rcu_assign_pointer(t->map, new);
+	WRITE_ONCE(t->nr_pages, new->nr_pages);
+	percpu_up_write(&t->resize_sem);
+
+	/* wait for lookups still walking the old pages */
+	synchronize_rcu();
+	free_page_map(old);
+	return 0;
+out:
+	percpu_up_write(&t->resize_sem);
+	return err;
+}
+
+/*
+ * Take @t for update.  Keep the load factor bounded so that probes stay
+ * short; once a table can't grow any more, new blocks are not indexed.
+ */
+static inline bool dedup_table_loaded(struct dedup_table *t,
+						unsigned int nr_pages)
+{
+	unsigned long long limit = (unsigned long long)nr_pages *
+			DEDUP_BUCKETS_PER_BLOCK * t->slots *
+			DEDUP_MAX_LOAD_FACTOR / 100;
+
+	return atomic_read(&t->nr_entries) >= limit;
+}
+
+static int dedup_table_get(struct f2fs_sb_info *sbi, struct dedup_table *t)
+{
+	unsigned int nr_pages = READ_ONCE(t->nr_pages);
+
+	if (dedup_table_loaded(t, nr_pages)) {
+		if (nr_pages >= t->max_pages)
+			return -ENOSPC;
+		grow_dedup_table(sbi, t, nr_pages);
+	}
+	percpu_down_read(&t->resize_sem);
+	return 0;
+}
+
+static inline void dedup_table_put(struct dedup_table *t)
+{
+	percpu_up_read(&t->resize_sem);
+}
+
+/*
+ * Tell whether indexing one more block would have the refcount table grow
+ * past max_fp_pages.  Clones, owners and crypt contexts are still kept,
+ * as freeing shared blocks depends on them; new blocks go unindexed.
+ */
+static bool dedup_index_full(struct f2fs_dedup_info *dm)
+{
+	struct dedup_table *rt = &dm->tables[DEDUP_REF_TABLE];
+	unsigned int max = READ_ONCE(dm->max_fp_pages);
+	unsigned int nr_pages = READ_ONCE(rt->nr_pages);
+
+	if (!max || !dedup_table_loaded(rt, nr_pages))
+		return false;
+	return dedup_resident_pages(dm) + nr_pages +
+					DEDUP_MIN_TABLE_PAGES > max;
+}
+
+/* lockless lookup of @fp, return its value in @val */
+static bool dedup_lookup_fp(struct f2fs_sb_info *sbi, struct dedup_table *t,
+						const u8 *fp, u32 *val)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct dedup_page_map *map;
+	struct f2fs_dedup_fp_entry *fe;
+	struct dedup_stripe *s;
+	unsigned int idx, pg, seq, probes;
+	bool found, evicted, filtered;
+	int err;
+
+retry:
+	rcu_read_lock();
+	map = rcu_dereference(t->map);
+	idx = dedup_home_bucket(map, dedup_fp_hash(fp));
+	pg = idx / DEDUP_BUCKETS_PER_BLOCK;
+	s = dedup_stripe(t, idx);
+	do {
+		seq = read_seqcount_begin(&s->seq);
+		fe = __lookup_fp(map, idx, fp, &probes);
+		found = fe;
+		if (found)
+			*val = le32_to_cpu(READ_ONCE(fe->val));
+		evicted = READ_ONCE(map->pages[pg]) == dedup_evicted;
+	} while (read_seqcount_retry(&s->seq, seq));
+	filtered = evicted && !dedup_filter_may_hold(dm, map, pg, fp);
+	rcu_read_unlock();
+
+	if (filtered) {
+		dedup_stat_add(dm, DEDUP_STAT_LOOKUP, 1);
+		dedup_stat_add(dm, DEDUP_STAT_FILTERED, 1);
+		return false;
+	}
+
+	if (!evicted) {
+		dedup_touch_fp(dm, pg);
+		dedup_stat_add(dm, DEDUP_STAT_LOOKUP, 1);
+		dedup_stat_add(dm, DEDUP_STAT_PROBE, probes);
+		if (found)
+			dedup_stat_add(dm, DEDUP_STAT_HIT, 1);
+		return found;
+	}
+
+	percpu_down_read(&t->resize_sem);
+	map = dedup_map(t);
+	pg = dedup_home_bucket(map, dedup_fp_hash(fp)) /
+					DEDUP_BUCKETS_PER_BLOCK;
+	err = 0;
+	if (map->pages[pg] == dedup_evicted)
+		err = dedup_load_fp_page(sbi, t, map, pg);
+	dedup_table_put(t);
+	if (err)
+		return false;
+
+	dedup_balance_fp(sbi);
+	goto retry;
+}
+
+/* lockless lookup of the refcount of @blkaddr, 0 if it is not indexed */
+static u32 dedup_lookup_ref(struct dedup_table *t, block_t blkaddr)
+{
+	struct dedup_page_map *map;
+	struct f2fs_dedup_ref_entry *re;
+	struct dedup_stripe *s;
+	unsigned int home, idx, seq;
+	u32 ref;
+
+	rcu_read_lock();
+	map = rcu_dereference(t->map);
+	home = dedup_home_bucket(map, dedup_blk_hash(blkaddr));
+	s = dedup_stripe(t, home);
+	do {
+		seq = read_seqcount_begin(&s->seq);
+		idx = home;
+		re = __lookup_ref(map, &idx, blkaddr);
+		ref = re ? le32_to_cpu(READ_ONCE(re->ref)) : 0;
+	} while (read_seqcount_retry(&s->seq, seq));
+	rcu_read_unlock();
+
+	return ref;
+}
+
+/* references beyond the first one are what makes GC of a segment dearer */
+static inline void dedup_seg_refs_add(struct f2fs_sb_info *sbi,
+					block_t blkaddr, int delta)
+{
+	atomic_add(delta, &DEDUP_I(sbi)->seg_refs[GET_SEGNO(sbi, blkaddr)]);
+}
+
+/* a block shared enough to go cold has its segment marked for GC */
+static inline void dedup_mark_cold(struct f2fs_sb_info *sbi,
+					block_t blkaddr, u32 ref)
+{
+	unsigned long *segmap = DEDUP_I(sbi)->cold_segmap;
+	unsigned int segno = GET_SEGNO(sbi, blkaddr);
+
+	if (f2fs_dedup_cold_block(sbi, ref) && !test_bit(segno, segmap) &&
+			get_seg_entry(sbi, segno)->type != CURSEG_COLD_DATA)
+		set_bit(segno, segmap);
+}
+
+/* a reference gone may let GC collect every owner left in the section */
+static inline void dedup_unstick(struct f2fs_sb_info *sbi, block_t blkaddr)
+{
+	unsigned long *secmap = DEDUP_I(sbi)->stuck_secmap;
+	unsigned int secno = GET_SEC_FROM_SEG(sbi, GET_SEGNO(sbi, blkaddr));
+
+	if (test_bit(secno, secmap))
+		clear_bit(secno, secmap);
+}
+
+/* insert @fp unless it is there already; a full page gets the table grown */
+static int dedup_insert_fp(struct f2fs_sb_info *sbi, struct dedup_table *t,
+						const u8 *fp, u32 val)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct dedup_page_map *map;
+	struct dedup_stripe *s;
+	unsigned int idx, nr_pages;
+	bool retried = false;
+	int err;
+
+retry:
+	err = dedup_table_get(sbi, t);
+	if (err)
+		return err;
+
+	map = dedup_map(t);
+	nr_pages = map->nr_pages;
+	idx = dedup_home_bucket(map, dedup_fp_hash(fp));
+	s = dedup_stripe(t, idx);
+
+	err = dedup_lock_fp(sbi, t, map, idx);
+	if (err) {
+		dedup_table_put(t);
+		return err;
+	}
+	if (__lookup_fp(map, idx, fp, NULL))
+		err = -EEXIST;
+	else
+		err = __insert_fp(dm, t, map, fp, val);
+	dedup_stripe_unlock(s);
+	dedup_table_put(t);
+
+	if (err == -ENOSPC && !retried &&
+			!grow_dedup_table(sbi, t, nr_pages)) {
+		retried = true;
+		goto retry;
+	}
+	return err;
+}
+
+/* record that dnode @nid points to the shared block at @blkaddr too */
+void f2fs_dedup_add_owner(struct f2fs_sb_info *sbi, block_t blkaddr,
+				nid_t nid, unsigned int ofs_in_node)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct dedup_table *ot = &dm->tables[DEDUP_OWNER_TABLE];
+	struct dedup_page_map *map;
+	struct dedup_stripe *s;
+	unsigned int nr_pages, idx;
+	bool retried = false;
+	int err;
+
+retry:
+	/* an owner left out only keeps GC from moving the block */
+	if (dedup_table_get(sbi, ot))
+		return;
+
+	map = dedup_map(ot);
+	nr_pages = map->nr_pages;
+	idx = dedup_home_bucket(map, dedup_blk_hash(blkaddr));
+	s = dedup_stripe(ot, idx);
+
+	dedup_stripe_lock(s);
+	if (__lookup_owner(map, &idx, blkaddr, nid, ofs_in_node))
+		err = 0;
+	else
+		err = __insert_owner(dm, ot, map, blkaddr, nid, ofs_in_node);
+	dedup_stripe_unlock(s);
+	dedup_table_put(ot);
+
+	if (err == -ENOSPC && !retried &&
+			!grow_dedup_table(sbi, ot, nr_pages)) {
+		retried = true;
+		goto retry;
+	}
+}
+
+/*
+ * Remove the owner entries of @blkaddr, and record them again for
+ * @new_blkaddr if the block moved there.
+ */
+static void dedup_drop_owners(struct f2fs_sb_info *sbi, block_t blkaddr,
+						block_t new_blkaddr)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct dedup_table *ot = &dm->tables[DEDUP_OWNER_TABLE];
+	struct f2fs_dedup_owner_entry *oe;
+	struct dedup_page_map *map;
+	struct dedup_stripe *s;
+	unsigned int home, idx, ofs_in_node;
+	nid_t nid;
+	int slot;
+
+	do {
+		percpu_down_read(&ot->resize_sem);
+		map = dedup_map(ot);
+		home = idx = dedup_home_bucket(map, dedup_blk_hash(blkaddr));
+		s = dedup_stripe(ot, home);
+		slot = -1;
+
+		dedup_stripe_lock(s);
+		oe = __next_owner(map, home, &idx, &slot, blkaddr);
+		if (oe) {
+			nid = le32_to_cpu(oe->nid);
+			ofs_in_node = le16_to_cpu(oe->ofs_in_node);
+			__delete_owner(dm, ot, map, home, idx, oe);
+		}
+		dedup_stripe_unlock(s);
+		dedup_table_put(ot);
+
+		/* the new address hashes to another page, maybe a grown one */
+		if (oe && new_blkaddr != NULL_ADDR)
+			f2fs_dedup_add_owner(sbi, new_blkaddr, nid, ofs_in_node);
+	} while (oe);
+}
+
+/*
+ * Decrypt a copy of the ciphertext @cpage read from @blkaddr with the key
+ * and IV of the file block it was written for, and compare it with the
+ * plaintext in @page.
+ */
+static bool dedup_same_plaintext(struct f2fs_sb_info *sbi, block_t blkaddr,
+				struct page *cpage, struct page *page)
+{
+	struct inode *inode = page->mapping->host;
+	struct inode *owner;
+	struct page *tmp;
+	u64 lblk = page->index;
+	bool same = false;
+
+	owner = f2fs_dedup_crypt_owner(sbi, blkaddr, inode, &lblk);
+	if (IS_ERR(owner))
+		return false;
+	if (!owner) {
+		owner = inode;
+		ihold(owner);
+	}
+
+	/* an inline encryption key can't decrypt in software */
+	if (!fscrypt_inode_uses_fs_layer_crypto(owner))
+		goto out;
+
+	tmp = alloc_page(GFP_NOFS);
+	if (!tmp)
+		goto out;
+	memcpy(page_address(tmp), page_address(cpage), PAGE_SIZE);
+	lock_page(tmp);
+	if (!fscrypt_decrypt_shared_block(owner, tmp, PAGE_SIZE, 0, lblk))
+		same = !memcmp(page_address(tmp), page_address(page),
+								PAGE_SIZE);
+	unlock_page(tmp);
+	__free_page(tmp);
+out:
+	iput(owner);
+	return same;
+}
+
+/*
+ * A weak fingerprint only says the blocks may be equal; read the candidate
+ * and compare it with the data about to be written, which goes to disk
+ * @encrypted or as is.  The caller holds a reference on the candidate, so
+ * that it can't be freed and reused meanwhile.
+ */
+static bool dedup_same_data(struct f2fs_sb_info *sbi, block_t blkaddr,
+					struct page *page, bool encrypted)
+{
+	struct page *cpage;
+	bool same;
+
+	if (!f2fs_is_valid_blkaddr(sbi, blkaddr, DATA_GENERIC_ENHANCE_READ))
+		return false;
+
+	cpage = f2fs_get_tmp_page(sbi, blkaddr);
+	if (IS_ERR(cpage))
+		return false;
+	if (encrypted)
+		same = dedup_same_plaintext(sbi, blkaddr, cpage, page);
+	else
+		same = !memcmp(page_address(cpage), page_address(page),
+								PAGE_SIZE);
+	f2fs_put_page(cpage, 1);
+
+	dedup_stat_add(DEDUP_I(sbi), DEDUP_STAT_CONFIRM, 1);
+	if (!same)
+		dedup_stat_add(DEDUP_I(sbi), DEDUP_STAT_COLLISION, 1);
+
+	/* the block is a data block, only keep it cached when shared */
+	if (!same || !test_opt(sbi, DEDUP_CACHE))
+		invalidate_mapping_pages(META_MAPPING(sbi), blkaddr, blkaddr);
+	return same;
+}
+
+/* take one more reference on @blkaddr if it still holds @fphash */
+static bool dedup_get_ref(struct f2fs_sb_info *sbi, block_t blkaddr,
+							u32 fphash)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct dedup_table *rt = &dm->tables[DEDUP_REF_TABLE];
+	struct f2fs_dedup_ref_entry *re;
+	struct dedup_page_map *map;
+	struct dedup_stripe *s;
+	unsigned int idx;
+	bool found = false;
+	u32 ref = 0;
+
+	percpu_down_read(&rt->resize_sem);
+	map = dedup_map(rt);
+	idx = dedup_home_bucket(map, dedup_blk_hash(blkaddr));
+	s = dedup_stripe(rt, idx);
+
+	dedup_stripe_lock(s);
+	re = __lookup_ref(map, &idx, blkaddr);
+	/* the block may have been reused since the lockless lookup */
+	if (re && re->ref && le32_to_cpu(re->fphash) == fphash) {
+		le32_add_cpu(&re->ref, 1);
+		ref = le32_to_cpu(re->ref);
+		mark_bucket_dirty(dm, rt, idx);
+		dedup_ref_stat(dm, ref - 1, ref);
+		found = true;
+	}
+	dedup_stripe_unlock(s);
+	dedup_table_put(rt);
+
+	if (found) {
+		dedup_seg_refs_add(sbi, blkaddr, 1);
+		dedup_mark_cold(sbi, blkaddr, ref);
+	}
+	return found;
+}
+
+/* give the block just written at @blkaddr its first reference */
+static void dedup_insert_ref(struct f2fs_sb_info *sbi, block_t blkaddr,
+							u32 fphash)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct dedup_table *rt = &dm->tables[DEDUP_REF_TABLE];
+	struct f2fs_dedup_ref_entry *re;
+	struct dedup_page_map *map;
+	struct dedup_stripe *s;
+	unsigned int idx;
+
+	if (dedup_table_get(sbi, rt))
+		return;
+
+	map = dedup_map(rt);
+	idx = dedup_home_bucket(map, dedup_blk_hash(blkaddr));
+	s = dedup_stripe(rt, idx);
+
+	dedup_stripe_lock(s);
+	/* the address may have been indexed in an earlier life */
+	re = __lookup_ref(map, &idx, blkaddr);
+	if (re) {
+		dedup_ref_stat(dm, le32_to_cpu(re->ref), 1);
+		re->ref = cpu_to_le32(1);
+		re->fphash = cpu_to_le32(fphash);
+		mark_bucket_dirty(dm, rt, idx);
+	} else if (!__insert_ref(dm, rt, map, blkaddr, 1, fphash)) {
+		dedup_ref_stat(dm, 0, 1);
+	}
+	dedup_stripe_unlock(s);
+	dedup_table_put(rt);
+}
+
+/*
+ * Look up the block holding @fp and take one more reference on it.
+ * Return true with its address in @blkaddr if the write can share it.
+ * @page holds the plaintext to be written, @encrypted if it goes to disk
+ * encrypted.
+ */
+bool f2fs_dedup_share_block(struct f2fs_sb_info *sbi, const u8 *fp,
+		struct page *page, bool encrypted, block_t *blkaddr)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	u64 start = f2fs_dedup_lat_start(sbi);
+	bool shared = false;
+	u32 addr;
+
+	if (!dedup_lookup_fp(sbi, &dm->tables[DEDUP_FP_TABLE], fp, &addr))
+		goto out;
+
+	if (!dedup_get_ref(sbi, addr, (u32)dedup_fp_hash(fp)))
+		goto out;
+
+	if (dm->fp_weak && !dedup_same_data(sbi, addr, page, encrypted)) {
+		/* the other owners may have gone meanwhile */
+		if (!f2fs_dedup_put_block(sbi, addr))
+			f2fs_dedup_release_block(sbi, addr);
+		goto out;
+	}
+
+	shared = true;
+	*blkaddr = addr;
+	dedup_stat_add(dm, DEDUP_STAT_SHARED, 1);
+out:
+	f2fs_update_dedup_latency(sbi, DEDUP_LAT_LOOKUP, start);
+	return shared;
+}
+
+/* index a block just written at @blkaddr, with one reference */
+void f2fs_dedup_insert_block(struct f2fs_sb_info *sbi, const u8 *fp,
+							block_t blkaddr)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	u64 start = f2fs_dedup_lat_start(sbi);
+
+	if (dedup_index_full(dm))
+		return;
+	if (!dedup_insert_fp(sbi, &dm->tables[DEDUP_FP_TABLE], fp, blkaddr))
+		dedup_insert_ref(sbi, blkaddr, (u32)dedup_fp_hash(fp));
+	f2fs_update_dedup_latency(sbi, DEDUP_LAT_INSERT, start);
+}
+
+/*
+ * Look up the compressed cluster holding @fp, and take one more reference
+ * on each of its blocks.  Return their number, up to @max, and the first
+ * one in @blkaddr, or 0 if the cluster has to be compressed and written.
+ */
+unsigned int f2fs_dedup_share_cluster(struct f2fs_sb_info *sbi,
+			const u8 *fp, unsigned int max, block_t *blkaddr)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	u32 fphash = (u32)dedup_fp_hash(fp);
+	u64 start = f2fs_dedup_lat_start(sbi);
+	unsigned int nr;
+	u32 addr;
+
+	/*
+	 * A weak match would have to be read back and decompressed to be
+	 * confirmed, so clusters are only shared on a trusted fingerprint.
+	 */
+	if (dm->fp_weak)
+		return 0;
+
+	if (!dedup_lookup_fp(sbi, &dm->tables[DEDUP_FP_TABLE], fp, &addr))
+		goto miss;
+
+	for (nr = 0; nr < max; nr++) {
+		if (dedup_get_ref(sbi, addr + nr,
+				dedup_cluster_tag(fphash, nr, true))) {
+			*blkaddr = addr;
+			dedup_stat_add(dm, DEDUP_STAT_SHARED, nr + 1);
+			dedup_stat_add(dm, DEDUP_STAT_CLUSTER, 1);
+			f2fs_update_dedup_latency(sbi, DEDUP_LAT_LOOKUP, start);
+			return nr + 1;
+		}
+		/* GC may have moved a block of it away */
+		if (!dedup_get_ref(sbi, addr + nr,
+				dedup_cluster_tag(fphash, nr, false)))
+			break;
+	}
+
+	while (nr--)
+		f2fs_dedup_put_block(sbi, addr + nr);
+miss:
+	f2fs_update_dedup_latency(sbi, DEDUP_LAT_LOOKUP, start);
+	return 0;
+}
+
+/* index the @nr compressed blocks of a cluster just written at @blkaddr */
+void f2fs_dedup_insert_cluster(struct f2fs_sb_info *sbi, const u8 *fp,
+				block_t blkaddr, unsigned int nr)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	u32 fphash = (u32)dedup_fp_hash(fp);
+	u64 start = f2fs_dedup_lat_start(sbi);
+	unsigned int i;
+
+	/* never to be shared, see f2fs_dedup_share_cluster() */
+	if (dm->fp_weak || dedup_index_full(dm))
+		return;
+
+	if (!dedup_insert_fp(sbi, &dm->tables[DEDUP_FP_TABLE], fp, blkaddr))
+		for (i = 0; i < nr; i++)
+			dedup_insert_ref(sbi, blkaddr + i,
+				dedup_cluster_tag(fphash, i, i == nr - 1));
+	f2fs_update_dedup_latency(sbi, DEDUP_LAT_INSERT, start);
+}
+
+/*
+ * Take one more reference on the block at @blkaddr for a file cloning it.
+ * A block which is not indexed has a single owner, and gets a refcount
+ * entry of its own with no fingerprint.
+ */
+int f2fs_dedup_get_block(struct f2fs_sb_info *sbi, block_t blkaddr)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct dedup_table *rt = &dm->tables[DEDUP_REF_TABLE];
+	struct f2fs_dedup_ref_entry *re;
+	struct dedup_page_map *map;
+	struct dedup_stripe *s;
+	unsigned int idx, nr_pages;
+	bool retried = false;
+	u32 ref = 2;
+	int err;
+
+retry:
+	err = dedup_table_get(sbi, rt);
+	if (err)
+		return err;
+
+	map = dedup_map(rt);
+	nr_pages = map->nr_pages;
+	idx = dedup_home_bucket(map, dedup_blk_hash(blkaddr));
+	s = dedup_stripe(rt, idx);
+
+	dedup_stripe_lock(s);
+	re = __lookup_ref(map, &idx, blkaddr);
+	if (re && re->ref) {
+		le32_add_cpu(&re->ref, 1);
+		ref = le32_to_cpu(re->ref);
+		mark_bucket_dirty(dm, rt, idx);
+		dedup_ref_stat(dm, ref - 1, ref);
+	} else if (re) {
+		re->ref = cpu_to_le32(2);
+		re->fphash = 0;
+		mark_bucket_dirty(dm, rt, idx);
+		dedup_ref_stat(dm, 0, 2);
+	} else {
+		err = __insert_ref(dm, rt, map, blkaddr, 2, 0);
+		if (!err)
+			dedup_ref_stat(dm, 0, 2);
+	}
+	dedup_stripe_unlock(s);
+	dedup_table_put(rt);
+
+	if (err == -ENOSPC && !retried &&
+			!grow_dedup_table(sbi, rt, nr_pages)) {
+		retried = true;
+		goto retry;
+	}
+	if (!err) {
+		dedup_seg_refs_add(sbi, blkaddr, 1);
+		dedup_mark_cold(sbi, blkaddr, ref);
+		dedup_stat_add(dm, DEDUP_STAT_CLONED, 1);
+	}
+	return err;
+}
+
+/*
+ * Drop one reference on the block at @blkaddr.  Return true if it is still
+ * shared by other files and so must stay valid.  The last reference takes
+ * the refcount, fingerprint and owner entries of the block away with it.
+ */
+bool f2fs_dedup_put_block(struct f2fs_sb_info *sbi, block_t blkaddr)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct dedup_table *rt, *ft;
+	struct f2fs_dedup_ref_entry *re;
+	struct dedup_page_map *map;
+	struct dedup_stripe *s;
+	unsigned int home, idx;
+	bool shared = false, found = false;
+	u32 fphash = 0;
+
+	if (!f2fs_dedup_enabled(sbi))
+		return false;
+
+	rt = &dm->tables[DEDUP_REF_TABLE];
+	percpu_down_read(&rt->resize_sem);
+	map = dedup_map(rt);
+	home = idx = dedup_home_bucket(map, dedup_blk_hash(blkaddr));
+	s = dedup_stripe(rt, idx);
+
+	dedup_stripe_lock(s);
+	re = __lookup_ref(map, &idx, blkaddr);
+	if (re) {
+		u32 ref = le32_to_cpu(re->ref);
+
+		found = true;
+		if (ref > 1) {
+			le32_add_cpu(&re->ref, -1);
+			mark_bucket_dirty(dm, rt, idx);
+			dedup_ref_stat(dm, ref, ref - 1);
+			shared = true;
+		} else {
+			fphash = le32_to_cpu(re->fphash);
+			__delete_ref(dm, rt, map, home, idx, re);
+			dedup_ref_stat(dm, ref, 0);
+		}
+	}
+	dedup_stripe_unlock(s);
+	dedup_table_put(rt);
+
+	if (found)
+		dedup_unstick(sbi, blkaddr);
+	if (shared) {
+		dedup_seg_refs_add(sbi, blkaddr, -1);
+		return true;
+	}
+
+	/* the ciphertext has no other reader left */
+	f2fs_dedup_drop_crypt(sbi, blkaddr, NULL, NULL);
+	if (!found)
+		return false;
+
+	/* the caller frees it, let its discard coalesce with others */
+	f2fs_dedup_hold_discard(sbi, GET_SEGNO(sbi, blkaddr), true);
+
+	/* nothing can share the block now, forget its fingerprint */
+	ft = &dm->tables[DEDUP_FP_TABLE];
+	percpu_down_read(&ft->resize_sem);
+	map = dedup_map(ft);
+	idx = dedup_home_bucket(map, fphash);
+	s = dedup_stripe(ft, idx);
+
+	/* a stale fingerprint is told apart by fphash of the ref entry */
+	if (!dedup_lock_fp(sbi, ft, map, idx)) {
+		__delete_fp_val(dm, ft, map, fphash, blkaddr);
+		dedup_stripe_unlock(s);
+	}
+	dedup_table_put(ft);
+
+	dedup_drop_owners(sbi, blkaddr, NULL_ADDR);
+	return false;
+}
+
+/*
+ * A file block is now mapped to a shared block instead of @old_blkaddr.
+ * Drop the old block, and give back the block the new data doesn't take.
+ * The inode keeps being charged for it, as every owner of a shared block
+ * is, so that truncating any owner balances out.
+ */
+void f2fs_dedup_release_block(struct f2fs_sb_info *sbi, block_t old_blkaddr)
+{
+	if (__is_valid_data_blkaddr(old_blkaddr))
+		f2fs_invalidate_blocks(sbi, old_blkaddr);
+
+	spin_lock(&sbi->stat_lock);
+	f2fs_bug_on(sbi, !sbi->total_valid_block_count);
+	sbi->total_valid_block_count--;
+	if (sbi->reserved_blocks &&
+		sbi->current_reserved_blocks < sbi->reserved_blocks)
+		sbi->current_reserved_blocks++;
+	spin_unlock(&sbi->stat_lock);
+}
+
+/* refcount of the block at @blkaddr, 0 or 1 if it has a single owner */
+u32 f2fs_dedup_block_refs(struct f2fs_sb_info *sbi, block_t blkaddr)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+
+	if (!f2fs_dedup_enabled(sbi) || !__is_valid_data_blkaddr(blkaddr) ||
+		!atomic_read(&dm->seg_refs[GET_SEGNO(sbi, blkaddr)]))
+		return 0;
+	return dedup_lookup_ref(&dm->tables[DEDUP_REF_TABLE], blkaddr);
+}
+
+/* tell whether the block at @blkaddr has more than one owner */
+bool f2fs_dedup_block_shared(struct f2fs_sb_info *sbi, block_t blkaddr)
+{
+	return f2fs_dedup_block_refs(sbi, blkaddr) > 1;
+}
+
+/*
+ * Cache the data of shared block @blkaddr, held in @page, once by its
+ * address so that every file reading it is served from memory.  Meta
+ * mapping holds it, raw as on disk, and drops it along with the block.
+ */
+void f2fs_dedup_cache_block(struct f2fs_sb_info *sbi, struct page *page,
+							block_t blkaddr)
+{
+	struct page *cpage;
+	int ret;
+
+	if (!test_opt(sbi, DEDUP_CACHE))
+		return;
+
+	if (!f2fs_is_valid_blkaddr(sbi, blkaddr, DATA_GENERIC_ENHANCE_READ))
+		return;
+
+	if (!f2fs_available_free_memory(sbi, DEDUP_PAGE))
+		return;
+
+	cpage = find_get_page(META_MAPPING(sbi), blkaddr);
+	if (cpage) {
+		f2fs_put_page(cpage, 0);
+		return;
+	}
+
+	cpage = alloc_page(__GFP_NOWARN | __GFP_IO);
+	if (!cpage)
+		return;
+
+	ret = add_to_page_cache_lru(cpage, META_MAPPING(sbi),
+						blkaddr, GFP_NOFS);
+	if (ret) {
+		f2fs_put_page(cpage, 0);
+		return;
+	}
+
+	memcpy(page_address(cpage), page_address(page), PAGE_SIZE);
+	SetPageUptodate(cpage);
+	f2fs_put_page(cpage, 1);
+}
+
+/*
+ * Fill @page of @inode from the cached copy of shared block @blkaddr.
+ * Only data which is read as is can be: transformed data is cached raw.
+ */
+bool f2fs_dedup_load_cached_block(struct inode *inode, struct page *page,
+							block_t blkaddr)
+{
+	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
+	struct page *cpage;
+	bool hitted = false;
+
+	if (!test_opt(sbi, DEDUP_CACHE) || f2fs_post_read_required(inode) ||
+			!f2fs_dedup_block_shared(sbi, blkaddr))
+		return false;
+
+	cpage = f2fs_pagecache_get_page(META_MAPPING(sbi),
+				blkaddr, FGP_LOCK | FGP_NOWAIT, GFP_NOFS);
+	if (cpage) {
+		if (PageUptodate(cpage)) {
+			memcpy(page_address(page),
+				page_address(cpage), PAGE_SIZE);
+			hitted = true;
+		}
+		f2fs_put_page(cpage, 1);
+	}
+
+	return hitted;
+}
+
+/* extra references held on the blocks of @segno, or of its section */
+unsigned int f2fs_dedup_seg_refs(struct f2fs_sb_info *sbi,
+				unsigned int segno, bool use_section)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	unsigned int start = segno, end = segno + 1;
+	unsigned int refs = 0;
+
+	if (!f2fs_dedup_enabled(sbi))
+		return 0;
+
+	if (use_section && __is_large_section(sbi)) {
+		start = GET_SEG_FROM_SEC(sbi, GET_SEC_FROM_SEG(sbi, segno));
+		end = start + sbi->segs_per_sec;
+	}
+	for (; start < end; start++)
+		refs += atomic_read(&dm->seg_refs[start]);
+	return refs;
+}
+
+/* counter @type, DEDUP_STAT_*, summed over all cpus */
+u64 f2fs_dedup_stat(struct f2fs_sb_info *sbi, int type)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	u64 sum = 0;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		sum += per_cpu_ptr(dm->stats, cpu)->count[type];
+	return sum;
+}
+
+/*
+ * Sum the per-cpu refcount histogram of indexed blocks into @hist, and
+ * return the number of blocks saved by sharing.  Cheap enough for the
+ * status file, which is shown with irqs disabled, and only a snapshot.
+ */
+u64 f2fs_dedup_ref_histogram(struct f2fs_sb_info *sbi,
+					unsigned long long *hist)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	s64 sum[DEDUP_REF_HIST_SIZE] = {}, saved = 0;
+	int cpu, i;
+
+	for_each_possible_cpu(cpu) {
+		struct f2fs_dedup_stat *st = per_cpu_ptr(dm->stats, cpu);
+
+		for (i = 0; i < DEDUP_REF_HIST_SIZE; i++)
+			sum[i] += READ_ONCE(st->refs[i]);
+		saved += READ_ONCE(st->saved);
+	}
+	for (i = 0; i < DEDUP_REF_HIST_SIZE; i++)
+		hist[i] = max_t(s64, sum[i], 0);
+	return max_t(s64, saved, 0);
+}
+
+/*
+ * Check that slot @ofs_in_node of dnode @nid still points to @blkaddr, and
+ * fill @o with what GC needs to know about it.  Return 1 if it does, 0 if
+ * the owner is gone, or an error if the dnode can't be read.
+ */
+static int dedup_owner_alive(struct f2fs_sb_info *sbi, block_t blkaddr,
+		nid_t nid, unsigned int ofs_in_node, struct f2fs_dedup_owner *o)
+{
+	struct node_info ni;
+	struct page *node_page;
+	block_t source_blkaddr;
+	int err;
+
+	if (f2fs_check_nid_range(sbi, nid))
+		return 0;
+
+	node_page = f2fs_get_node_page(sbi, nid);
+	if (IS_ERR(node_page))
+		return PTR_ERR(node_page);
+
+	err = f2fs_get_node_info(sbi, nid, &ni, false);
+	if (err) {
+		f2fs_put_page(node_page, 1);
+		return err;
+	}
+
+	/* entries come from disk, keep a bad one inside the dnode */
+	if (ofs_in_node >= (IS_INODE(node_page) ? DEF_ADDRS_PER_INODE :
+						DEF_ADDRS_PER_BLOCK) ||
+			f2fs_check_nid_range(sbi, ni.ino)) {
+		f2fs_put_page(node_page, 1);
+		return 0;
+	}
+
+	o->nid = nid;
+	o->ofs_in_node = ofs_in_node;
+	o->ino = ni.ino;
+	o->nofs = ofs_of_node(node_page);
+	o->version = ni.version;
+	source_blkaddr = data_blkaddr(NULL, node_page, ofs_in_node);
+	f2fs_put_page(node_page, 1);
+
+	return source_blkaddr == blkaddr;
+}
+
+/*
+ * Collect in @owners the dnodes pointing to the shared block at @blkaddr,
+ * the one named by its summary entry @sum first, and remove the owner
+ * entries gone stale on the way.  Return the number of owners, -EAGAIN
+ * if owners came or went meanwhile, or -ENOSPC if there are more than
+ * @max or some were never recorded, the owner table being full, so that
+ * the block can't be moved until one of its references goes away.
+ */
+int f2fs_dedup_get_owners(struct f2fs_sb_info *sbi, block_t blkaddr,
+		struct f2fs_summary *sum, struct f2fs_dedup_owner *owners,
+		int max)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct dedup_table *ot = &dm->tables[DEDUP_OWNER_TABLE];
+	struct f2fs_dedup_owner_entry *oe, *cand;
+	struct dedup_page_map *map;
+	struct dedup_stripe *s;
+	unsigned int home, idx;
+	int nr_cand = 0, nr = 0, slot = -1, i, ret;
+	bool more = false;
+	u32 ref;
+
+	ref = dedup_lookup_ref(&dm->tables[DEDUP_REF_TABLE], blkaddr);
+	if (ref < 2)
+		return -EAGAIN;
+	if (ref > max)
+		return -ENOSPC;
+
+	cand = f2fs_kmalloc(sbi, array_size(max, sizeof(*cand)), GFP_NOFS);
+	if (!cand)
+		return -ENOMEM;
+
+	/* dnodes can't be read under the stripe lock, take a copy */
+	percpu_down_read(&ot->resize_sem);
+	map = dedup_map(ot);
+	home = idx = dedup_home_bucket(map, dedup_blk_hash(blkaddr));
+	s = dedup_stripe(ot, home);
+	dedup_stripe_lock(s);
+	while ((oe = __next_owner(map, home, &idx, &slot, blkaddr))) {
+		if (nr_cand == max) {
+			more = true;
+			break;
+		}
+		cand[nr_cand++] = *oe;
+	}
+	dedup_stripe_unlock(s);
+	dedup_table_put(ot);
+
+	ret = dedup_owner_alive(sbi, blkaddr, le32_to_cpu(sum->nid),
+				le16_to_cpu(sum->ofs_in_node), &owners[0]);
+	if (ret < 0)
+		goto out;
+	nr = ret;
+
+	for (i = 0; i < nr_cand; i++) {
+		nid_t nid = le32_to_cpu(cand[i].nid);
+		unsigned int ofs_in_node = le16_to_cpu(cand[i].ofs_in_node);
+
+		/* GC made the recorded owner the summary one */
+		if (nr && owners[0].nid == nid &&
+				owners[0].ofs_in_node == ofs_in_node)
+			continue;
+
+		if (nr == max) {
+			more = true;
+			break;
+		}
+
+		ret = dedup_owner_alive(sbi, blkaddr, nid, ofs_in_node,
+							&owners[nr]);
+		if (ret < 0)
+			goto out;
+		if (ret) {
+			nr++;
+			continue;
+		}
+
+		percpu_down_read(&ot->resize_sem);
+		map = dedup_map(ot);
+		home = idx = dedup_home_bucket(map, dedup_blk_hash(blkaddr));
+		s = dedup_stripe(ot, home);
+		dedup_stripe_lock(s);
+		oe = __lookup_owner(map, &idx, blkaddr, nid, ofs_in_node);
+		if (oe)
+			__delete_owner(dm, ot, map, home, idx, oe);
+		dedup_stripe_unlock(s);
+		dedup_table_put(ot);
+	}
+
+	if (more || nr > ref)
+		ret = -EAGAIN;
+	else if (nr < ref)
+		/* every live owner read, unless one came meanwhile */
+		ret = dedup_lookup_ref(&dm->tables[DEDUP_REF_TABLE],
+					blkaddr) == ref ? -ENOSPC : -EAGAIN;
+	else
+		ret = nr;
+out:
+	kfree(cand);
+	return ret;
+}
+
+/*
+ * Take the refcount entry of @blkaddr out of the index while GC moves
+ * the block, so that nothing shares it meanwhile and giving up its
+ * summary owner frees it.  Return its refcount, with the home of its
+ * fingerprint entry in @fphash, or 0 if it is not indexed.
+ */
+u32 f2fs_dedup_detach_block(struct f2fs_sb_info *sbi, block_t blkaddr,
+							u32 *fphash)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct dedup_table *rt = &dm->tables[DEDUP_REF_TABLE];
+	struct f2fs_dedup_ref_entry *re;
+	struct dedup_page_map *map;
+	struct dedup_stripe *s;
+	unsigned int home, idx;
+	u32 ref = 0;
+
+	percpu_down_read(&rt->resize_sem);
+	map = dedup_map(rt);
+	home = idx = dedup_home_bucket(map, dedup_blk_hash(blkaddr));
+	s = dedup_stripe(rt, home);
+
+	dedup_stripe_lock(s);
+	re = __lookup_ref(map, &idx, blkaddr);
+	if (re) {
+		ref = le32_to_cpu(re->ref);
+		*fphash = le32_to_cpu(re->fphash);
+		__delete_ref(dm, rt, map, home, idx, re);
+		dedup_ref_stat(dm, ref, 0);
+	}
+	dedup_stripe_unlock(s);
+	dedup_table_put(rt);
+
+	if (ref > 1)
+		dedup_seg_refs_add(sbi, blkaddr, 1 - ref);
+	return ref;
+}
+
+/*
+ * Index the block GC moved from @old_blkaddr to @new_blkaddr again, with
+ * the @ref and @fphash f2fs_dedup_detach_block() took away, and point its
+ * fingerprint and owner entries to the new address.  A failed move gives
+ * the entry back with @new_blkaddr the same as @old_blkaddr.
+ */
+void f2fs_dedup_attach_block(struct f2fs_sb_info *sbi, block_t old_blkaddr,
+			block_t new_blkaddr, u32 ref, u32 fphash)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct dedup_table *rt = &dm->tables[DEDUP_REF_TABLE];
+	struct dedup_table *ft = &dm->tables[DEDUP_FP_TABLE];
+	struct f2fs_dedup_fp_entry *fe;
+	struct dedup_page_map *map;
+	struct dedup_stripe *s;
+	unsigned int nr_pages, idx, slot;
+	bool retried = false;
+	int err;
+
+	if (!ref)
+		return;
+retry:
+	err = dedup_table_get(sbi, rt);
+	if (!err) {
+		map = dedup_map(rt);
+		nr_pages = map->nr_pages;
+		s = dedup_stripe(rt, dedup_home_bucket(map,
+					dedup_blk_hash(new_blkaddr)));
+		dedup_stripe_lock(s);
+		err = __insert_ref(dm, rt, map, new_blkaddr, ref, fphash);
+		if (!err)
+			dedup_ref_stat(dm, 0, ref);
+		dedup_stripe_unlock(s);
+		dedup_table_put(rt);
+
+		if (err == -ENOSPC && !retried &&
+				!grow_dedup_table(sbi, rt, nr_pages)) {
+			retried = true;
+			goto retry;
+		}
+	}
+	if (err) {
+		/* owners can't tell when the block is free any more */
+		f2fs_err(sbi, "Lost refcount of shared block %u (%d)",
+			 new_blkaddr, err);
+		set_sbi_flag(sbi, SBI_NEED_FSCK);
+		return;
+	}
+	if (ref > 1)
+		dedup_seg_refs_add(sbi, new_blkaddr, ref - 1);
+
+	if (new_blkaddr == old_blkaddr)
+		return;
+
+	percpu_down_read(&ft->resize_sem);
+	map = dedup_map(ft);
+	idx = dedup_home_bucket(map, fphash);
+	s = dedup_stripe(ft, idx);
+	if (!dedup_lock_fp(sbi, ft, map, idx)) {
+		fe = __lookup_fp_val(map, fphash, old_blkaddr, &idx, &slot);
+		if (fe) {
+			fe->val = cpu_to_le32(new_blkaddr);
+			mark_bucket_dirty(dm, ft, idx);
+		}
+		dedup_stripe_unlock(s);
+	}
+	dedup_table_put(ft);
+
+	dedup_drop_owners(sbi, old_blkaddr, new_blkaddr);
+}
+
+/*
+ * Remember that the ciphertext at @blkaddr was encrypted for block @lblk
+ * of inode @ino, so that a file sharing it can tell the key and IV to
+ * decrypt it with.
+ */
+void f2fs_dedup_insert_crypt(struct f2fs_sb_info *sbi, block_t blkaddr,
+						nid_t ino, pgoff_t lblk)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct dedup_table *ct = &dm->tables[DEDUP_CRYPT_TABLE];
+	struct f2fs_dedup_crypt_entry *ce;
+	struct dedup_page_map *map;
+	struct dedup_stripe *s;
+	unsigned int idx, nr_pages;
+	bool retried = false;
+	int err;
+
+retry:
+	if (dedup_table_get(sbi, ct))
+		return;
+
+	map = dedup_map(ct);
+	nr_pages = map->nr_pages;
+	idx = dedup_home_bucket(map, dedup_blk_hash(blkaddr));
+	s = dedup_stripe(ct, idx);
+
+	dedup_stripe_lock(s);
+	ce = __lookup_crypt(map, &idx, blkaddr);
+	if (ce) {
+		ce->ino = cpu_to_le32(ino);
+		ce->lblk = cpu_to_le32(lblk);
+		mark_bucket_dirty(dm, ct, idx);
+		err = 0;
+	} else {
+		err = __insert_crypt(dm, ct, map, blkaddr, ino, lblk);
+	}
+	dedup_stripe_unlock(s);
+	dedup_table_put(ct);
+
+	if (err == -ENOSPC && !retried &&
+			!grow_dedup_table(sbi, ct, nr_pages)) {
+		retried = true;
+		goto retry;
+	}
+}
+
+/*
+ * Forget the crypt context of @blkaddr, once the block is freed or
+ * rewritten by its only owner.  Return the context in @ino and @lblk if
+ * it was there.
+ */
+bool f2fs_dedup_drop_crypt(struct f2fs_sb_info *sbi, block_t blkaddr,
+						nid_t *ino, u32 *lblk)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct dedup_table *ct = &dm->tables[DEDUP_CRYPT_TABLE];
+	struct f2fs_dedup_crypt_entry *ce;
+	struct dedup_page_map *map;
+	struct dedup_stripe *s;
+	unsigned int home, idx;
+
+	if (!f2fs_dedup_enabled(sbi) || !atomic_read(&ct->nr_entries))
+		return false;
+
+	percpu_down_read(&ct->resize_sem);
+	map = dedup_map(ct);
+	home = idx = dedup_home_bucket(map, dedup_blk_hash(blkaddr));
+	s = dedup_stripe(ct, home);
+
+	dedup_stripe_lock(s);
+	ce = __lookup_crypt(map, &idx, blkaddr);
+	if (ce) {
+		if (ino)
+			*ino = le32_to_cpu(ce->ino);
+		if (lblk)
+			*lblk = le32_to_cpu(ce->lblk);
+		__delete_crypt(dm, ct, map, home, idx, ce);
+	}
+	dedup_stripe_unlock(s);
+	dedup_table_put(ct);
+
+	return ce;
+}
+
+/* hash the @nr pages in @pages and then @len bytes of @tail into @out */
+static int dedup_digest(struct f2fs_dedup_info *dm, struct page **pages,
+		unsigned int nr, const u8 *tail, unsigned int len, u8 *out)
+{
+	struct shash_desc *desc;
+	unsigned int i;
+	int err;
+
+	if (!dm->fp_tfm) {
+		struct blake2s_state state;
+
+		blake2s_init(&state, BLAKE2S_HASH_SIZE);
+		for (i = 0; i < nr; i++)
+			blake2s_update(&state, page_address(pages[i]),
+								PAGE_SIZE);
+		blake2s_update(&state, tail, len);
+		blake2s_final(&state, out);
+		return 0;
+	}
+
+	desc = get_cpu_ptr(dm->fp_desc);
+	err = crypto_shash_init(desc);
+	for (i = 0; !err && i < nr; i++)
+		err = crypto_shash_update(desc, page_address(pages[i]),
+								PAGE_SIZE);
+	if (!err)
+		err = crypto_shash_finup(desc, tail, len, out);
+	put_cpu_ptr(dm->fp_desc);
+	return err;
+}
+
+/*
+ * An all-zero block is neither hashed nor shared but left at NEW_ADDR,
+ * which reads back as zeroes without any I/O.  Like a fallocated block
+ * it stays reserved, yet takes no block on disk and no index entry.
+ * Drop the block it replaces at @old_blkaddr.
+ */
+void f2fs_dedup_zero_block(struct f2fs_sb_info *sbi, block_t old_blkaddr)
+{
+	if (__is_valid_data_blkaddr(old_blkaddr))
+		f2fs_invalidate_blocks(sbi, old_blkaddr);
+	dedup_stat_add(DEDUP_I(sbi), DEDUP_STAT_ZERO, 1);
+}
+
+/* return true if a write to @inode should skip fingerprinting */
+bool f2fs_dedup_bypass(struct f2fs_sb_info *sbi, struct inode *inode)
+{
+	struct f2fs_inode_info *fi = F2FS_I(inode);
+	unsigned int skip = READ_ONCE(fi->i_dedup_skip);
+
+	if (!skip || !READ_ONCE(DEDUP_I(sbi)->bypass_ratio))
+		return false;
+
+	WRITE_ONCE(fi->i_dedup_skip, skip - 1);
+	dedup_stat_add(DEDUP_I(sbi), DEDUP_STAT_BYPASS, 1);
+	return true;
+}
+
+/* account a lookup for a write to @inode, and see if it should bypass */
+void f2fs_dedup_account(struct f2fs_sb_info *sbi, struct inode *inode,
+							bool hit)
+{
+	struct f2fs_inode_info *fi = F2FS_I(inode);
+	unsigned int ratio = READ_ONCE(DEDUP_I(sbi)->bypass_ratio);
+	unsigned int tried, hits;
+
+	if (!ratio)
+		return;
+
+	tried = fi->i_dedup_tried + 1;
+	hits = fi->i_dedup_hits + hit;
+	if (tried < DEDUP_BYPASS_WINDOW) {
+		fi->i_dedup_tried = tried;
+		fi->i_dedup_hits = hits;
+		return;
+	}
+
+	if (hits * 100 < ratio * tried) {
+		WRITE_ONCE(fi->i_dedup_skip,
+			DEDUP_BYPASS_WINDOW << fi->i_dedup_backoff);
+		if (fi->i_dedup_backoff < DEDUP_BYPASS_MAX_SHIFT)
+			fi->i_dedup_backoff++;
+	} else {
+		fi->i_dedup_backoff = 0;
+	}
+	fi->i_dedup_tried = 0;
+	fi->i_dedup_hits = 0;
+}
+
+/*
+ * A block repeating one 64-bit word, as left by tools filling files with
+ * a pattern, is not hashed: its fingerprint is the word, mixed the same
+ * way as a digest and then tagged.  Every block of a pattern is thus
+ * kept as one shared block on disk and one index entry, like any other
+ * duplicate; a match is still confirmed under a weak hash.  The scan
+ * stops at the first differing word, the second one of most blocks.
+ */
+static bool dedup_pattern_fingerprint(struct page *page, u8 *digest)
+{
+	const u64 *p = page_address(page);
+	unsigned int i;
+
+	for (i = 1; i < PAGE_SIZE / sizeof(u64); i++)
+		if (p[i] != p[0])
+			return false;
+
+	/* an odd multiplier is a bijection, no two patterns collide */
+	put_unaligned_le64(p[0] * GOLDEN_RATIO_64, digest);
+	put_unaligned_le64(p[0] ^ DEDUP_PATTERN_TAG, digest + sizeof(u64));
+	return true;
+}
+
+/* compute the fingerprint of the block in @page */
+int f2fs_dedup_fingerprint(struct f2fs_sb_info *sbi, struct page *page,
+								u8 *digest)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	u8 out[HASH_MAX_DIGESTSIZE];
+	u64 start = ktime_get_ns();
+	int err;
+
+	if (dedup_pattern_fingerprint(page, digest)) {
+		dedup_stat_add(dm, DEDUP_STAT_PATTERN, 1);
+		return 0;
+	}
+
+	err = dedup_digest(dm, &page, 1, NULL, 0, out);
+	dedup_stat_add(dm, DEDUP_STAT_HASH, 1);
+	dedup_stat_add(dm, DEDUP_STAT_HASH_NS, ktime_get_ns() - start);
+	if (err)
+		return err;
+	f2fs_update_dedup_latency(sbi, DEDUP_LAT_HASH, start);
+
+	/* keep the leading bytes of a longer digest, pad a shorter one */
+	memcpy(digest, out, min_t(unsigned int, dm->fp_size, DEDUP_FP_SIZE));
+	if (dm->fp_size < DEDUP_FP_SIZE)
+		memset(digest + dm->fp_size, 0, DEDUP_FP_SIZE - dm->fp_size);
+	return 0;
+}
+
+/*
+ * Compute the fingerprint of the raw cluster in @pages of @inode.  Two
+ * files store a cluster alike only if they compress it the same way,
+ * which is hashed along with the data.
+ */
+int f2fs_dedup_fingerprint_cluster(struct inode *inode, struct page **pages,
+					unsigned int nr, u8 *digest)
+{
+	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct f2fs_inode_info *fi = F2FS_I(inode);
+	struct {
+		__u8 algorithm;
+		__u8 level;
+		__le16 flag;
+	} __packed param = {
+		.algorithm = fi->i_compress_algorithm,
+		.level = fi->i_compress_level,
+		.flag = cpu_to_le16(fi->i_compress_flag),
+	};
+	u8 out[HASH_MAX_DIGESTSIZE];
+	u64 start = ktime_get_ns();
+	int err;
+
+	err = dedup_digest(dm, pages, nr, (u8 *)&param, sizeof(param), out);
+	dedup_stat_add(dm, DEDUP_STAT_HASH, nr);
+	dedup_stat_add(dm, DEDUP_STAT_HASH_NS, ktime_get_ns() - start);
+	if (err)
+		return err;
+	f2fs_update_dedup_latency(sbi, DEDUP_LAT_HASH, start);
+
+	memcpy(digest, out, min_t(unsigned int, dm->fp_size, DEDUP_FP_SIZE));
+	if (dm->fp_size < DEDUP_FP_SIZE)
+		memset(digest + dm->fp_size, 0, DEDUP_FP_SIZE - dm->fp_size);
+	return 0;
+}
+
+static void dedup_hash_chunk(struct f2fs_dedup_batch *batch,
+				unsigned int start, unsigned int end)
+{
+	unsigned int i;
+
+	for (i = start; i < end; i++) {
+		/* do_write_page() skips zero blocks before any hashing */
+		if (f2fs_dedup_zero_page(batch->pages[i])) {
+			batch->hashed[i] = false;
+			continue;
+		}
+		batch->hashed[i] = !f2fs_dedup_fingerprint(batch->sbi,
+					batch->pages[i], batch->digests[i]);
+	}
+}
+
+static void dedup_hash_workfn(struct work_struct *work)
+{
+	struct dedup_hash_work *hw = container_of(work,
+					struct dedup_hash_work, work);
+	struct f2fs_dedup_batch *batch = hw->batch;
+
+	dedup_hash_chunk(batch, hw->start, hw->end);
+	if (atomic_dec_and_test(&batch->pending))
+		complete(&batch->done);
+}
+
+/*
+ * Peek at the block holding @fp, without counting a lookup or reading an
+ * evicted page back.  NEW_ADDR stands for a fingerprint which may be on
+ * such a page.
+ */
+static block_t dedup_peek_fp(struct f2fs_dedup_info *dm, const u8 *fp)
+{
+	struct dedup_table *t = &dm->tables[DEDUP_FP_TABLE];
+	struct dedup_page_map *map;
+	struct f2fs_dedup_fp_entry *fe;
+	struct dedup_stripe *s;
+	unsigned int idx, pg, seq;
+	bool evicted;
+	block_t addr;
+
+	rcu_read_lock();
+	map = rcu_dereference(t->map);
+	idx = dedup_home_bucket(map, dedup_fp_hash(fp));
+	pg = idx / DEDUP_BUCKETS_PER_BLOCK;
+	s = dedup_stripe(t, idx);
+	do {
+		seq = read_seqcount_begin(&s->seq);
+		fe = __lookup_fp(map, idx, fp, NULL);
+		addr = fe ? le32_to_cpu(READ_ONCE(fe->val)) : NULL_ADDR;
+		evicted = READ_ONCE(map->pages[pg]) == dedup_evicted;
+	} while (read_seqcount_retry(&s->seq, seq));
+	if (evicted && dedup_filter_may_hold(dm, map, pg, fp))
+		addr = NEW_ADDR;
+	rcu_read_unlock();
+	return addr;
+}
+
+/*
+ * Keep the hits of @batch in runs shorter than min_extent from being
+ * shared, these pages are written out and indexed as usual instead.
+ * A run next to a page whose lookup can't be told now may be longer.
+ */
+static void dedup_plan_extents(struct f2fs_sb_info *sbi,
+				struct f2fs_dedup_batch *batch)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	unsigned int min_extent = READ_ONCE(dm->min_extent);
+	block_t addrs[DEDUP_BATCH_SIZE];
+	unsigned int i, j, start;
+
+	memset(batch->noshare, 0, sizeof(batch->noshare));
+	if (min_extent <= 1)
+		return;
+
+	for (i = 0; i < batch->nr; i++)
+		addrs[i] = !batch->hashed[i] ? NULL_ADDR :
+			dedup_peek_fp(dm, batch->digests[i]);
+
+	for (start = 0; start < batch->nr; start = i) {
+		/* both pages and blocks of a run are consecutive */
+		for (i = start + 1; i < batch->nr; i++) {
+			if (!__is_valid_data_blkaddr(addrs[start]))
+				break;
+			if (addrs[i] != addrs[i - 1] + 1 ||
+				batch->pages[i]->index !=
+					batch->pages[i - 1]->index + 1)
+				break;
+		}
+
+		if (!__is_valid_data_blkaddr(addrs[start]) ||
+				i - start >= min_extent)
+			continue;
+		if (!start || addrs[start - 1] == NEW_ADDR)
+			continue;
+		if (i == batch->nr || addrs[i] == NEW_ADDR)
+			continue;
+
+		for (j = start; j < i; j++)
+			batch->noshare[j] = true;
+		dedup_stat_add(dm, DEDUP_STAT_UNSHARED, i - start);
+	}
+}
+
+/*
+ * Fingerprint all pages of @batch.  The chunks after the first one go to
+ * the hash workqueue and the caller hashes the first one meanwhile, so
+ * hashing spreads over cpus while earlier bios are still in flight.
+ * Then hits too short to be shared as an extent are marked.
+ */
+void f2fs_dedup_hash_batch(struct f2fs_sb_info *sbi,
+				struct f2fs_dedup_batch *batch)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	unsigned int nr_works = DIV_ROUND_UP(batch->nr, DEDUP_HASH_CHUNK);
+	unsigned int i;
+
+	batch->sbi = sbi;
+	if (nr_works <= 1 || !dm->hash_wq) {
+		dedup_hash_chunk(batch, 0, batch->nr);
+		goto plan;
+	}
+
+	init_completion(&batch->done);
+	atomic_set(&batch->pending, nr_works - 1);
+	for (i = 1; i < nr_works; i++) {
+		struct dedup_hash_work *hw = &batch->works[i];
+
+		hw->batch = batch;
+		hw->start = i * DEDUP_HASH_CHUNK;
+		hw->end = min_t(unsigned int, batch->nr,
+					hw->start + DEDUP_HASH_CHUNK);
+		INIT_WORK(&hw->work, dedup_hash_workfn);
+		queue_work(dm->hash_wq, &hw->work);
+	}
+	dedup_hash_chunk(batch, 0, DEDUP_HASH_CHUNK);
+	wait_for_completion(&batch->done);
+plan:
+	dedup_plan_extents(sbi, batch);
+}
+
+/* lockless lookup of the crypt context of @blkaddr */
+static bool dedup_lookup_crypt(struct dedup_table *t, block_t blkaddr,
+						nid_t *ino, u32 *lblk)
+{
+	struct f2fs_dedup_crypt_entry *ce;
+	struct dedup_page_map *map;
+	struct dedup_stripe *s;
+	unsigned int home, idx, seq;
+	bool found;
+
+	rcu_read_lock();
+	map = rcu_dereference(t->map);
+	home = dedup_home_bucket(map, dedup_blk_hash(blkaddr));
+	s = dedup_stripe(t, home);
+	do {
+		seq = read_seqcount_begin(&s->seq);
+		idx = home;
+		ce = __lookup_crypt(map, &idx, blkaddr);
+		found = ce;
+		if (found) {
+			*ino = le32_to_cpu(READ_ONCE(ce->ino));
+			*lblk = le32_to_cpu(READ_ONCE(ce->lblk));
+		}
+	} while (read_seqcount_retry(&s->seq, seq));
+	rcu_read_unlock();
+
+	return found;
+}
+
+/* get owner @ino of shared ciphertext, from the cache if it is there */
+static struct inode *dedup_crypt_iget(struct f2fs_sb_info *sbi, nid_t ino)
+{
+	struct dedup_crypt_cache *cc = &DEDUP_I(sbi)->crypt_cache;
+	struct inode *inode = NULL, *old;
+	int i;
+
+	spin_lock(&cc->lock);
+	for (i = 0; i < DEDUP_CRYPT_INODES; i++) {
+		if (cc->inodes[i] && cc->inodes[i]->i_ino == ino) {
+			inode = cc->inodes[i];
+			ihold(inode);
+			break;
+		}
+	}
+	spin_unlock(&cc->lock);
+	if (inode)
+		return inode;
+
+	inode = f2fs_iget(sbi->sb, ino);
+	if (IS_ERR(inode))
+		return inode;
+	if (is_bad_inode(inode) || !IS_ENCRYPTED(inode)) {
+		iput(inode);
+		return ERR_PTR(-EFSCORRUPTED);
+	}
+
+	ihold(inode);
+	spin_lock(&cc->lock);
+	old = cc->inodes[cc->next];
+	cc->inodes[cc->next] = inode;
+	cc->next = (cc->next + 1) % DEDUP_CRYPT_INODES;
+	spin_unlock(&cc->lock);
+
+	if (old)
+		iput(old);
+	return inode;
+}
+
+/* let the owners of shared ciphertext go, before inodes are evicted */
+void f2fs_dedup_drop_crypt_inodes(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct inode *inodes[DEDUP_CRYPT_INODES];
+	int i;
+
+	if (!dm)
+		return;
+
+	spin_lock(&dm->crypt_cache.lock);
+	memcpy(inodes, dm->crypt_cache.inodes, sizeof(inodes));
+	memset(dm->crypt_cache.inodes, 0, sizeof(inodes));
+	spin_unlock(&dm->crypt_cache.lock);
+
+	for (i = 0; i < DEDUP_CRYPT_INODES; i++)
+		if (inodes[i])
+			iput(inodes[i]);
+}
+
+/*
+ * Find the file block the ciphertext read from @blkaddr into a page of
+ * @inode was encrypted for.  Return its inode with a reference held and
+ * its logical block in @lblk_num, or NULL if the block is @inode's own.
+ * This is a lookup by address and, mostly, a cache hit; nothing is
+ * hashed or read.
+ */
+struct inode *f2fs_dedup_crypt_owner(struct f2fs_sb_info *sbi,
+		block_t blkaddr, struct inode *inode, u64 *lblk_num)
+{
+	nid_t ino;
+	u32 lblk;
+
+	if (!f2fs_dedup_enabled(sbi) ||
+		!dedup_lookup_crypt(&DEDUP_I(sbi)->tables[DEDUP_CRYPT_TABLE],
+							blkaddr, &ino, &lblk))
+		return NULL;
+
+	if (ino == inode->i_ino && lblk == *lblk_num)
+		return NULL;
+
+	*lblk_num = lblk;
+	if (ino == inode->i_ino) {
+		ihold(inode);
+		return inode;
+	}
+	return dedup_crypt_iget(sbi, ino);
+}
+
+static void free_dedup_tables(struct f2fs_dedup_info *dm)
+{
+	int i;
+
+	for (i = 0; i < NR_DEDUP_TABLES; i++) {
+		struct dedup_table *t = &dm->tables[i];
+
+		free_page_map(dedup_map(t));
+		RCU_INIT_POINTER(t->map, NULL);
+		t->nr_pages = 0;
+		atomic_set(&t->nr_entries, 0);
+	}
+}
+
+/* a fingerprint table which is on disk already is left to be read @lazy */
+static int init_dedup_tables(struct f2fs_sb_info *sbi,
+				unsigned int *nr_pages, bool lazy)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	int i;
+
+	for (i = 0; i < NR_DEDUP_TABLES; i++) {
+		struct dedup_table *t = &dm->tables[i];
+		bool unread = lazy && i == DEDUP_FP_TABLE;
+		struct dedup_page_map *map;
+
+		map = alloc_page_map(sbi, t, nr_pages[i], unread);
+		if (!map) {
+			free_dedup_tables(dm);
+			return -ENOMEM;
+		}
+		RCU_INIT_POINTER(t->map, map);
+		t->nr_pages = nr_pages[i];
+		atomic_set(&t->nr_entries, 0);
+
+		if (unread) {
+			bitmap_set(dm->fp_unread, 0, nr_pages[i]);
+			atomic_set(&dm->fp_nr_unread, nr_pages[i]);
+			atomic_set(&dm->fp_evicted, nr_pages[i]);
+		}
+	}
+	return 0;
+}
+
+static int init_dedup_hash(struct f2fs_sb_info *sbi, unsigned int type)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	const char *driver = dedup_hash_algos[type].driver;
+	unsigned int cpu;
+
+	dm->fp_hash = type;
+	dm->fp_weak = dedup_hash_algos[type].weak;
+	if (!driver) {
+		dm->fp_size = BLAKE2S_HASH_SIZE;
+		return 0;
+	}
+
+	dm->fp_tfm = crypto_alloc_shash(driver, 0, 0);
+	if (IS_ERR(dm->fp_tfm)) {
+		int err = PTR_ERR(dm->fp_tfm);
+
+		f2fs_err(sbi, "Cannot load %s for dedup (%d)", driver, err);
+		dm->fp_tfm = NULL;
+		return err;
+	}
+
+	dm->fp_size = crypto_shash_digestsize(dm->fp_tfm);
+	/* a short digest must not pass for a strong one */
+	if (WARN_ON(dm->fp_size < sizeof(u64) ||
+		(!dm->fp_weak && dm->fp_size < DEDUP_FP_SIZE)))
+		return -EINVAL;
+
+	dm->fp_desc = __alloc_percpu(sizeof(struct shash_desc) +
+				crypto_shash_descsize(dm->fp_tfm),
+				__alignof__(struct shash_desc));
+	if (!dm->fp_desc)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu)
+		per_cpu_ptr(dm->fp_desc, cpu)->tfm = dm->fp_tfm;
+	return 0;
+}
+
+static int init_dedup_locks(struct f2fs_dedup_info *dm)
+{
+	int i, j, err;
+
+	spin_lock_init(&dm->crypt_cache.lock);
+	mutex_init(&dm->fp_shrink_lock);
+
+	for (i = 0; i < NR_DEDUP_TABLES; i++) {
+		struct dedup_table *t = &dm->tables[i];
+
+		err = percpu_init_rwsem(&t->resize_sem);
+		if (err)
+			return err;
+
+		for (j = 0; j < DEDUP_STRIPES; j++) {
+			spin_lock_init(&t->stripes[j].lock);
+			seqcount_spinlock_init(&t->stripes[j].seq,
+						&t->stripes[j].lock);
+		}
+	}
+	return 0;
+}
+
+/* a table is reserved large enough to index every block of main area */
+static unsigned int dedup_table_max_pages(struct f2fs_sb_info *sbi,
+							unsigned int slots)
+{
+	unsigned int blocks = MAIN_SEGS(sbi) << sbi->log_blocks_per_seg;
+	unsigned int pages = DIV_ROUND_UP(DIV_ROUND_UP(blocks, slots),
+						DEDUP_BUCKETS_PER_BLOCK);
+
+	return roundup_pow_of_two(max_t(unsigned int, pages,
+						DEDUP_MIN_TABLE_PAGES));
+}
+
+static void init_dedup_geometry(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	unsigned int blocks;
+	int i;
+
+	dm->tables[DEDUP_FP_TABLE].slots = DEDUP_FP_SLOTS;
+	dm->tables[DEDUP_CRYPT_TABLE].slots = DEDUP_CRYPT_SLOTS;
+	dm->tables[DEDUP_REF_TABLE].slots = DEDUP_REF_SLOTS;
+	dm->tables[DEDUP_OWNER_TABLE].slots = DEDUP_OWNER_SLOTS;
+
+	dm->table_blocks = 0;
+	for (i = 0; i < NR_DEDUP_TABLES; i++) {
+		struct dedup_table *t = &dm->tables[i];
+
+		t->max_pages = dedup_table_max_pages(sbi, t->slots);
+		t->start_blk = dm->table_blocks;
+		dm->table_blocks += t->max_pages;
+	}
+
+	dm->bitmap_size = DIV_ROUND_UP(dm->table_blocks, BITS_PER_BYTE);
+	dm->hdr_blocks = DIV_ROUND_UP(sizeof(struct f2fs_dedup_header) +
+					dm->bitmap_size, F2FS_BLKSIZE);
+
+	/* two header packs, two table sets and the anchor */
+	blocks = 2 * dm->hdr_blocks + 2 * dm->table_blocks + 1;
+	dm->segment_count = roundup(DIV_ROUND_UP(blocks, sbi->blocks_per_seg),
+							sbi->segs_per_sec);
+}
+
+/* the area is only trusted if SIT still shows it fully claimed */
+static bool dedup_area_claimed(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	unsigned int segno;
+
+	for (segno = dm->start_segno;
+			segno < dm->start_segno + dm->segment_count; segno++)
+		if (get_valid_blocks(sbi, segno, false) != sbi->blocks_per_seg)
+			return false;
+	return true;
+}
+
+/*
+ * The checkpoint says that there was a dedup area, yet it can't be read,
+ * e.g. since an fsck which doesn't know it gave its segments back as free.
+ * Blocks may still be shared with no refcount to tell, and freeing one
+ * for a single owner would corrupt the others, so only a read-only mount
+ * goes on, without dedup.
+ */
+static int dedup_area_lost(struct f2fs_sb_info *sbi)
+{
+	f2fs_err(sbi, "Dedup area at segno %u is lost, run a dedup-aware fsck",
+		 DEDUP_I(sbi)->start_segno);
+	set_sbi_flag(sbi, SBI_NEED_FSCK);
+	return f2fs_readonly(sbi->sb) ? 0 : -EFSCORRUPTED;
+}
+
+/* return true with the fingerprint algorithm of the area in @fp_hash */
+static bool read_dedup_anchor(struct f2fs_sb_info *sbi, unsigned int *fp_hash)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct f2fs_dedup_anchor *anchor;
+	struct page *page;
+	bool valid = false;
+	__u32 crc;
+	int i;
+
+	page = f2fs_get_meta_page(sbi, dedup_anchor_addr(sbi));
+	if (IS_ERR(page))
+		return false;
+
+	anchor = (struct f2fs_dedup_anchor *)page_address(page);
+	if (le32_to_cpu(anchor->magic) != F2FS_DEDUP_MAGIC)
+		goto out;
+
+	crc = le32_to_cpu(anchor->checksum);
+	anchor->checksum = 0;
+	if (!f2fs_crc_valid(sbi, crc, anchor, sizeof(*anchor))) {
+		anchor->checksum = cpu_to_le32(crc);
+		f2fs_warn(sbi, "Invalid dedup anchor crc: 0x%x", crc);
+		goto out;
+	}
+	anchor->checksum = cpu_to_le32(crc);
+
+	for (i = 0; i < NR_DEDUP_TABLES; i++)
+		if (le32_to_cpu(anchor->max_pages[i]) !=
+						dm->tables[i].max_pages)
+			break;
+
+	if (i < NR_DEDUP_TABLES ||
+		le32_to_cpu(anchor->fp_hash) >= DEDUP_HASH_MAX ||
+		le32_to_cpu(anchor->start_segno) != dm->start_segno ||
+		le32_to_cpu(anchor->segment_count) != dm->segment_count ||
+		le32_to_cpu(anchor->hdr_blocks) != dm->hdr_blocks ||
+		le32_to_cpu(anchor->table_blocks) != dm->table_blocks) {
+		f2fs_warn(sbi, "Dedup area geometry mismatch, segno:%u, count:%u",
+			  le32_to_cpu(anchor->start_segno),
+			  le32_to_cpu(anchor->segment_count));
+		goto out;
+	}
+	valid = dedup_area_claimed(sbi);
+	if (valid)
+		*fp_hash = le32_to_cpu(anchor->fp_hash);
+out:
+	f2fs_put_page(page, 1);
+	/* the block may belong to a file, don't leave it in meta cache */
+	if (!valid)
+		invalidate_mapping_pages(META_MAPPING(sbi),
+				dedup_anchor_addr(sbi), dedup_anchor_addr(sbi));
+	return valid;
+}
+
+static void write_dedup_anchor(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct f2fs_dedup_anchor *anchor;
+	struct page *page;
+	int i;
+
+	page = f2fs_grab_meta_page(sbi, dedup_anchor_addr(sbi));
+	memset(page_address(page), 0, PAGE_SIZE);
+	anchor = (struct f2fs_dedup_anchor *)page_address(page);
+	anchor->magic = cpu_to_le32(F2FS_DEDUP_MAGIC);
+	anchor->start_segno = cpu_to_le32(dm->start_segno);
+	anchor->segment_count = cpu_to_le32(dm->segment_count);
+	anchor->hdr_blocks = cpu_to_le32(dm->hdr_blocks);
+	anchor->table_blocks = cpu_to_le32(dm->table_blocks);
+	for (i = 0; i < NR_DEDUP_TABLES; i++)
+		anchor->max_pages[i] = cpu_to_le32(dm->tables[i].max_pages);
+	anchor->fp_hash = cpu_to_le32(dm->fp_hash);
+	anchor->checksum = cpu_to_le32(f2fs_crc32(sbi, anchor,
+							sizeof(*anchor)));
+	set_page_dirty(page);
+	f2fs_put_page(page, 1);
+}
+
+/* read header pack @pack into hdr_buf, return its version or 0 if invalid */
+static unsigned long long read_dedup_header(struct f2fs_sb_info *sbi,
+								int pack)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct f2fs_dedup_header *hdr = dm->hdr_buf;
+	unsigned long long version;
+	unsigned int i;
+	__u32 crc;
+
+	for (i = 0; i < dm->hdr_blocks; i++) {
+		struct page *page;
+
+		page = f2fs_get_meta_page(sbi, dedup_hdr_addr(sbi, pack) + i);
+		if (IS_ERR(page))
+			return 0;
+		memcpy(dm->hdr_buf + i * F2FS_BLKSIZE, page_address(page),
+								F2FS_BLKSIZE);
+		f2fs_put_page(page, 1);
+	}
+
+	if (le32_to_cpu(hdr->magic) != F2FS_DEDUP_MAGIC ||
+		le32_to_cpu(hdr->table_blocks) != dm->table_blocks ||
+		le32_to_cpu(hdr->bitmap_size) != dm->bitmap_size)
+		return 0;
+
+	crc = le32_to_cpu(hdr->checksum);
+	hdr->checksum = 0;
+	if (!f2fs_crc_valid(sbi, crc, hdr, dm->hdr_blocks * F2FS_BLKSIZE)) {
+		f2fs_warn(sbi, "Invalid dedup header crc, pack:%d", pack);
+		return 0;
+	}
+
+	for (i = 0; i < NR_DEDUP_TABLES; i++) {
+		unsigned int nr_pages = le32_to_cpu(hdr->nr_pages[i]);
+
+		if (nr_pages < DEDUP_MIN_TABLE_PAGES || !is_power_of_2(nr_pages) ||
+				nr_pages > dm->tables[i].max_pages) {
+			f2fs_warn(sbi, "Invalid dedup table size, pack:%d, table:%u, pages:%u",
+				  pack, i, nr_pages);
+			return 0;
+		}
+	}
+
+	/* a header written by a checkpoint which did not commit */
+	version = le64_to_cpu(hdr->version);
+	if (version > cur_cp_version(F2FS_CKPT(sbi)))
+		return 0;
+	return version;
+}
+
+static void write_dedup_header(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct f2fs_dedup_header *hdr = dm->hdr_buf;
+	int pack = dm->cur_hdr_pack ^ 1;
+	unsigned int i;
+
+	memset(hdr, 0, dm->hdr_blocks * F2FS_BLKSIZE);
+	hdr->magic = cpu_to_le32(F2FS_DEDUP_MAGIC);
+	hdr->version = cpu_to_le64(cur_cp_version(F2FS_CKPT(sbi)));
+	hdr->table_blocks = cpu_to_le32(dm->table_blocks);
+	hdr->bitmap_size = cpu_to_le32(dm->bitmap_size);
+	for (i = 0; i < NR_DEDUP_TABLES; i++)
+		hdr->nr_pages[i] = cpu_to_le32(dm->tables[i].nr_pages);
+	memcpy(hdr->ver_bitmap, dm->ver_bitmap, dm->bitmap_size);
+	hdr->checksum = cpu_to_le32(f2fs_crc32(sbi, hdr,
+					dm->hdr_blocks * F2FS_BLKSIZE));
+
+	for (i = 0; i < dm->hdr_blocks; i++)
+		f2fs_update_meta_page(sbi, dm->hdr_buf + i * F2FS_BLKSIZE,
+					dedup_hdr_addr(sbi, pack) + i);
+
+	dm->cur_hdr_pack = pack;
+	dm->hdr_version = le64_to_cpu(hdr->version);
+	dm->hdr_dirty = false;
+}
+
+/*
+ * Pick the newest committed header pack, like f2fs_get_valid_checkpoint(),
+ * and return the size of each table in @nr_pages.
+ */
+static int load_dedup_header(struct f2fs_sb_info *sbi, unsigned int *nr_pages)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct f2fs_dedup_header *hdr = dm->hdr_buf;
+	unsigned long long ver[2];
+	int pack, i;
+
+	ver[0] = read_dedup_header(sbi, 0);
+	ver[1] = read_dedup_header(sbi, 1);
+	if (!ver[0] && !ver[1])
+		return -EINVAL;
+
+	pack = ver[1] > ver[0] ? 1 : 0;
+	if (pack == 0)
+		read_dedup_header(sbi, 0);
+
+	memcpy(dm->ver_bitmap, hdr->ver_bitmap, dm->bitmap_size);
+	for (i = 0; i < NR_DEDUP_TABLES; i++)
+		nr_pages[i] = le32_to_cpu(hdr->nr_pages[i]);
+	dm->cur_hdr_pack = pack;
+	dm->hdr_version = ver[pack];
+	return 0;
+}
+
+static int load_dedup_table(struct f2fs_sb_info *sbi, struct dedup_table *t)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct dedup_page_map *map = dedup_map(t);
+	unsigned int readed, start_blk = t->start_blk;
+	unsigned int end_blk = t->start_blk + t->nr_pages;
+	unsigned int blkno;
+
+	do {
+		readed = f2fs_ra_meta_pages(sbi, start_blk,
+				min_t(unsigned int, end_blk - start_blk,
+					BIO_MAX_VECS), META_DEDUP, true);
+
+		for (blkno = start_blk; blkno < start_blk + readed; blkno++) {
+			unsigned int pg = blkno - t->start_blk;
+			struct page *page;
+
+			page = f2fs_get_meta_page(sbi,
+					current_dedup_addr(sbi, blkno));
+			if (IS_ERR(page))
+				return PTR_ERR(page);
+			memcpy(map->pages[pg], page_address(page), F2FS_BLKSIZE);
+			f2fs_put_page(page, 1);
+
+			atomic_add(count_page_entries(dm, t, map, pg),
+							&t->nr_entries);
+		}
+		start_blk += readed;
+	} while (readed && start_blk < end_blk);
+
+	return 0;
+}
+
+/*
+ * Read the unread fingerprint pages of @work's range, a readahead batch
+ * at a time, while max_fp_pages leaves room for them, and only scan the
+ * rest for their filters.  Until all are read or scanned the table holds
+ * more entries than it counts, and only grows once a bucket is full.
+ */
+static void dedup_load_workfn(struct work_struct *work)
+{
+	struct dedup_loader *ld = container_of(work, struct dedup_loader,
+								work);
+	struct f2fs_sb_info *sbi = ld->sbi;
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct dedup_table *t = &dm->tables[DEDUP_FP_TABLE];
+	unsigned int pg = ld->start;
+
+	while (pg < ld->end && !READ_ONCE(dm->stop_loading)) {
+		unsigned int budget = dedup_fp_budget(dm);
+		bool full = budget && READ_ONCE(t->nr_pages) -
+				atomic_read(&dm->fp_evicted) >= budget;
+		unsigned int end;
+
+		end = pg + f2fs_ra_meta_pages(sbi, t->start_blk + pg,
+				min_t(unsigned int, ld->end - pg, BIO_MAX_VECS),
+				META_DEDUP, false);
+		if (end == pg)
+			return;
+
+		for (; pg < end; pg++) {
+			struct dedup_page_map *map;
+			int err = 0;
+
+			/* none is left unread once the table grew */
+			if (!test_bit(pg, dm->fp_unread))
+				continue;
+
+			percpu_down_read(&t->resize_sem);
+			map = dedup_map(t);
+			if (map->pages[pg] == dedup_evicted && full)
+				err = dedup_scan_fp_page(sbi, t, map, pg);
+			else if (map->pages[pg] == dedup_evicted)
+				err = dedup_load_fp_page(sbi, t, map, pg);
+			dedup_table_put(t);
+			if (err)
+				return;
+		}
+		cond_resched();
+	}
+}
+
+/* split the unread fingerprint table among the loaders */
+static void dedup_start_loaders(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	unsigned int nr_pages = dm->tables[DEDUP_FP_TABLE].nr_pages;
+	unsigned int nr = min_t(unsigned int, DEDUP_LOADERS,
+						num_online_cpus());
+	unsigned int i;
+
+	for (i = 0; i < DEDUP_LOADERS; i++) {
+		struct dedup_loader *ld = &dm->loaders[i];
+
+		INIT_WORK(&ld->work, dedup_load_workfn);
+		ld->sbi = sbi;
+		ld->start = ld->end = 0;
+	}
+
+	/* read on demand only, with no writes to look up for */
+	if (f2fs_readonly(sbi->sb))
+		return;
+
+	for (i = 0; i < nr; i++) {
+		struct dedup_loader *ld = &dm->loaders[i];
+
+		ld->start = nr_pages / nr * i;
+		ld->end = i == nr - 1 ? nr_pages : nr_pages / nr * (i + 1);
+		queue_work(system_unbound_wq, &ld->work);
+	}
+}
+
+/* wait for the loaders, meta mapping must outlive them */
+void f2fs_stop_dedup_loaders(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	int i;
+
+	if (!dm || !dm->loaders[0].sbi)
+		return;
+
+	WRITE_ONCE(dm->stop_loading, true);
+	for (i = 0; i < DEDUP_LOADERS; i++)
+		cancel_work_sync(&dm->loaders[i].work);
+}
+
+/*
+ * Sum up the extra references into each segment once the index is read,
+ * and count the indexed blocks by refcount.
+ */
+static void init_dedup_seg_refs(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct dedup_table *rt = &dm->tables[DEDUP_REF_TABLE];
+	struct dedup_page_map *map = dedup_map(rt);
+	unsigned int idx, i;
+
+	for (idx = 0; idx < map->nr_pages * DEDUP_BUCKETS_PER_BLOCK; idx++) {
+		struct f2fs_dedup_ref_bucket *b = dedup_bucket(map, idx);
+
+		for (i = 0; i < DEDUP_REF_SLOTS; i++) {
+			block_t blkaddr = le32_to_cpu(b->entries[i].blkaddr);
+			u32 ref = le32_to_cpu(b->entries[i].ref);
+
+			if (blkaddr != NULL_ADDR)
+				dedup_ref_stat(dm, 0, ref);
+			if (ref < 2 || !__is_valid_data_blkaddr(blkaddr) ||
+				GET_SEGNO(sbi, blkaddr) >= MAIN_SEGS(sbi))
+				continue;
+			dedup_seg_refs_add(sbi, blkaddr, ref - 1);
+		}
+	}
+}
+
+/*
+ * Reserve the dedup area on a volume which does not have one yet.  This
+ * runs after roll-forward recovery so that no recovered block can land in
+ * the segments being claimed; the claim and the anchor become durable with
+ * the next checkpoint, and until then the tables are only kept in memory.
+ */
+void f2fs_create_dedup_area(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	block_t area_blocks;
+	int err, i;
+
+	if (!dm || dm->enabled || !dm->tables[DEDUP_FP_TABLE].map)
+		return;
+
+	if (f2fs_readonly(sbi->sb) || f2fs_hw_is_readonly(sbi))
+		return;
+
+	/* dedup area is updated in place */
+	if (f2fs_sb_has_blkzoned(sbi)) {
+		f2fs_info(sbi, "Dedup is not supported on zoned block device");
+		return;
+	}
+
+	if (dm->segment_count * DEDUP_AREA_MAX_RATIO > MAIN_SEGS(sbi)) {
+		f2fs_info(sbi, "Volume is too small for dedup area (%u segments)",
+			  dm->segment_count);
+		return;
+	}
+
+	area_blocks = dm->segment_count << sbi->log_blocks_per_seg;
+	if (sbi->user_block_count - valid_user_blocks(sbi) < area_blocks) {
+		f2fs_info(sbi, "No space left for dedup area");
+		return;
+	}
+
+	err = f2fs_claim_segments(sbi, dm->start_segno, dm->segment_count);
+	if (err) {
+		f2fs_info(sbi, "Failed to reserve dedup area at segno %u (%d)",
+			  dm->start_segno, err);
+		return;
+	}
+
+	write_dedup_anchor(sbi);
+
+	memset(dm->ver_bitmap, 0, dm->bitmap_size);
+	/* every page in use must be valid on disk once there is a header */
+	for (i = 0; i < NR_DEDUP_TABLES; i++)
+		bitmap_set(dm->dirty_bitmap, dm->tables[i].start_blk,
+						dm->tables[i].nr_pages);
+	dm->cur_hdr_pack = 1;
+	dm->hdr_version = 0;
+	dm->hdr_dirty = true;
+	dm->enabled = true;
+
+	f2fs_notice(sbi, "Created dedup area: segno %u, %u segments",
+		    dm->start_segno, dm->segment_count);
+}
+
+/*
+ * Write the table blocks changed since the last checkpoint into their
+ * spare copies, followed by a header pack pointing at them.  Called from
+ * f2fs_write_checkpoint() with cp_global_sem held and FS operations
+ * blocked; the pages reach the disk with the other meta pages before the
+ * checkpoint pack is committed.
+ */
+void f2fs_flush_dedup_entries(struct f2fs_sb_info *sbi, struct cp_control *cpc)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	u64 start = ktime_get_ns();
+	unsigned int nr_flushed = 0;
+	int i;
+
+	if (!f2fs_dedup_enabled(sbi))
+		return;
+
+	/* keep the table sizes stable until the header is written */
+	for (i = 0; i < NR_DEDUP_TABLES; i++)
+		percpu_down_read(&dm->tables[i].resize_sem);
+
+	for (i = 0; i < NR_DEDUP_TABLES; i++) {
+		struct dedup_table *t = &dm->tables[i];
+		struct dedup_page_map *map = dedup_map(t);
+		unsigned long blkno = t->start_blk;
+
+		for_each_set_bit_from(blkno, dm->dirty_bitmap,
+					t->start_blk + map->nr_pages) {
+			unsigned int pg = blkno - t->start_blk;
+			struct dedup_stripe *s;
+			struct page *page;
+
+			page = f2fs_grab_meta_page(sbi,
+					next_dedup_addr(sbi, blkno));
+
+			/*
+			 * a clean page may be evicted and read back from
+			 * its current copy, so switch copies along with it
+			 */
+			s = dedup_stripe(t, pg * DEDUP_BUCKETS_PER_BLOCK);
+			spin_lock(&s->lock);
+			memcpy(page_address(page), map->pages[pg],
+							F2FS_BLKSIZE);
+			f2fs_change_bit(blkno, dm->ver_bitmap);
+			clear_bit(blkno, dm->dirty_bitmap);
+			clear_bit(blkno, dm->staged_bitmap);
+			spin_unlock(&s->lock);
+
+			set_page_dirty(page);
+			f2fs_put_page(page, 1);
+			dm->hdr_dirty = true;
+			nr_flushed++;
+		}
+
+		/* pages staged by a grow are written, only switch copies */
+		blkno = t->start_blk;
+		for_each_set_bit_from(blkno, dm->staged_bitmap,
+					t->start_blk + map->nr_pages) {
+			struct dedup_stripe *s = dedup_stripe(t,
+				(blkno - t->start_blk) * DEDUP_BUCKETS_PER_BLOCK);
+
+			spin_lock(&s->lock);
+			f2fs_change_bit(blkno, dm->ver_bitmap);
+			clear_bit(blkno, dm->staged_bitmap);
+			spin_unlock(&s->lock);
+			dm->hdr_dirty = true;
+		}
+	}
+
+	if (dm->hdr_dirty)
+		write_dedup_header(sbi);
+
+	for (i = 0; i < NR_DEDUP_TABLES; i++)
+		percpu_up_read(&dm->tables[i].resize_sem);
+
+	dedup_stat_add(dm, DEDUP_STAT_FLUSH, 1);
+	dedup_stat_add(dm, DEDUP_STAT_FLUSH_BLK, nr_flushed);
+	dedup_stat_add(dm, DEDUP_STAT_FLUSH_NS, ktime_get_ns() - start);
+	f2fs_update_dedup_latency(sbi, DEDUP_LAT_FLUSH, start);
+
+	/* pages just written are clean, and can go if over the cap */
+	dedup_balance_fp(sbi);
+}
+
+/*
+ * Return the inode owning the block at @blkaddr as told by its summary
+ * entry, with the index of the block in @bidx, or NULL if the block is no
+ * longer alive or its owner is not a candidate of offline dedup.
+ */
+static struct inode *dedup_block_owner(struct f2fs_sb_info *sbi,
+		struct f2fs_summary *sum, block_t blkaddr, pgoff_t *bidx)
+{
+	nid_t nid = le32_to_cpu(sum->nid);
+	unsigned int ofs_in_node = le16_to_cpu(sum->ofs_in_node);
+	struct node_info ni;
+	struct page *node_page;
+	struct inode *inode;
+	unsigned int nofs;
+	block_t source_blkaddr;
+
+	node_page = f2fs_get_node_page(sbi, nid);
+	if (IS_ERR(node_page))
+		return NULL;
+
+	if (f2fs_get_node_info(sbi, nid, &ni, false) ||
+			f2fs_check_nid_range(sbi, ni.ino)) {
+		f2fs_put_page(node_page, 1);
+		return NULL;
+	}
+
+	nofs = ofs_of_node(node_page);
+	source_blkaddr = data_blkaddr(NULL, node_page, ofs_in_node);
+	f2fs_put_page(node_page, 1);
+
+	if (source_blkaddr != blkaddr)
+		return NULL;
+
+	inode = f2fs_iget(sbi->sb, ni.ino);
+	if (IS_ERR(inode))
+		return NULL;
+
+	/* encrypted or compressed data can't be compared in page cache */
+	if (is_bad_inode(inode) || !S_ISREG(inode->i_mode) ||
+			f2fs_post_read_required(inode) ||
+			f2fs_is_pinned_file(inode) ||
+			f2fs_is_atomic_file(inode) ||
+			!f2fs_dedup_file(inode)) {
+		iput(inode);
+		return NULL;
+	}
+
+	*bidx = f2fs_start_bidx_of_node(nofs, inode) + ofs_in_node;
+	return inode;
+}
+
+/*
+ * Point the block of @inode held in locked @page, still at @blkaddr, to an
+ * equal block if the index knows one.  Otherwise index @blkaddr as the
+ * first copy if @index.  The caller holds f2fs_lock_op().
+ * Return true if the block was merged and @blkaddr freed.
+ */
+static bool __dedup_merge_page(struct f2fs_sb_info *sbi,
+		struct inode *inode, struct page *page, block_t blkaddr,
+		const u8 *digest, bool zero, bool index)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct dnode_of_data dn;
+	block_t new_blkaddr;
+	bool merged = false;
+	u32 addr;
+
+	set_new_dnode(&dn, inode, NULL, NULL, 0);
+	if (f2fs_get_dnode_of_data(&dn, page->index, LOOKUP_NODE))
+		return false;
+
+	if (dn.data_blkaddr != blkaddr)
+		goto put_dnode;
+
+	if (zero) {
+		f2fs_update_data_blkaddr(&dn, NEW_ADDR);
+		f2fs_dedup_zero_block(sbi, blkaddr);
+		merged = true;
+		goto put_dnode;
+	}
+
+	if (!dedup_lookup_fp(sbi, &dm->tables[DEDUP_FP_TABLE],
+						digest, &addr)) {
+		/* the first copy, later ones are merged into it */
+		if (index)
+			f2fs_dedup_insert_block(sbi, digest, blkaddr);
+		goto put_dnode;
+	}
+
+	if (addr == blkaddr || !f2fs_dedup_share_block(sbi, digest, page,
+							false, &new_blkaddr))
+		goto put_dnode;
+
+	f2fs_update_data_blkaddr(&dn, new_blkaddr);
+	f2fs_dedup_add_owner(sbi, new_blkaddr, dn.nid, dn.ofs_in_node);
+	f2fs_dedup_release_block(sbi, blkaddr);
+	f2fs_dedup_cache_block(sbi, page, new_blkaddr);
+	merged = true;
+put_dnode:
+	f2fs_put_dnode(&dn);
+	return merged;
+}
+
+/*
+ * Fingerprint block @bidx of @inode, still at @blkaddr, and point its
+ * dnode to an equal block if the index knows one.  Return true if the
+ * block was merged and @blkaddr freed.
+ */
+static bool dedup_merge_block(struct f2fs_sb_info *sbi, struct inode *inode,
+					pgoff_t bidx, block_t blkaddr)
+{
+	struct page *page;
+	u8 digest[DEDUP_FP_SIZE];
+	bool merged = false;
+	bool zero;
+
+	/* keep GC and direct IO away from the block */
+	if (!f2fs_down_write_trylock(&F2FS_I(inode)->i_gc_rwsem[WRITE]))
+		return false;
+
+	page = f2fs_get_lock_data_page(inode, bidx, false);
+	if (IS_ERR(page))
+		goto out;
+
+	/* the page will be written and logged again */
+	if (PageDirty(page) || PageWriteback(page))
+		goto put_page;
+
+	zero = f2fs_dedup_zero_page(page);
+	if (!zero && f2fs_dedup_fingerprint(sbi, page, digest))
+		goto put_page;
+
+	f2fs_lock_op(sbi);
+	merged = __dedup_merge_page(sbi, inode, page, blkaddr, digest,
+							zero, true);
+	f2fs_unlock_op(sbi);
+put_page:
+	f2fs_put_page(page, 1);
+out:
+	f2fs_up_write(&F2FS_I(inode)->i_gc_rwsem[WRITE]);
+	return merged;
+}
+
+/*
+ * GC is about to migrate block @blkaddr of @inode, whose data it holds in
+ * locked @page, and the caller holds i_gc_rwsem.  Merge the block into an
+ * equal one instead if the index knows one, and return true: there is
+ * nothing left to copy.  Otherwise @hashed tells whether @digest holds the
+ * fingerprint to index the copy with.
+ */
+bool f2fs_dedup_gc_merge(struct inode *inode, struct page *page,
+			block_t blkaddr, u8 *digest, bool *hashed)
+{
+	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
+	bool merged;
+	bool zero;
+
+	*hashed = false;
+	if (!f2fs_dedup_enabled(sbi) || !READ_ONCE(DEDUP_I(sbi)->gc_merge))
+		return false;
+
+	/* encrypted or compressed data can't be compared in page cache */
+	if (!f2fs_dedup_file(inode) || f2fs_post_read_required(inode) ||
+			f2fs_is_atomic_file(inode) ||
+			f2fs_is_pinned_file(inode))
+		return false;
+
+	/* newer data is on its way to disk, with its own lookup */
+	if (!PageUptodate(page) || PageDirty(page) || PageWriteback(page))
+		return false;
+
+	zero = f2fs_dedup_zero_page(page);
+	if (!zero && f2fs_dedup_fingerprint(sbi, page, digest))
+		return false;
+
+	/* see f2fs_do_write_data_page() for why not to wait for it */
+	if (!f2fs_trylock_op(sbi))
+		return false;
+	merged = __dedup_merge_page(sbi, inode, page, blkaddr, digest,
+							zero, false);
+	f2fs_unlock_op(sbi);
+
+	if (merged)
+		dedup_stat_add(DEDUP_I(sbi), DEDUP_STAT_GC_MERGED, 1);
+	else
+		*hashed = !zero;
+	return merged;
+}
+
+/*
+ * Merge the duplicate blocks of data segment @segno.  Return the number
+ * of merged blocks, or -EAGAIN if the fs got busy in the middle.
+ */
+static int dedup_scan_segment(struct f2fs_sb_info *sbi, unsigned int segno,
+					struct f2fs_summary_block *sum_blk)
+{
+	struct sit_info *sit_i = SIT_I(sbi);
+	block_t start_addr = START_BLOCK(sbi, segno);
+	unsigned int usable_blks = f2fs_usable_blks_in_seg(sbi, segno);
+	struct page *sum_page;
+	unsigned int off;
+	int merged = 0;
+
+	/* work on a copy, SSA pages are locked by block replacement */
+	sum_page = f2fs_get_sum_page(sbi, segno);
+	if (IS_ERR(sum_page))
+		return 0;
+	memcpy(sum_blk, page_address(sum_page), F2FS_BLKSIZE);
+	f2fs_put_page(sum_page, 1);
+
+	if (GET_SUM_TYPE(&sum_blk->footer) != SUM_TYPE_DATA)
+		return 0;
+
+	for (off = 0; off < usable_blks; off++) {
+		struct inode *inode;
+		pgoff_t bidx;
+		bool valid;
+
+		if (kthread_should_stop() || !is_idle(sbi, GC_TIME))
+			return -EAGAIN;
+
+		down_read(&sit_i->sentry_lock);
+		valid = f2fs_test_bit(off,
+				get_seg_entry(sbi, segno)->cur_valid_map);
+		up_read(&sit_i->sentry_lock);
+		if (!valid)
+			continue;
+
+		inode = dedup_block_owner(sbi, &sum_blk->entries[off],
+						start_addr + off, &bidx);
+		if (!inode)
+			continue;
+
+		if (dedup_merge_block(sbi, inode, bidx, start_addr + off))
+			merged++;
+		iput(inode);
+		cond_resched();
+	}
+	return merged;
+}
+
+/*
+ * Scan up to DEDUP_SCAN_SEGMENTS cold segments written since their last
+ * scan.  Return the number of merged blocks, or -ENODATA if no segment
+ * is waiting for a scan.
+ */
+static int dedup_offline_round(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct f2fs_dedup_kthread *dt = dm->dedup_thread;
+	unsigned long long now = get_mtime(sbi, false);
+	unsigned int segno = dt->next_segno;
+	unsigned int scanned = 0, seen = 0;
+	int merged = 0, ret;
+
+	while (scanned < DEDUP_SCAN_SEGMENTS && seen < MAIN_SEGS(sbi)) {
+		struct seg_entry *se;
+
+		segno = find_next_bit(dm->offline_segmap, MAIN_SEGS(sbi),
+								segno);
+		if (segno >= MAIN_SEGS(sbi)) {
+			/* wrap around once */
+			if (!dt->next_segno)
+				break;
+			dt->next_segno = 0;
+			segno = 0;
+			continue;
+		}
+		seen++;
+
+		se = get_seg_entry(sbi, segno);
+		if (IS_CURSEG(sbi, segno) ||
+				se->mtime + DEDUP_COLD_SEG_AGE > now) {
+			segno++;
+			continue;
+		}
+
+		clear_bit(segno, dm->offline_segmap);
+		if (!IS_DATASEG(se->type) || !get_valid_blocks(sbi, segno,
+								false)) {
+			segno++;
+			continue;
+		}
+
+		ret = dedup_scan_segment(sbi, segno, dt->sum_blk);
+		if (ret < 0) {
+			/* the rest of the segment is left for next round */
+			set_bit(segno, dm->offline_segmap);
+			break;
+		}
+		merged += ret;
+		scanned++;
+		segno++;
+	}
+
+	dt->next_segno = segno < MAIN_SEGS(sbi) ? segno : 0;
+	if (!scanned && !merged &&
+			find_first_bit(dm->offline_segmap, MAIN_SEGS(sbi)) >=
+							MAIN_SEGS(sbi))
+		return -ENODATA;
+	return merged;
+}
+
+static inline void dedup_increase_sleep_time(struct f2fs_dedup_kthread *dt,
+							unsigned int *wait)
+{
+	if (*wait == dt->no_dedup_sleep_time)
+		return;
+
+	if ((long long)*wait + dt->min_sleep_time > dt->max_sleep_time)
+		*wait = dt->max_sleep_time;
+	else
+		*wait += dt->min_sleep_time;
+}
+
+static inline void dedup_decrease_sleep_time(struct f2fs_dedup_kthread *dt,
+							unsigned int *wait)
+{
+	if (*wait == dt->no_dedup_sleep_time)
+		*wait = dt->max_sleep_time;
+
+	if ((long long)*wait - dt->min_sleep_time < dt->min_sleep_time)
+		*wait = dt->min_sleep_time;
+	else
+		*wait -= dt->min_sleep_time;
+}
+
+static int dedup_thread_func(void *data)
+{
+	struct f2fs_sb_info *sbi = data;
+	struct f2fs_dedup_kthread *dt = DEDUP_I(sbi)->dedup_thread;
+	wait_queue_head_t *wq = &dt->dedup_wait_queue_head;
+	unsigned int wait_ms = dt->min_sleep_time;
+	int ret;
+
+	set_freezable();
+	do {
+		wait_event_interruptible_timeout(*wq,
+				kthread_should_stop() || freezing(current),
+				msecs_to_jiffies(wait_ms));
+
+		if (try_to_freeze())
+			continue;
+		if (kthread_should_stop())
+			break;
+
+		if (sbi->sb->s_writers.frozen >= SB_FREEZE_WRITE) {
+			dedup_increase_sleep_time(dt, &wait_ms);
+			continue;
+		}
+
+		if (!sb_start_write_trylock(sbi->sb))
+			continue;
+
+		/* stay out of the way of foreground IO */
+		if (!is_idle(sbi, GC_TIME)) {
+			dedup_increase_sleep_time(dt, &wait_ms);
+			goto next;
+		}
+
+		ret = dedup_offline_round(sbi);
+		if (ret == -ENODATA)
+			wait_ms = dt->no_dedup_sleep_time;
+		else if (ret > 0)
+			dedup_decrease_sleep_time(dt, &wait_ms);
+		else
+			dedup_increase_sleep_time(dt, &wait_ms);
+next:
+		sb_end_write(sbi->sb);
+	} while (!kthread_should_stop());
+	return 0;
+}
+
+int f2fs_start_dedup_thread(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct f2fs_dedup_kthread *dt;
+	dev_t dev = sbi->sb->s_bdev->bd_dev;
+	int err = 0;
+
+	if (!f2fs_dedup_enabled(sbi) || dm->dedup_thread)
+		return 0;
+
+	dt = f2fs_kzalloc(sbi, sizeof(struct f2fs_dedup_kthread), GFP_KERNEL);
+	if (!dt)
+		return -ENOMEM;
+
+	dt->sum_blk = f2fs_kmalloc(sbi, F2FS_BLKSIZE, GFP_KERNEL);
+	if (!dt->sum_blk) {
+		kfree(dt);
+		return -ENOMEM;
+	}
+
+	dt->min_sleep_time = DEF_DEDUP_THREAD_MIN_SLEEP_TIME;
+	dt->max_sleep_time = DEF_DEDUP_THREAD_MAX_SLEEP_TIME;
+	dt->no_dedup_sleep_time = DEF_DEDUP_THREAD_NODEDUP_SLEEP_TIME;
+
+	dm->dedup_thread = dt;
+	init_waitqueue_head(&dt->dedup_wait_queue_head);
+	dt->f2fs_dedup_task = kthread_run(dedup_thread_func, sbi,
+			"f2fs_dedup-%u:%u", MAJOR(dev), MINOR(dev));
+	if (IS_ERR(dt->f2fs_dedup_task)) {
+		err = PTR_ERR(dt->f2fs_dedup_task);
+		kfree(dt->sum_blk);
+		kfree(dt);
+		dm->dedup_thread = NULL;
+	}
+	return err;
+}
+
+void f2fs_stop_dedup_thread(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct f2fs_dedup_kthread *dt = dm ? dm->dedup_thread : NULL;
+
+	if (!dt)
+		return;
+	kthread_stop(dt->f2fs_dedup_task);
+	kfree(dt->sum_blk);
+	kfree(dt);
+	dm->dedup_thread = NULL;
+}
+
+int f2fs_build_dedup_manager(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_dedup_info *dm;
+	unsigned int nr_pages[NR_DEDUP_TABLES];
+	unsigned int fp_hash;
+	bool anchor_valid;
+	int err, i;
+
+	dm = f2fs_kzalloc(sbi, sizeof(struct f2fs_dedup_info), GFP_KERNEL);
+	if (!dm)
+		return -ENOMEM;
+	sbi->dedup_info = dm;
+
+	err = init_dedup_locks(dm);
+	if (err)
+		return err;
+	init_dedup_geometry(sbi);
+
+	dm->stats = alloc_percpu(struct f2fs_dedup_stat);
+	if (!dm->stats)
+		return -ENOMEM;
+	dm->bypass_ratio = DEF_DEDUP_BYPASS_RATIO;
+	dm->min_extent = DEF_DEDUP_MIN_EXTENT;
+	dm->cold_refs = DEF_DEDUP_COLD_REFS;
+
+	/* no room for a dedup area on this volume */
+	if (dm->segment_count * DEDUP_AREA_MAX_RATIO > MAIN_SEGS(sbi))
+		return 0;
+
+	dm->start_segno = MAIN_SEGS(sbi) - dm->segment_count;
+	dm->dedup_base_addr = START_BLOCK(sbi, dm->start_segno);
+
+	/* fingerprints in an existing area tell which algorithm to keep */
+	fp_hash = F2FS_OPTION(sbi).dedup_hash;
+	anchor_valid = read_dedup_anchor(sbi, &fp_hash);
+	if (!anchor_valid && is_set_ckpt_flags(sbi, CP_DEDUP_AREA_FLAG))
+		return dedup_area_lost(sbi);
+	if (anchor_valid && fp_hash != F2FS_OPTION(sbi).dedup_hash)
+		f2fs_warn(sbi, "Dedup area is indexed by %s, ignore dedup_hash=%s",
+			  f2fs_dedup_hash_name(fp_hash),
+			  f2fs_dedup_hash_name(F2FS_OPTION(sbi).dedup_hash));
+
+	err = init_dedup_hash(sbi, fp_hash);
+	if (err)
+		return err;
+
+	/* writeback waits for it, so it must make progress under reclaim */
+	dm->hash_wq = alloc_workqueue("f2fs_dedup_wq",
+				WQ_UNBOUND | WQ_HIGHPRI | WQ_MEM_RECLAIM,
+				num_online_cpus());
+	if (!dm->hash_wq)
+		return -ENOMEM;
+
+	dm->ver_bitmap = f2fs_kvzalloc(sbi, dm->bitmap_size, GFP_KERNEL);
+	dm->dirty_bitmap = f2fs_kvzalloc(sbi,
+			f2fs_bitmap_size(dm->table_blocks), GFP_KERNEL);
+	dm->staged_bitmap = f2fs_kvzalloc(sbi,
+			f2fs_bitmap_size(dm->table_blocks), GFP_KERNEL);
+	dm->hdr_buf = f2fs_kvzalloc(sbi, dm->hdr_blocks * F2FS_BLKSIZE,
+								GFP_KERNEL);
+	dm->offline_segmap = f2fs_kvzalloc(sbi,
+			f2fs_bitmap_size(MAIN_SEGS(sbi)), GFP_KERNEL);
+	dm->seg_refs = f2fs_kvzalloc(sbi,
+			array_size(MAIN_SEGS(sbi), sizeof(atomic_t)), GFP_KERNEL);
+	dm->discard_segmap = f2fs_kvzalloc(sbi,
+			f2fs_bitmap_size(MAIN_SEGS(sbi)), GFP_KERNEL);
+	dm->cold_segmap = f2fs_kvzalloc(sbi,
+			f2fs_bitmap_size(MAIN_SEGS(sbi)), GFP_KERNEL);
+	dm->stuck_secmap = f2fs_kvzalloc(sbi,
+			f2fs_bitmap_size(MAIN_SECS(sbi)), GFP_KERNEL);
+	dm->fp_accessed = f2fs_kvzalloc(sbi,
+			f2fs_bitmap_size(dm->tables[DEDUP_FP_TABLE].max_pages),
+			GFP_KERNEL);
+	dm->fp_unread = f2fs_kvzalloc(sbi,
+			f2fs_bitmap_size(dm->tables[DEDUP_FP_TABLE].max_pages),
+			GFP_KERNEL);
+	if (!dm->ver_bitmap || !dm->dirty_bitmap || !dm->staged_bitmap ||
+		!dm->hdr_buf || !dm->offline_segmap || !dm->seg_refs ||
+		!dm->fp_accessed || !dm->fp_unread || !dm->discard_segmap ||
+		!dm->cold_segmap || !dm->stuck_secmap)
+		return -ENOMEM;
+
+	for (i = 0; i < NR_DEDUP_TABLES; i++)
+		nr_pages[i] = DEDUP_MIN_TABLE_PAGES;
+
+	/* a volume without dedup area gets one after recovery */
+	if (!anchor_valid)
+		return init_dedup_tables(sbi, nr_pages, false);
+
+	err = load_dedup_header(sbi, nr_pages);
+	if (err) {
+		if (is_set_ckpt_flags(sbi, CP_DEDUP_AREA_FLAG))
+			return dedup_area_lost(sbi);
+		f2fs_warn(sbi, "No valid dedup header, disable dedup");
+		return 0;
+	}
+
+	err = init_dedup_tables(sbi, nr_pages, true);
+	if (err)
+		return err;
+
+	for (i = 0; i < NR_DEDUP_TABLES; i++) {
+		if (i == DEDUP_FP_TABLE)
+			continue;
+		err = load_dedup_table(sbi, &dm->tables[i]);
+		if (err) {
+			f2fs_err(sbi, "Failed to load dedup tables (%d)", err);
+			return err;
+		}
+	}
+	init_dedup_seg_refs(sbi);
+	dm->enabled = true;
+	dedup_start_loaders(sbi);
+	return 0;
+}
+
+void f2fs_destroy_dedup_manager(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	int i;
+
+	if (!dm)
+		return;
+
+	f2fs_stop_dedup_loaders(sbi);
+	if (dm->hash_wq)
+		destroy_workqueue(dm->hash_wq);
+	free_dedup_tables(dm);
+	for (i = 0; i < NR_DEDUP_TABLES; i++)
+		percpu_free_rwsem(&dm->tables[i].resize_sem);
+	free_percpu(dm->fp_desc);
+	if (dm->fp_tfm)
+		crypto_free_shash(dm->fp_tfm);
+	kvfree(dm->ver_bitmap);
+	kvfree(dm->dirty_bitmap);
+	kvfree(dm->staged_bitmap);
+	kvfree(dm->hdr_buf);
+	kvfree(dm->offline_segmap);
+	kvfree(dm->seg_refs);
+	kvfree(dm->discard_segmap);
+	kvfree(dm->cold_segmap);
+	kvfree(dm->stuck_secmap);
+	kvfree(dm->fp_accessed);
+	kvfree(dm->fp_unread);
+	free_percpu(dm->stats);
+	sbi->dedup_info = NULL;
+	kfree(dm);
+}
+
+/* a writeback batch, kept off the stack and its lock dependencies */
+struct f2fs_dedup_batch *f2fs_dedup_alloc_batch(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_dedup_batch *batch;
+
+	batch = f2fs_kmem_cache_alloc(dedup_batch_slab, GFP_NOFS, false, sbi);
+	if (batch)
+		batch->nr = 0;
+	return batch;
+}
+
+void f2fs_dedup_free_batch(struct f2fs_dedup_batch *batch)
+{
+	if (batch)
+		kmem_cache_free(dedup_batch_slab, batch);
+}
+
+int __init f2fs_create_dedup_caches(void)
+{
+	/*
+	 * Not f2fs_kmem_cache_create(), which takes no alignment: a table
+	 * page must start on a bucket, so that no bucket straddles two
+	 * cache lines and a probe touches a single one.
+	 */
+	dedup_page_slab = kmem_cache_create("f2fs_dedup_page", F2FS_BLKSIZE,
+				DEDUP_BUCKET_SIZE, SLAB_RECLAIM_ACCOUNT, NULL);
+	if (!dedup_page_slab)
+		goto fail;
+
+	dedup_batch_slab = f2fs_kmem_cache_create("f2fs_dedup_batch",
+					sizeof(struct f2fs_dedup_batch));
+	if (!dedup_batch_slab)
+		goto destroy_dedup_page;
+	return 0;
+
+destroy_dedup_page:
+	kmem_cache_destroy(dedup_page_slab);
+fail:
+	return -ENOMEM;
+}
+
+void f2fs_destroy_dedup_caches(void)
+{
+	/* evicted pages are freed by rcu callbacks */
+	rcu_barrier();
+	kmem_cache_destroy(dedup_batch_slab);
+	kmem_cache_destroy(dedup_page_slab);
+}
+
+#ifdef CONFIG_F2FS_DEDUP_KUNIT_TEST
+#include "dedup-test.c"
+#endif
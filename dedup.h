@@ -0,0 +1,555 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * fs/f2fs/dedup.h
+ *
+ * In-memory index and on-disk area for block-level data deduplication.
+ */
+#ifndef __F2FS_DEDUP_H__
+#define __F2FS_DEDUP_H__
+
+#include <linux/pagevec.h>
+#include <linux/percpu-rwsem.h>
+#include <linux/seqlock.h>
+
+/*
+ * The dedup area occupies the last sections of the main area and is taken
+ * out of the allocator with all of its blocks marked valid in SIT:
+ *
+ *   | header pack #0 | header pack #1 | table set #0 | table set #1 | anchor |
+ *
+ * The anchor is the last block of the main area and describes where the
+ * area starts.  Every table block has two copies; the version bitmap in
+ * the current header pack says which set holds the live copy, and the
+ * header packs alternate between checkpoints the same way CP packs do.
+ *
+ * A table set holds the fingerprint, ciphertext, refcount and owner tables,
+ * each reserved at its maximum size.  A table block is a page of buckets in the
+ * same format as kept in memory, and only the first nr_pages blocks of a
+ * table, as recorded in the header, are in use.
+ */
+#define F2FS_DEDUP_MAGIC	0x44454455	/* "DEDU" */
+
+/*
+ * Set in every checkpoint once the tail of the main area is a dedup area,
+ * for fsck to leave its segments claimed, and for a mount to notice that
+ * the area is gone while blocks may still be shared.  Left to stick.
+ */
+#define CP_DEDUP_AREA_FLAG	0x00008000
+
+/*
+ * Digests are kept in 16 bytes whatever the algorithm: longer ones are
+ * truncated and a 64-bit one is zero padded.
+ */
+#define DEDUP_FP_SIZE		16	/* bytes of a block fingerprint */
+
+/* the second half of the fingerprint of a repeated-word block, "PATTERNS" */
+#define DEDUP_PATTERN_TAG	0x5041545445524e53ULL
+
+enum {
+	DEDUP_FP_TABLE,			/* fingerprint -> blkaddr */
+	DEDUP_CRYPT_TABLE,		/* blkaddr -> ino, lblk of ciphertext */
+	DEDUP_REF_TABLE,		/* blkaddr -> refcount */
+	DEDUP_OWNER_TABLE,		/* blkaddr -> dnodes sharing it */
+	NR_DEDUP_TABLES
+};
+
+struct f2fs_dedup_anchor {
+	__le32 magic;			/* F2FS_DEDUP_MAGIC */
+	__le32 checksum;		/* crc32 of this block */
+	__le32 start_segno;		/* first segment of the dedup area */
+	__le32 segment_count;		/* # of segments in the dedup area */
+	__le32 hdr_blocks;		/* # of blocks in one header pack */
+	__le32 table_blocks;		/* # of table blocks in one set */
+	__le32 max_pages[NR_DEDUP_TABLES]; /* reserved blocks of each table */
+	__le32 fp_hash;			/* fingerprint algorithm, DEDUP_HASH_* */
+} __packed;
+
+struct f2fs_dedup_header {
+	__le32 magic;			/* F2FS_DEDUP_MAGIC */
+	__le32 checksum;		/* crc32 of the whole header pack */
+	__le64 version;			/* checkpoint version of the flush */
+	__le32 table_blocks;		/* # of table blocks in one set */
+	__le32 bitmap_size;		/* bytes of the version bitmap */
+	__le32 nr_pages[NR_DEDUP_TABLES]; /* blocks in use of each table */
+	__u8 ver_bitmap[];		/* set holding the live copy */
+} __packed;
+
+/*
+ * Every bucket is one cache line.  The home bucket of a fingerprint comes
+ * straight from its leading bits, a probe compares the one-byte tags of a
+ * bucket before touching any fingerprint, and goes on to the next bucket
+ * of the same page only if an insert ever had to pass this one (F14 style
+ * overflow count), so a lookup usually costs a single cache miss.  Since
+ * a probe never leaves its page, a page is the unit of locking.
+ */
+#define DEDUP_BUCKET_SIZE	64
+#define DEDUP_BUCKETS_PER_BLOCK	(F2FS_BLKSIZE / DEDUP_BUCKET_SIZE)
+
+#define DEDUP_FP_SLOTS		3
+#define DEDUP_CRYPT_SLOTS	5
+#define DEDUP_REF_SLOTS		5
+#define DEDUP_OWNER_SLOTS	5
+#define DEDUP_OVERFLOW_MAX	U8_MAX	/* sticks once reached */
+
+struct f2fs_dedup_fp_entry {
+	__u8 fingerprint[DEDUP_FP_SIZE];
+	__le32 val;			/* blkaddr */
+} __packed;
+
+struct f2fs_dedup_fp_bucket {
+	__u8 tags[DEDUP_FP_SLOTS];	/* 0 means the slot is free */
+	__u8 overflow;			/* # of inserts which passed by */
+	struct f2fs_dedup_fp_entry entries[DEDUP_FP_SLOTS];
+} __packed;
+
+/*
+ * A ciphertext block can only be decrypted with the key and IV of the
+ * file block it was written for, which a file sharing it has to find by
+ * the block address it reads from.
+ */
+struct f2fs_dedup_crypt_entry {
+	__le32 blkaddr;			/* NULL_ADDR means the slot is free */
+	__le32 ino;			/* inode the block was encrypted for */
+	__le32 lblk;			/* its logical block in that inode */
+} __packed;
+
+struct f2fs_dedup_crypt_bucket {
+	__u8 overflow;			/* # of inserts which passed by */
+	__u8 reserved[3];
+	struct f2fs_dedup_crypt_entry entries[DEDUP_CRYPT_SLOTS];
+} __packed;
+
+struct f2fs_dedup_ref_entry {
+	__le32 blkaddr;			/* NULL_ADDR means the slot is free */
+	__le32 ref;			/* # of file blocks sharing it */
+	__le32 fphash;			/* home of its fingerprint entry */
+} __packed;
+
+struct f2fs_dedup_ref_bucket {
+	__u8 overflow;			/* # of inserts which passed by */
+	__u8 reserved[3];
+	struct f2fs_dedup_ref_entry entries[DEDUP_REF_SLOTS];
+} __packed;
+
+/*
+ * The summary entry of a block only names the dnode which wrote it; the
+ * dnodes which shared it later are kept in the owner table, several
+ * entries per block, so that GC can move the block once and remap them
+ * all.  An entry is not removed when its dnode lets the block go, GC
+ * checks every entry against its dnode and drops the stale ones.
+ */
+struct f2fs_dedup_owner_entry {
+	__le32 blkaddr;			/* NULL_ADDR means the slot is free */
+	__le32 nid;			/* dnode pointing to the block */
+	__le16 ofs_in_node;		/* slot of the block in the dnode */
+	__le16 reserved;
+} __packed;
+
+struct f2fs_dedup_owner_bucket {
+	__u8 overflow;			/* # of inserts which passed by */
+	__u8 reserved[3];
+	struct f2fs_dedup_owner_entry entries[DEDUP_OWNER_SLOTS];
+} __packed;
+
+/* tables start small and double up to their reserved size */
+#define DEDUP_MIN_TABLE_PAGES	4
+#define DEDUP_MAX_LOAD_FACTOR	87	/* % of slots in use before growing */
+
+/* the dedup area may not take more than 1/8 of the main area */
+#define DEDUP_AREA_MAX_RATIO	8
+
+/*
+ * Lookups run under RCU and retry on the seqcount of the stripe; inserts
+ * and refcount updates take the stripe lock of the page they touch.  The
+ * page map is only replaced by a grow, which holds resize_sem for write
+ * to keep updaters away, and is freed after a grace period.
+ */
+#define DEDUP_STRIPES		64	/* locks of a table, by bucket page */
+
+struct dedup_stripe {
+	spinlock_t lock;		/* serialize updates of its pages */
+	seqcount_spinlock_t seq;	/* to validate lockless lookups */
+} ____cacheline_aligned_in_smp;
+
+struct dedup_page_map {
+	unsigned int nr_pages;		/* # of pages in use, power of 2 */
+	unsigned long *filter;		/* of each fingerprint page */
+	void *pages[];			/* bucket pages */
+};
+
+/*
+ * An evicted fingerprint page leaves a blocked Bloom filter of its entries
+ * behind, so that most lookups missing in it are told without reading it
+ * back.  A fingerprint sets DEDUP_FILTER_HASHES bits within one of the
+ * page's DEDUP_FILTER_LINES cache lines, which a lookup reads alone.
+ * Entries only change while their page is in memory, so the filter is
+ * built each time the page goes and never has to delete.  A page not read
+ * since mount gets its filter once a loader has scanned it.
+ */
+#define DEDUP_FILTER_LINES	4
+#define DEDUP_FILTER_HASHES	3
+#define DEDUP_FILTER_SIZE	(DEDUP_FILTER_LINES * DEDUP_BUCKET_SIZE)
+#define DEDUP_FILTER_LINE_BITS	(DEDUP_BUCKET_SIZE * BITS_PER_BYTE)
+
+struct dedup_table {
+	struct dedup_page_map __rcu *map;	/* current bucket pages */
+	struct percpu_rw_semaphore resize_sem;	/* updaters vs. grow */
+	unsigned int nr_pages;		/* copy of map->nr_pages */
+	atomic_t nr_entries;		/* # of entries in use */
+	unsigned int max_pages;		/* # of pages reserved on disk */
+	unsigned int start_blk;		/* first table block in a set */
+	unsigned int slots;		/* # of entries in a bucket */
+	struct dedup_stripe stripes[DEDUP_STRIPES];
+};
+
+/*
+ * Writeback locks a pagevec worth of pages first and fingerprints them
+ * together, DEDUP_HASH_CHUNK pages per work on the hash workqueue, before
+ * any of them is allocated and submitted.
+ */
+#define DEDUP_BATCH_SIZE	PAGEVEC_SIZE
+#define DEDUP_HASH_CHUNK	4	/* pages hashed by one work */
+
+struct f2fs_dedup_batch;
+
+struct dedup_hash_work {
+	struct work_struct work;
+	struct f2fs_dedup_batch *batch;
+	unsigned int start, end;	/* pages of the batch to hash */
+};
+
+struct f2fs_dedup_batch {
+	struct f2fs_sb_info *sbi;
+	unsigned int nr;		/* # of pages gathered */
+	struct page *pages[DEDUP_BATCH_SIZE];	/* locked, clean for io */
+	u8 digests[DEDUP_BATCH_SIZE][DEDUP_FP_SIZE];
+	bool hashed[DEDUP_BATCH_SIZE];	/* digest is valid */
+	bool noshare[DEDUP_BATCH_SIZE];	/* hit too short, write it out */
+	atomic_t pending;		/* # of works still hashing */
+	struct completion done;		/* all works are finished */
+	struct dedup_hash_work works[DIV_ROUND_UP(DEDUP_BATCH_SIZE,
+							DEDUP_HASH_CHUNK)];
+};
+
+/*
+ * In offline mode the write path only marks the segments it writes to.
+ * The dedup thread wakes up like the GC thread, and once the segments
+ * have gone cold it fingerprints their valid blocks and points the dnode
+ * of every duplicate to the first copy, invalidating the duplicate.
+ */
+#define DEF_DEDUP_THREAD_MIN_SLEEP_TIME		10000	/* milliseconds */
+#define DEF_DEDUP_THREAD_MAX_SLEEP_TIME		60000
+#define DEF_DEDUP_THREAD_NODEDUP_SLEEP_TIME	300000	/* wait 5 min */
+#define DEDUP_COLD_SEG_AGE	30	/* seconds since a segment was updated */
+#define DEDUP_SCAN_SEGMENTS	4	/* segments scanned in a round */
+
+struct f2fs_dedup_kthread {
+	struct task_struct *f2fs_dedup_task;
+	wait_queue_head_t dedup_wait_queue_head;
+
+	/* for dedup sleep time */
+	unsigned int min_sleep_time;
+	unsigned int max_sleep_time;
+	unsigned int no_dedup_sleep_time;
+
+	unsigned int next_segno;	/* where the next round starts */
+	struct f2fs_summary_block *sum_blk;	/* copy of the scanned SSA */
+};
+
+/*
+ * The fingerprint table is not read at mount.  Its pages start out
+ * evicted and are read on first use, while up to DEDUP_LOADERS works
+ * read the rest in the background, each one a range of the table at a
+ * time.  Past what max_fp_pages leaves to them they only scan a page to
+ * build its filter.  The other tables are needed to free blocks, count
+ * against max_fp_pages, and are read at once.
+ */
+#define DEDUP_LOADERS		4
+
+struct dedup_loader {
+	struct work_struct work;
+	struct f2fs_sb_info *sbi;
+	unsigned int start, end;	/* fingerprint pages to read */
+};
+
+/*
+ * GC moves a shared block only once it has locked every owner, and leaves
+ * it in place if there are more, an extra owner costing a dnode update.
+ * Its section then can't be freed, and stays out of victim selection
+ * until a reference to one of its blocks goes away.
+ */
+#define DEDUP_GC_MAX_OWNERS	64
+
+/* a dnode pointing to a shared block, as collected for GC */
+struct f2fs_dedup_owner {
+	nid_t nid;			/* dnode holding the address */
+	unsigned int ofs_in_node;	/* slot of the address in it */
+	nid_t ino;			/* inode of the dnode */
+	unsigned int nofs;		/* offset of the dnode in the inode */
+	unsigned char version;		/* node version, for the summary */
+
+	/* kept by GC while it moves the block */
+	struct inode *inode;
+	struct page *page;		/* locked page of the block */
+	bool locked;			/* holds i_gc_rwsem of inode */
+};
+
+/*
+ * Files sharing encrypted blocks of a few others keep coming back to the
+ * same owners, whose inodes are kept around with their keys loaded.
+ */
+#define DEDUP_CRYPT_INODES	16
+
+struct dedup_crypt_cache {
+	spinlock_t lock;
+	unsigned int next;		/* slot to replace next */
+	struct inode *inodes[DEDUP_CRYPT_INODES];
+};
+
+/*
+ * A file whose writes share less than bypass_ratio percent of the blocks
+ * over a window stops being fingerprinted for a while, twice as long
+ * each time the next window fails too, and is sampled again after it.
+ */
+#define DEF_DEDUP_BYPASS_RATIO	1	/* %, 0 never bypasses */
+#define DEDUP_BYPASS_WINDOW	64	/* writes looked up per sample */
+#define DEDUP_BYPASS_MAX_SHIFT	6	/* up to 64 windows bypassed */
+
+/*
+ * Sharing a block in the middle of a file's run of sequential blocks
+ * splits its extent in three.  Within a batch, hits are only taken as
+ * runs of at least min_extent pages mapping to consecutive blocks, so a
+ * shared range stays one extent too.  A run at either end of the batch
+ * may go on in the next one and is always taken.
+ */
+#define DEF_DEDUP_MIN_EXTENT	1	/* blocks, 1 shares any hit */
+
+/*
+ * Shared blocks outlive the other blocks of the segment they were written
+ * to.  Once a block gets cold_refs references, its segment is marked in
+ * cold_segmap, and background GC moves the blocks shared that much to the
+ * cold data log, so that hot and warm segments can empty out.
+ */
+#define DEF_DEDUP_COLD_REFS	8	/* references, 0 never moves */
+#define DEDUP_COLD_SEGMENTS	4	/* segments cleared in a GC round */
+
+/*
+ * A compressed cluster is indexed by the fingerprint of its raw pages and
+ * of what decides how they compress, pointing to the first one of its
+ * compressed blocks, which are consecutive.  Block k of the cluster gets
+ * the fingerprint hash plus k as fphash, and the last one has the
+ * DEDUP_CLUSTER_END bit set too, so that a hit finds all of them by
+ * address.  Home buckets only take the low bits of fphash.
+ */
+#define DEDUP_CLUSTER_END	(1U << 31)
+
+static inline u32 dedup_cluster_tag(u32 fphash, unsigned int k, bool last)
+{
+	return ((fphash + k) & ~DEDUP_CLUSTER_END) |
+				(last ? DEDUP_CLUSTER_END : 0);
+}
+
+struct f2fs_dedup_stat {
+	u64 count[NR_DEDUP_STATS];	/* DEDUP_STAT_* */
+	/* indexed blocks by refcount, and blocks saved, as of this cpu */
+	s64 refs[DEDUP_REF_HIST_SIZE];
+	s64 saved;
+};
+
+struct f2fs_dedup_info {
+	/* dedup area geometry */
+	unsigned int start_segno;	/* first segment of the dedup area */
+	unsigned int segment_count;	/* # of segments in the dedup area */
+	block_t dedup_base_addr;	/* first block of the dedup area */
+	unsigned int hdr_blocks;	/* # of blocks in one header pack */
+	unsigned int table_blocks;	/* # of table blocks in one set */
+	unsigned int bitmap_size;	/* bytes of each bitmap */
+
+	/* in-memory index */
+	struct dedup_table tables[NR_DEDUP_TABLES];
+	atomic_t *seg_refs;		/* extra references into each segment */
+	unsigned long *discard_segmap;	/* segments coalescing frees */
+	unsigned long *cold_segmap;	/* segments with blocks to go cold */
+	unsigned long *stuck_secmap;	/* sections GC can't empty */
+
+	/* clean fingerprint pages are evicted, and read back when used */
+	unsigned int max_fp_pages;	/* table pages kept, 0: no cap */
+	atomic_t fp_evicted;		/* # of fingerprint pages evicted */
+	unsigned long *fp_accessed;	/* pages used since the clock passed */
+	unsigned int fp_clock;		/* next page to consider evicting */
+	struct mutex fp_shrink_lock;	/* one clock hand at a time */
+
+	/* fingerprint pages not read since mount, see DEDUP_LOADERS */
+	unsigned long *fp_unread;	/* their entries aren't counted yet */
+	atomic_t fp_nr_unread;		/* # of pages not read yet */
+	bool stop_loading;		/* loaders should give up */
+	struct dedup_loader loaders[DEDUP_LOADERS];
+
+	/* fingerprinting, a descriptor per cpu to avoid allocation */
+	struct crypto_shash *fp_tfm;
+	struct shash_desc __percpu *fp_desc;
+	unsigned int fp_hash;		/* algorithm in use, DEDUP_HASH_* */
+	unsigned int fp_size;		/* digest size of fp_tfm */
+	bool fp_weak;			/* matches are confirmed by reading */
+	struct workqueue_struct *hash_wq;	/* fingerprints batches */
+
+	unsigned int bypass_ratio;	/* hit % below which files bypass */
+	unsigned int min_extent;	/* shortest run of hits shared */
+	unsigned int gc_merge;		/* GC merges the blocks it moves */
+	unsigned int cold_refs;		/* refcount sending blocks cold */
+
+	/* counters of lookups, hashing and flushes, summed when shown */
+	struct f2fs_dedup_stat __percpu *stats;
+
+	/* owners of shared ciphertext, by hand for decryption */
+	struct dedup_crypt_cache crypt_cache;
+
+	/* offline dedup */
+	unsigned long *offline_segmap;	/* segments written since scanned */
+	struct f2fs_dedup_kthread *dedup_thread;
+
+	char *ver_bitmap;		/* set holding the live copy */
+	unsigned long *dirty_bitmap;	/* table blocks dirtied since last cp */
+	unsigned long *staged_bitmap;	/* ... written to their next copy */
+	bool hdr_dirty;			/* header pack needs to be written */
+
+	void *hdr_buf;			/* to assemble a header pack */
+	int cur_hdr_pack;		/* pack holding the live header */
+	unsigned long long hdr_version;	/* version of the live header */
+
+	bool enabled;			/* dedup is active on this instance */
+};
+
+static inline struct f2fs_dedup_info *DEDUP_I(struct f2fs_sb_info *sbi)
+{
+	return (struct f2fs_dedup_info *)(sbi->dedup_info);
+}
+
+static inline bool f2fs_dedup_enabled(struct f2fs_sb_info *sbi)
+{
+	return DEDUP_I(sbi) && DEDUP_I(sbi)->enabled;
+}
+
+/*
+ * The dedup area is valid in SIT but has no summary entries, so no GC may
+ * pick a segment of it, even while dedup is disabled on this mount.
+ */
+static inline bool f2fs_dedup_area_seg(struct f2fs_sb_info *sbi,
+						unsigned int segno)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+
+	if (!dm || (!dm->enabled &&
+			!is_set_ckpt_flags(sbi, CP_DEDUP_AREA_FLAG)))
+		return false;
+	return segno >= dm->start_segno &&
+			segno < dm->start_segno + dm->segment_count;
+}
+
+/* a section holding a shared block GC failed to collect the owners of */
+static inline bool f2fs_dedup_sec_stuck(struct f2fs_sb_info *sbi,
+						unsigned int secno)
+{
+	return f2fs_dedup_enabled(sbi) &&
+		test_bit(secno, DEDUP_I(sbi)->stuck_secmap);
+}
+
+static inline bool f2fs_dedup_inline(struct f2fs_sb_info *sbi)
+{
+	return f2fs_dedup_enabled(sbi) &&
+		F2FS_OPTION(sbi).dedup_mode == DEDUP_MODE_INLINE;
+}
+
+static inline bool f2fs_dedup_offline(struct f2fs_sb_info *sbi)
+{
+	return f2fs_dedup_enabled(sbi) &&
+		F2FS_OPTION(sbi).dedup_mode == DEDUP_MODE_OFFLINE;
+}
+
+/* files opted out by F2FS_IOC_SET_NODEDUP are never fingerprinted */
+static inline bool f2fs_dedup_file(struct inode *inode)
+{
+	return !(F2FS_I(inode)->i_flags & F2FS_NODEDUP_FL);
+}
+
+/* memchr_inv() goes a word at a time, and stops at the first nonzero one */
+static inline bool f2fs_dedup_zero_page(struct page *page)
+{
+	return !memchr_inv(page_address(page), 0, PAGE_SIZE);
+}
+
+/* a block with cold_refs references or more belongs to the cold log */
+static inline bool f2fs_dedup_cold_block(struct f2fs_sb_info *sbi, u32 ref)
+{
+	unsigned int cold_refs = READ_ONCE(DEDUP_I(sbi)->cold_refs);
+
+	return cold_refs && ref > 1 && ref >= cold_refs;
+}
+
+/* let the dedup thread know where data was just written */
+static inline void f2fs_dedup_log_block(struct f2fs_sb_info *sbi,
+							block_t blkaddr)
+{
+	set_bit(GET_SEGNO(sbi, blkaddr), DEDUP_I(sbi)->offline_segmap);
+}
+
+/*
+ * Blocks freed as their last reference goes are scattered over segments
+ * still in use.  Realtime discard takes the free runs of such a segment
+ * only once they reach discard_granularity, and holds shorter ones back
+ * to grow with their neighbours.  The segment stays in discard_segmap as
+ * long as it holds some back.
+ */
+static inline bool f2fs_dedup_coalesce_discard(struct f2fs_sb_info *sbi,
+							unsigned int segno)
+{
+	return f2fs_dedup_enabled(sbi) &&
+		test_bit(segno, DEDUP_I(sbi)->discard_segmap);
+}
+
+static inline void f2fs_dedup_hold_discard(struct f2fs_sb_info *sbi,
+					unsigned int segno, bool hold)
+{
+	if (hold)
+		set_bit(segno, DEDUP_I(sbi)->discard_segmap);
+	else
+		clear_bit(segno, DEDUP_I(sbi)->discard_segmap);
+}
+
+static inline block_t __dedup_table_addr(struct f2fs_sb_info *sbi,
+					unsigned int blkno, bool next)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	block_t blk_addr = dm->dedup_base_addr + 2 * dm->hdr_blocks + blkno;
+
+	if (f2fs_test_bit(blkno, dm->ver_bitmap) != next)
+		blk_addr += dm->table_blocks;
+	return blk_addr;
+}
+
+/* live copy of table block @blkno */
+static inline block_t current_dedup_addr(struct f2fs_sb_info *sbi,
+						unsigned int blkno)
+{
+	return __dedup_table_addr(sbi, blkno, false);
+}
+
+/* copy of table block @blkno to be written by the next checkpoint */
+static inline block_t next_dedup_addr(struct f2fs_sb_info *sbi,
+						unsigned int blkno)
+{
+	return __dedup_table_addr(sbi, blkno, true);
+}
+
+static inline block_t dedup_hdr_addr(struct f2fs_sb_info *sbi, int pack)
+{
+	return DEDUP_I(sbi)->dedup_base_addr + pack * DEDUP_I(sbi)->hdr_blocks;
+}
+
+static inline block_t dedup_anchor_addr(struct f2fs_sb_info *sbi)
+{
+	return MAIN_BLKADDR(sbi) +
+		(MAIN_SEGS(sbi) << sbi->log_blocks_per_seg) - 1;
+}
+
+#endif /* __F2FS_DEDUP_H__ */
@@ -0,0 +1,65 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * fs/f2fs/dedup_trace.h
+ *
+ * Tracepoints of block-level data deduplication.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM f2fs_dedup
+
+#if !defined(_F2FS_DEDUP_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _F2FS_DEDUP_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#define show_dedup_lat_stage(stage)					\
+	__print_symbolic(stage,						\
+		{ DEDUP_LAT_HASH,	"hash" },			\
+		{ DEDUP_LAT_LOOKUP,	"lookup" },			\
+		{ DEDUP_LAT_INSERT,	"insert" },			\
+		{ DEDUP_LAT_FLUSH,	"flush" },			\
+		{ DEDUP_LAT_WRITE,	"write" })
+
+/* latency of a dedup stage over the last iostat period */
+TRACE_EVENT(f2fs_dedup_latency,
+
+	TP_PROTO(struct f2fs_sb_info *sbi, int stage, unsigned long long cnt,
+		unsigned long long avg_ns, unsigned long long p50_ns,
+		unsigned long long p99_ns),
+
+	TP_ARGS(sbi, stage, cnt, avg_ns, p50_ns, p99_ns),
+
+	TP_STRUCT__entry(
+		__field(dev_t,			dev)
+		__field(int,			stage)
+		__field(unsigned long long,	cnt)
+		__field(unsigned long long,	avg_ns)
+		__field(unsigned long long,	p50_ns)
+		__field(unsigned long long,	p99_ns)
+	),
+
+	TP_fast_assign(
+		__entry->dev	= sbi->sb->s_dev;
+		__entry->stage	= stage;
+		__entry->cnt	= cnt;
+		__entry->avg_ns	= avg_ns;
+		__entry->p50_ns	= p50_ns;
+		__entry->p99_ns	= p99_ns;
+	),
+
+	TP_printk("dev = (%d,%d), stage = %s, cnt = %llu, avg = %llu ns, "
+		"p50 < %llu ns, p99 < %llu ns",
+		MAJOR(__entry->dev), MINOR(__entry->dev),
+		show_dedup_lat_stage(__entry->stage),
+		__entry->cnt, __entry->avg_ns,
+		__entry->p50_ns, __entry->p99_ns)
+);
+
+#endif /* _F2FS_DEDUP_TRACE_H */
+
+/* this part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE dedup_trace
+#include <trace/define_trace.h>
@@ -106,6 +106,7 @@ extern const char *f2fs_fault_name[FAULT_MAX];
 #define F2FS_MOUNT_MERGE_CHECKPOINT	0x10000000
 #define	F2FS_MOUNT_GC_MERGE		0x20000000
 #define F2FS_MOUNT_COMPRESS_CACHE	0x40000000
+#define F2FS_MOUNT_DEDUP_CACHE		0x80000000
 
 #define F2FS_OPTION(sbi)	((sbi)->mount_opt)
 #define clear_opt(sbi, option)	(F2FS_OPTION(sbi).opt &= ~F2FS_MOUNT_##option)
@@ -180,6 +181,10 @@ struct f2fs_mount_info {
 	int compress_mode;			/* compression mode */
 	unsigned char extensions[COMPRESS_EXT_NUM][F2FS_EXTENSION_LEN];	/* extensions */
 	unsigned char noextensions[COMPRESS_EXT_NUM][F2FS_EXTENSION_LEN]; /* extensions */
+
+	/* For deduplication */
+	int dedup_mode;				/* inline, offline or off */
+	unsigned char dedup_hash;		/* fingerprint algorithm */
 };
 
 #define F2FS_FEATURE_ENCRYPT		0x0001
@@ -258,6 +263,7 @@ enum {
 	META_SSA,
 	META_MAX,
 	META_POR,
+	META_DEDUP,
 	DATA_GENERIC,		/* check range only */
 	DATA_GENERIC_ENHANCE,	/* strong check on range and segment bitmap */
 	DATA_GENERIC_ENHANCE_READ,	/*
@@ -812,6 +818,12 @@ struct f2fs_inode_info {
 	unsigned char i_compress_level;		/* compress level (lz4hc,zstd) */
 	unsigned short i_compress_flag;		/* compress flag */
 	unsigned int i_cluster_size;		/* cluster size */
+
+	/* for adaptive dedup bypass, updated without locks */
+	unsigned short i_dedup_tried;		/* # of writes looked up */
+	unsigned short i_dedup_hits;		/* # of them shared */
+	unsigned int i_dedup_skip;		/* # of writes left to bypass */
+	unsigned char i_dedup_backoff;		/* log of next bypass length */
 };
 
 static inline void get_extent_info(struct extent_info *ext,
@@ -1175,6 +1187,7 @@ enum iostat_type {
 
 	/* other */
 	FS_DISCARD,			/* discard */
+	FS_DEDUP_IO,			/* data writes saved by dedup */
 	NR_IO_TYPE,
 };
 
@@ -1197,6 +1210,9 @@ struct f2fs_io_info {
 	bool is_por;		/* indicate IO is from recovery or not */
 	bool retry;		/* need to reallocate block address */
 	int compr_blocks;	/* # of compressed block addresses */
+	const u8 *dedup_fp;	/* fingerprint computed ahead, or NULL */
+	bool dedup_noshare;	/* only index it, a hit would split extents */
+	bool dedup_skipped;	/* not written, dedup found it on disk */
 	bool encrypted;		/* indicate file is encrypted */
 	enum iostat_type io_type;	/* io type */
 	struct writeback_control *io_wbc; /* writeback control */
@@ -1360,6 +1376,51 @@ enum {
 	DISCARD_UNIT_SECTION,	/* basic discard unit is section */
 };
 
+enum {
+	DEDUP_MODE_INLINE,	/* dedup in the write path */
+	DEDUP_MODE_OFFLINE,	/* dedup by a background thread */
+	DEDUP_MODE_OFF,		/* keep the index, but merge nothing new */
+};
+
+enum {
+	DEDUP_HASH_MD5,		/* a match is confirmed by comparing data */
+	DEDUP_HASH_SHA256,	/* fingerprints are trusted on match */
+	DEDUP_HASH_BLAKE2S,
+	DEDUP_HASH_XXHASH64,	/* cheapest, a match is confirmed too */
+	DEDUP_HASH_MAX,
+};
+
+/* shared blocks cached by dedup_cache, in meta mapping */
+#define	DEDUP_CACHE_WATERMARK			20
+#define	DEDUP_CACHE_PERCENT			20
+
+/* dedup counters, kept per cpu whether or not stats are compiled in */
+enum {
+	DEDUP_STAT_LOOKUP,	/* fingerprint lookups */
+	DEDUP_STAT_HIT,		/* lookups which found the fingerprint */
+	DEDUP_STAT_PROBE,	/* buckets visited by lookups */
+	DEDUP_STAT_FILTERED,	/* misses told by the filter of a page */
+	DEDUP_STAT_CONFIRM,	/* weak matches compared with the data */
+	DEDUP_STAT_COLLISION,	/* ... which turned out to differ */
+	DEDUP_STAT_SHARED,	/* blocks written or merged by sharing */
+	DEDUP_STAT_ZERO,	/* all-zero blocks left unwritten */
+	DEDUP_STAT_PATTERN,	/* repeated-word blocks spared hashing */
+	DEDUP_STAT_BYPASS,	/* blocks written without a lookup */
+	DEDUP_STAT_UNSHARED,	/* hits written out to keep extents whole */
+	DEDUP_STAT_CLUSTER,	/* compressed clusters shared as a whole */
+	DEDUP_STAT_CLONED,	/* blocks shared by address, by remap */
+	DEDUP_STAT_GC_MERGED,	/* blocks merged by GC instead of moved */
+	DEDUP_STAT_HASH,	/* blocks fingerprinted */
+	DEDUP_STAT_HASH_NS,	/* time spent fingerprinting */
+	DEDUP_STAT_FLUSH,	/* table flushes by checkpoint */
+	DEDUP_STAT_FLUSH_BLK,	/* table blocks flushed */
+	DEDUP_STAT_FLUSH_NS,	/* time spent flushing the tables */
+	NR_DEDUP_STATS,
+};
+
+/* refcount histogram of indexed blocks: 1, 2, 3-4, 5-8, 9-16, 17+ */
+#define DEDUP_REF_HIST_SIZE	6
+
 static inline int f2fs_test_bit(unsigned int nr, char *addr);
 static inline void f2fs_set_bit(unsigned int nr, char *addr);
 static inline void f2fs_clear_bit(unsigned int nr, char *addr);
@@ -1608,6 +1669,9 @@ struct f2fs_sb_info {
 	/* for segment-related operations */
 	struct f2fs_sm_info *sm_info;		/* segment manager */
 
+	/* for dedup-related operations */
+	struct f2fs_dedup_info *dedup_info;	/* dedup manager */
+
 	/* for bio operations */
 	struct f2fs_bio_info *write_io[NR_PAGE_TYPE];	/* for write bios */
 	/* keep migration IO order for LFS mode */
@@ -1832,6 +1896,10 @@ struct f2fs_sb_info {
 	/* For io latency related statistics info in one iostat period */
 	spinlock_t iostat_lat_lock;
 	struct iostat_lat_info *iostat_io_lat;
+
+	/* For dedup stage latency, per cpu to stay off the write path */
+	struct dedup_lat_info __percpu *dedup_lat;
+	struct dedup_lat_info *prev_dedup_lat;	/* sums at the last period */
 #endif
 };
 
@@ -2923,13 +2991,15 @@ static inline void f2fs_change_bit(unsigned int nr, char *addr)
 #define F2FS_NOCOMP_FL			0x00000400 /* Don't compress */
 #define F2FS_INDEX_FL			0x00001000 /* hash-indexed directory */
 #define F2FS_DIRSYNC_FL			0x00010000 /* dirsync behaviour (directories only) */
+#define F2FS_NODEDUP_FL			0x01000000 /* Don't dedup */
 #define F2FS_PROJINHERIT_FL		0x20000000 /* Create with parents projid */
 #define F2FS_CASEFOLD_FL		0x40000000 /* Casefolded file */
 
 /* Flags that should be inherited by new inodes from their parent. */
 #define F2FS_FL_INHERITED (F2FS_SYNC_FL | F2FS_NODUMP_FL | F2FS_NOATIME_FL | \
 			   F2FS_DIRSYNC_FL | F2FS_PROJINHERIT_FL | \
-			   F2FS_CASEFOLD_FL | F2FS_COMPR_FL | F2FS_NOCOMP_FL)
+			   F2FS_CASEFOLD_FL | F2FS_COMPR_FL | F2FS_NOCOMP_FL | \
+			   F2FS_NODEDUP_FL)
 
 /* Flags that are appropriate for regular files (all but dir-specific ones). */
 #define F2FS_REG_FLMASK		(~(F2FS_DIRSYNC_FL | F2FS_PROJINHERIT_FL | \
@@ -3608,6 +3678,8 @@ void f2fs_allocate_segment_for_resize(struct f2fs_sb_info *sbi, int type,
 					unsigned int start, unsigned int end);
 void f2fs_allocate_new_section(struct f2fs_sb_info *sbi, int type, bool force);
 void f2fs_allocate_new_segments(struct f2fs_sb_info *sbi);
+int f2fs_claim_segments(struct f2fs_sb_info *sbi, unsigned int start_segno,
+						unsigned int count);
 int f2fs_trim_fs(struct f2fs_sb_info *sbi, struct fstrim_range *range);
 bool f2fs_exist_trim_candidates(struct f2fs_sb_info *sbi,
 					struct cp_control *cpc);
@@ -3760,7 +3832,8 @@ int f2fs_write_single_data_page(struct page *page, int *submitted,
 				struct bio **bio, sector_t *last_block,
 				struct writeback_control *wbc,
 				enum iostat_type io_type,
-				int compr_blocks, bool allow_balance);
+				int compr_blocks, bool allow_balance,
+				const u8 *dedup_fp, bool dedup_noshare);
 void f2fs_write_failed(struct inode *inode, loff_t to);
 void f2fs_invalidate_folio(struct folio *folio, size_t offset, size_t length);
 bool f2fs_release_folio(struct folio *folio, gfp_t wait);
@@ -3788,6 +3861,77 @@ int f2fs_resize_fs(struct f2fs_sb_info *sbi, __u64 block_count);
 int __init f2fs_create_garbage_collection_cache(void);
 void f2fs_destroy_garbage_collection_cache(void);
 
+/*
+ * dedup.c
+ */
+struct f2fs_dedup_batch;
+struct f2fs_dedup_owner;
+
+const char *f2fs_dedup_hash_name(unsigned int type);
+void f2fs_dedup_hash_batch(struct f2fs_sb_info *sbi,
+				struct f2fs_dedup_batch *batch);
+bool f2fs_dedup_share_block(struct f2fs_sb_info *sbi, const u8 *fp,
+		struct page *page, bool encrypted, block_t *blkaddr);
+void f2fs_dedup_insert_block(struct f2fs_sb_info *sbi, const u8 *fp,
+							block_t blkaddr);
+int f2fs_dedup_get_block(struct f2fs_sb_info *sbi, block_t blkaddr);
+unsigned int f2fs_dedup_share_cluster(struct f2fs_sb_info *sbi,
+			const u8 *fp, unsigned int max, block_t *blkaddr);
+void f2fs_dedup_insert_cluster(struct f2fs_sb_info *sbi, const u8 *fp,
+				block_t blkaddr, unsigned int nr);
+bool f2fs_dedup_put_block(struct f2fs_sb_info *sbi, block_t blkaddr);
+void f2fs_dedup_release_block(struct f2fs_sb_info *sbi, block_t old_blkaddr);
+void f2fs_dedup_add_owner(struct f2fs_sb_info *sbi, block_t blkaddr,
+				nid_t nid, unsigned int ofs_in_node);
+u32 f2fs_dedup_block_refs(struct f2fs_sb_info *sbi, block_t blkaddr);
+bool f2fs_dedup_block_shared(struct f2fs_sb_info *sbi, block_t blkaddr);
+unsigned int f2fs_dedup_seg_refs(struct f2fs_sb_info *sbi,
+				unsigned int segno, bool use_section);
+int f2fs_dedup_get_owners(struct f2fs_sb_info *sbi, block_t blkaddr,
+		struct f2fs_summary *sum, struct f2fs_dedup_owner *owners,
+		int max);
+u32 f2fs_dedup_detach_block(struct f2fs_sb_info *sbi, block_t blkaddr,
+				u32 *fphash);
+void f2fs_dedup_attach_block(struct f2fs_sb_info *sbi, block_t old_blkaddr,
+			block_t new_blkaddr, u32 ref, u32 fphash);
+void f2fs_dedup_insert_crypt(struct f2fs_sb_info *sbi, block_t blkaddr,
+						nid_t ino, pgoff_t lblk);
+bool f2fs_dedup_drop_crypt(struct f2fs_sb_info *sbi, block_t blkaddr,
+						nid_t *ino, u32 *lblk);
+struct inode *f2fs_dedup_crypt_owner(struct f2fs_sb_info *sbi,
+		block_t blkaddr, struct inode *inode, u64 *lblk_num);
+void f2fs_dedup_drop_crypt_inodes(struct f2fs_sb_info *sbi);
+unsigned long f2fs_dedup_shrink(struct f2fs_sb_info *sbi, unsigned long nr);
+unsigned long f2fs_dedup_shrink_count(struct f2fs_sb_info *sbi);
+void f2fs_dedup_cache_block(struct f2fs_sb_info *sbi, struct page *page,
+							block_t blkaddr);
+bool f2fs_dedup_load_cached_block(struct inode *inode, struct page *page,
+							block_t blkaddr);
+int f2fs_dedup_fingerprint(struct f2fs_sb_info *sbi, struct page *page,
+								u8 *digest);
+int f2fs_dedup_fingerprint_cluster(struct inode *inode, struct page **pages,
+					unsigned int nr, u8 *digest);
+void f2fs_dedup_zero_block(struct f2fs_sb_info *sbi, block_t old_blkaddr);
+bool f2fs_dedup_bypass(struct f2fs_sb_info *sbi, struct inode *inode);
+void f2fs_dedup_account(struct f2fs_sb_info *sbi, struct inode *inode,
+							bool hit);
+bool f2fs_dedup_gc_merge(struct inode *inode, struct page *page,
+			block_t blkaddr, u8 *digest, bool *hashed);
+u64 f2fs_dedup_stat(struct f2fs_sb_info *sbi, int type);
+u64 f2fs_dedup_ref_histogram(struct f2fs_sb_info *sbi,
+					unsigned long long *hist);
+void f2fs_flush_dedup_entries(struct f2fs_sb_info *sbi, struct cp_control *cpc);
+void f2fs_create_dedup_area(struct f2fs_sb_info *sbi);
+int f2fs_start_dedup_thread(struct f2fs_sb_info *sbi);
+void f2fs_stop_dedup_thread(struct f2fs_sb_info *sbi);
+void f2fs_stop_dedup_loaders(struct f2fs_sb_info *sbi);
+int f2fs_build_dedup_manager(struct f2fs_sb_info *sbi);
+void f2fs_destroy_dedup_manager(struct f2fs_sb_info *sbi);
+struct f2fs_dedup_batch *f2fs_dedup_alloc_batch(struct f2fs_sb_info *sbi);
+void f2fs_dedup_free_batch(struct f2fs_dedup_batch *batch);
+int __init f2fs_create_dedup_caches(void);
+void f2fs_destroy_dedup_caches(void);
+
 /*
  * recovery.c
  */
@@ -3851,6 +3995,15 @@ struct f2fs_stat_info {
 	unsigned int block_count[2];
 	unsigned int inplace_count;
 	unsigned long long base_mem, cache_mem, page_mem;
+
+	/* dedup */
+	bool dedup_enabled;
+	unsigned long long dedup_stat[NR_DEDUP_STATS];
+	unsigned long long dedup_refs[DEDUP_REF_HIST_SIZE];
+	unsigned long long dedup_saved_blks;
+	unsigned int dedup_fp_entries, dedup_fp_slots;
+	unsigned int dedup_ref_entries, dedup_ref_slots;
+	unsigned int dedup_fp_pages, dedup_fp_evicted, dedup_fp_unread;
 };
 
 static inline struct f2fs_stat_info *F2FS_STAT(struct f2fs_sb_info *sbi)
@@ -4133,6 +4286,20 @@ static inline void f2fs_set_encrypted_inode(struct inode *inode)
 #endif
 }
 
+/* decrypt ciphertext deduplicated from @owner with the key it was written */
+#ifdef CONFIG_FS_ENCRYPTION
+int fscrypt_decrypt_shared_block(struct inode *owner, struct page *page,
+				 unsigned int len, unsigned int offs,
+				 u64 lblk_num);
+#else
+static inline int fscrypt_decrypt_shared_block(struct inode *owner,
+		struct page *page, unsigned int len, unsigned int offs,
+		u64 lblk_num)
+{
+	return -EOPNOTSUPP;
+}
+#endif
+
 /*
  * Returns true if the reads of the inode's data need to undergo some
  * postprocessing step, like decryption or authenticity verification.
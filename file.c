@@ -33,9 +33,14 @@
 #include "acl.h"
 #include "gc.h"
 #include "iostat.h"
+#include "dedup.h"
 #include <trace/events/f2fs.h>
 #include <uapi/linux/f2fs.h>
 
+/* dedup policy of a file, numbered clear of the other f2fs ioctls */
+#define F2FS_IOC_SET_NODEDUP		_IOW(F2FS_IOCTL_MAGIC, 30, __u32)
+#define F2FS_IOC_GET_NODEDUP		_IOR(F2FS_IOCTL_MAGIC, 31, __u32)
+
 static vm_fault_t f2fs_filemap_fault(struct vm_fault *vmf)
 {
 	struct inode *inode = file_inode(vmf->vma->vm_file);
@@ -2411,6 +2416,10 @@ static int __f2fs_ioc_gc_range(struct file *filp, struct f2fs_gc_range *range)
 					end >= MAX_BLKADDR(sbi))
 		return -EINVAL;
 
+	/* the dedup area ends the main area, so a range into it ends there */
+	if (f2fs_dedup_area_seg(sbi, GET_SEGNO(sbi, end)))
+		return -EINVAL;
+
 	ret = mnt_want_write_file(filp);
 	if (ret)
 		return ret;
@@ -2833,6 +2842,151 @@ static int f2fs_ioc_move_range(struct file *filp, unsigned long arg)
 	return __f2fs_ioc_move_range(filp, &range);
 }
 
+/*
+ * Point block @dst of @dst_inode to block @src of @src_inode, with one
+ * more reference on it.  A hole or preallocated block makes a hole.
+ */
+static int __remap_blkaddr(struct inode *src_inode, struct inode *dst_inode,
+						pgoff_t src, pgoff_t dst)
+{
+	struct f2fs_sb_info *sbi = F2FS_I_SB(src_inode);
+	struct dnode_of_data dn;
+	block_t blkaddr = NULL_ADDR;
+	int ret;
+
+	set_new_dnode(&dn, src_inode, NULL, NULL, 0);
+	ret = f2fs_get_dnode_of_data(&dn, src, LOOKUP_NODE_RA);
+	if (ret && ret != -ENOENT)
+		return ret;
+	if (!ret) {
+		blkaddr = f2fs_data_blkaddr(&dn);
+		f2fs_put_dnode(&dn);
+	}
+
+	if (!__is_valid_data_blkaddr(blkaddr))
+		return f2fs_truncate_hole(dst_inode, dst, dst + 1);
+	if (!f2fs_is_valid_blkaddr(sbi, blkaddr, DATA_GENERIC_ENHANCE))
+		return -EFSCORRUPTED;
+
+	set_new_dnode(&dn, dst_inode, NULL, NULL, 0);
+	ret = f2fs_get_dnode_of_data(&dn, dst, ALLOC_NODE);
+	if (ret)
+		return ret;
+
+	if (f2fs_data_blkaddr(&dn) != blkaddr) {
+		ret = f2fs_dedup_get_block(sbi, blkaddr);
+		if (!ret) {
+			f2fs_truncate_data_blocks_range(&dn, 1);
+			/* charged like every other owner of a shared block */
+			f2fs_i_blocks_write(dst_inode, 1, true, false);
+			f2fs_dedup_add_owner(sbi, blkaddr, dn.nid,
+							dn.ofs_in_node);
+			f2fs_update_data_blkaddr(&dn, blkaddr);
+		}
+	}
+	f2fs_put_dnode(&dn);
+	return ret;
+}
+
+/*
+ * Clone or dedupe a range by sharing the blocks of @file_in through the
+ * refcount table, without reading or writing any data.
+ */
+static loff_t f2fs_remap_file_range(struct file *file_in, loff_t pos_in,
+			struct file *file_out, loff_t pos_out, loff_t len,
+			unsigned int remap_flags)
+{
+	struct inode *src = file_inode(file_in);
+	struct inode *dst = file_inode(file_out);
+	struct f2fs_sb_info *sbi = F2FS_I_SB(src);
+	pgoff_t i, nr_blocks;
+	int ret;
+
+	if (remap_flags & ~(REMAP_FILE_DEDUP | REMAP_FILE_ADVISORY))
+		return -EINVAL;
+
+	if (!f2fs_dedup_enabled(sbi))
+		return -EOPNOTSUPP;
+
+	if (unlikely(f2fs_cp_error(sbi)))
+		return -EIO;
+
+	/* ciphertext and compressed clusters belong to their own file */
+	if (IS_ENCRYPTED(src) || IS_ENCRYPTED(dst) ||
+			f2fs_compressed_file(src) || f2fs_compressed_file(dst))
+		return -EOPNOTSUPP;
+
+	if ((remap_flags & REMAP_FILE_DEDUP) &&
+			(!f2fs_dedup_file(src) || !f2fs_dedup_file(dst)))
+		return -EOPNOTSUPP;
+
+	lock_two_nondirectories(src, dst);
+
+	ret = -EINVAL;
+	if (f2fs_is_atomic_file(src) || f2fs_is_atomic_file(dst) ||
+			f2fs_is_pinned_file(src) || f2fs_is_pinned_file(dst))
+		goto out_unlock;
+
+	ret = f2fs_convert_inline_inode(src);
+	if (ret)
+		goto out_unlock;
+
+	ret = f2fs_convert_inline_inode(dst);
+	if (ret)
+		goto out_unlock;
+
+	f2fs_down_write(&F2FS_I(src)->i_gc_rwsem[WRITE]);
+	if (src != dst) {
+		ret = -EBUSY;
+		if (!f2fs_down_write_trylock(&F2FS_I(dst)->i_gc_rwsem[WRITE]))
+			goto out_src;
+	}
+
+	filemap_invalidate_lock_two(src->i_mapping, dst->i_mapping);
+
+	/* checks the ranges, writes them out and compares them to dedupe */
+	ret = generic_remap_file_range_prep(file_in, pos_in, file_out, pos_out,
+							&len, remap_flags);
+	if (ret < 0 || !len)
+		goto out_invalidate;
+
+	/* the tail of a partial last block is not data of @dst */
+	ret = -EINVAL;
+	if (!IS_ALIGNED(len, F2FS_BLKSIZE) &&
+			pos_out + len < i_size_read(dst))
+		goto out_invalidate;
+
+	ret = 0;
+	nr_blocks = DIV_ROUND_UP(len, F2FS_BLKSIZE);
+	for (i = 0; i < nr_blocks && !ret; i++) {
+		f2fs_balance_fs(sbi, true);
+
+		f2fs_lock_op(sbi);
+		ret = __remap_blkaddr(src, dst,
+				(pos_in >> F2FS_BLKSIZE_BITS) + i,
+				(pos_out >> F2FS_BLKSIZE_BITS) + i);
+		f2fs_unlock_op(sbi);
+	}
+
+	truncate_pagecache_range(dst, pos_out,
+			round_up(pos_out + len, F2FS_BLKSIZE) - 1);
+
+	if (!ret && pos_out + len > i_size_read(dst))
+		f2fs_i_size_write(dst, pos_out + len);
+
+	if (!ret)
+		f2fs_update_time(sbi, REQ_TIME);
+out_invalidate:
+	filemap_invalidate_unlock_two(src->i_mapping, dst->i_mapping);
+	if (src != dst)
+		f2fs_up_write(&F2FS_I(dst)->i_gc_rwsem[WRITE]);
+out_src:
+	f2fs_up_write(&F2FS_I(src)->i_gc_rwsem[WRITE]);
+out_unlock:
+	unlock_two_nondirectories(src, dst);
+	return ret < 0 ? ret : len;
+}
+
 static int f2fs_ioc_flush_device(struct file *filp, unsigned long arg)
 {
 	struct inode *inode = file_inode(filp);
@@ -2882,6 +3036,8 @@ static int f2fs_ioc_flush_device(struct file *filp, unsigned long arg)
 	end_segno = min(start_segno + range.segments, dev_end_segno);
 
 	while (start_segno < end_segno) {
+		if (f2fs_dedup_area_seg(sbi, start_segno))
+			break;
 		if (!f2fs_down_write_trylock(&sbi->gc_lock)) {
 			ret = -EBUSY;
 			goto out;
@@ -3131,6 +3287,54 @@ static int f2fs_ioc_get_pin_file(struct file *filp, unsigned long arg)
 	return put_user(pin, (u32 __user *)arg);
 }
 
+/*
+ * Opt a file out of dedup, or back in.  Files created in a directory
+ * inherit its setting, and data already shared stays shared.
+ */
+static int f2fs_ioc_set_nodedup(struct file *filp, unsigned long arg)
+{
+	struct inode *inode = file_inode(filp);
+	struct f2fs_inode_info *fi = F2FS_I(inode);
+	__u32 nodedup;
+	int ret;
+
+	if (!inode_owner_or_capable(file_mnt_user_ns(filp), inode))
+		return -EACCES;
+
+	if (get_user(nodedup, (__u32 __user *)arg))
+		return -EFAULT;
+
+	if (!S_ISREG(inode->i_mode) && !S_ISDIR(inode->i_mode))
+		return -EINVAL;
+
+	if (f2fs_readonly(F2FS_I_SB(inode)->sb))
+		return -EROFS;
+
+	ret = mnt_want_write_file(filp);
+	if (ret)
+		return ret;
+
+	inode_lock(inode);
+	if (nodedup)
+		fi->i_flags |= F2FS_NODEDUP_FL;
+	else
+		fi->i_flags &= ~F2FS_NODEDUP_FL;
+	inode->i_ctime = current_time(inode);
+	f2fs_mark_inode_dirty_sync(inode, true);
+	inode_unlock(inode);
+
+	mnt_drop_write_file(filp);
+	return 0;
+}
+
+static int f2fs_ioc_get_nodedup(struct file *filp, unsigned long arg)
+{
+	struct inode *inode = file_inode(filp);
+	__u32 nodedup = !!(F2FS_I(inode)->i_flags & F2FS_NODEDUP_FL);
+
+	return put_user(nodedup, (u32 __user *)arg);
+}
+
 int f2fs_precache_extents(struct inode *inode)
 {
 	struct f2fs_inode_info *fi = F2FS_I(inode);
@@ -4104,6 +4308,10 @@ static long __f2fs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 		return f2fs_ioc_get_pin_file(filp, arg);
 	case F2FS_IOC_SET_PIN_FILE:
 		return f2fs_ioc_set_pin_file(filp, arg);
+	case F2FS_IOC_GET_NODEDUP:
+		return f2fs_ioc_get_nodedup(filp, arg);
+	case F2FS_IOC_SET_NODEDUP:
+		return f2fs_ioc_set_nodedup(filp, arg);
 	case F2FS_IOC_PRECACHE_EXTENTS:
 		return f2fs_ioc_precache_extents(filp, arg);
 	case F2FS_IOC_RESIZE_FS:
@@ -4750,6 +4958,8 @@ long f2fs_compat_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
 	case F2FS_IOC_GET_FEATURES:
 	case F2FS_IOC_GET_PIN_FILE:
 	case F2FS_IOC_SET_PIN_FILE:
+	case F2FS_IOC_GET_NODEDUP:
+	case F2FS_IOC_SET_NODEDUP:
 	case F2FS_IOC_PRECACHE_EXTENTS:
 	case F2FS_IOC_RESIZE_FS:
 	case FS_IOC_ENABLE_VERITY:
@@ -4790,4 +5000,5 @@ const struct file_operations f2fs_file_operations = {
 	.splice_read	= generic_file_splice_read,
 	.splice_write	= iter_file_splice_write,
 	.fadvise	= f2fs_file_fadvise,
+	.remap_file_range = f2fs_remap_file_range,
 };
@@ -21,12 +21,14 @@
 #include "segment.h"
 #include "gc.h"
 #include "iostat.h"
+#include "dedup.h"
 #include <trace/events/f2fs.h>
 
 static struct kmem_cache *victim_entry_slab;
 
 static unsigned int count_bits(const unsigned long *addr,
 				unsigned int offset, unsigned int len);
+static void gc_cold_shared_blocks(struct f2fs_sb_info *sbi);
 
 static int gc_thread_func(void *data)
 {
@@ -135,6 +137,8 @@ static int gc_thread_func(void *data)
 			decrease_sleep_time(gc_th, &wait_ms);
 		else
 			increase_sleep_time(gc_th, &wait_ms);
+
+		gc_cold_shared_blocks(sbi);
 do_gc:
 		if (!foreground)
 			stat_inc_bggc_count(sbi->stat_info);
@@ -321,7 +325,8 @@ static unsigned int check_bg_victims(struct f2fs_sb_info *sbi)
 	 * Those segments guarantee they have small valid blocks.
 	 */
 	for_each_set_bit(secno, dirty_i->victim_secmap, MAIN_SECS(sbi)) {
-		if (sec_usage_check(sbi, secno))
+		if (sec_usage_check(sbi, secno) ||
+				f2fs_dedup_sec_stuck(sbi, secno))
 			continue;
 		clear_bit(secno, dirty_i->victim_secmap);
 		return GET_SEG_FROM_SEC(sbi, secno);
@@ -329,6 +334,18 @@ static unsigned int check_bg_victims(struct f2fs_sb_info *sbi)
 	return NULL_SEGNO;
 }
 
+/*
+ * Every extra owner of a shared block costs GC a dnode update on top of
+ * the move, so count extra references like valid blocks, short of making
+ * the section look full.
+ */
+static unsigned int get_dedup_cost(struct f2fs_sb_info *sbi,
+					unsigned int segno)
+{
+	return min_t(unsigned int, f2fs_dedup_seg_refs(sbi, segno, true),
+						BLKS_PER_SEC(sbi) - 1);
+}
+
 static unsigned int get_cb_cost(struct f2fs_sb_info *sbi, unsigned int segno)
 {
 	struct sit_info *sit_i = SIT_I(sbi);
@@ -343,7 +360,9 @@ static unsigned int get_cb_cost(struct f2fs_sb_info *sbi, unsigned int segno)
 
 	for (i = 0; i < usable_segs_per_sec; i++)
 		mtime += get_seg_entry(sbi, start + i)->mtime;
-	vblocks = get_valid_blocks(sbi, segno, true);
+	vblocks = min_t(unsigned int, get_valid_blocks(sbi, segno, true) +
+			get_dedup_cost(sbi, segno),
+			(usable_segs_per_sec << sbi->log_blocks_per_seg) - 1);
 
 	mtime = div_u64(mtime, usable_segs_per_sec);
 	vblocks = div_u64(vblocks, usable_segs_per_sec);
@@ -370,7 +389,8 @@ static inline unsigned int get_gc_cost(struct f2fs_sb_info *sbi,
 
 	/* alloc_mode == LFS */
 	if (p->gc_mode == GC_GREEDY)
-		return get_valid_blocks(sbi, segno, true);
+		return get_valid_blocks(sbi, segno, true) +
+					get_dedup_cost(sbi, segno);
 	else if (p->gc_mode == GC_CB)
 		return get_cb_cost(sbi, segno);
 
@@ -748,7 +768,8 @@ retry:
 			goto out;
 		}
 
-		if (sec_usage_check(sbi, GET_SEC_FROM_SEG(sbi, *result)))
+		if (sec_usage_check(sbi, GET_SEC_FROM_SEG(sbi, *result)) ||
+				f2fs_dedup_area_seg(sbi, *result))
 			ret = -EBUSY;
 		else
 			p.min_segno = *result;
@@ -820,6 +841,10 @@ retry:
 		if (sec_usage_check(sbi, secno))
 			goto next;
 
+		/* GC would move blocks out of it in vain */
+		if (p.alloc_mode == LFS && f2fs_dedup_sec_stuck(sbi, secno))
+			goto next;
+
 		/* Don't touch checkpointed data */
 		if (unlikely(is_sbi_flag_set(sbi, SBI_CP_DISABLED))) {
 			if (p.alloc_mode == LFS) {
@@ -1237,6 +1262,9 @@ static int move_data_block(struct inode *inode, block_t bidx,
 	struct node_info ni;
 	struct page *page, *mpage;
 	block_t newaddr;
+	nid_t crypt_ino;
+	u32 crypt_lblk;
+	bool crypt_ctx;
 	int err = 0;
 	bool lfs_mode = f2fs_lfs_mode(fio.sbi);
 	int type = fio.sbi->am.atgc_enabled && (gc_type == BG_GC) &&
@@ -1318,6 +1346,10 @@ static int move_data_block(struct inode *inode, block_t bidx,
 
 	set_summary(&sum, dn.nid, dn.ofs_in_node, ni.version);
 
+	/* the ciphertext keeps the key and IV it was written with */
+	crypt_ctx = f2fs_dedup_drop_crypt(fio.sbi, fio.old_blkaddr,
+					&crypt_ino, &crypt_lblk);
+
 	/* allocate block address */
 	f2fs_allocate_data_block(fio.sbi, NULL, fio.old_blkaddr, &newaddr,
 				&sum, type, NULL);
@@ -1359,6 +1391,8 @@ static int move_data_block(struct inode *inode, block_t bidx,
 
 	f2fs_update_iostat(fio.sbi, FS_GC_DATA_IO, F2FS_BLKSIZE);
 
+	if (crypt_ctx)
+		f2fs_dedup_insert_crypt(fio.sbi, newaddr, crypt_ino, crypt_lblk);
 	f2fs_update_data_blkaddr(&dn, newaddr);
 	set_inode_flag(inode, FI_APPEND_WRITE);
 	if (page->index == 0)
@@ -1366,9 +1400,13 @@ static int move_data_block(struct inode *inode, block_t bidx,
 put_page_out:
 	f2fs_put_page(fio.encrypted_page, 1);
 recover_block:
-	if (err)
+	if (err) {
 		f2fs_do_replace_block(fio.sbi, &sum, newaddr, fio.old_blkaddr,
 							true, true, true);
+		if (crypt_ctx)
+			f2fs_dedup_insert_crypt(fio.sbi, fio.old_blkaddr,
+						crypt_ino, crypt_lblk);
+	}
 up_out:
 	if (lfs_mode)
 		f2fs_up_write(&fio.sbi->io_order_lock);
@@ -1379,17 +1417,412 @@ out:
 	return err;
 }
 
+static void unlock_shared_owners(struct f2fs_dedup_owner *owners, int nr)
+{
+	int i;
+
+	for (i = nr - 1; i >= 0; i--) {
+		struct f2fs_dedup_owner *o = &owners[i];
+
+		if (o->page)
+			f2fs_put_page(o->page, 1);
+		if (o->locked) {
+			f2fs_up_write(&F2FS_I(o->inode)->i_gc_rwsem[WRITE]);
+			f2fs_up_write(&F2FS_I(o->inode)->i_gc_rwsem[READ]);
+		}
+		iput(o->inode);
+	}
+}
+
+/*
+ * Keep writes, truncation and direct IO away from the block of every owner
+ * in @owners, and check that each one still points to @blkaddr.  Only
+ * trylocks are taken, since the pages belong to random files and the
+ * order they are locked in can't be told.
+ */
+static int lock_shared_owners(struct f2fs_sb_info *sbi, block_t blkaddr,
+		struct f2fs_dedup_owner *owners, int nr, int gc_type,
+		unsigned int segno)
+{
+	struct dnode_of_data dn;
+	int i, j, err;
+
+	for (i = 0; i < nr; i++) {
+		struct f2fs_dedup_owner *o = &owners[i];
+		struct f2fs_inode_info *fi;
+		pgoff_t bidx;
+
+		o->page = NULL;
+		o->locked = false;
+		o->inode = f2fs_iget(sbi->sb, o->ino);
+		if (IS_ERR(o->inode)) {
+			err = PTR_ERR(o->inode);
+			goto unlock;
+		}
+		fi = F2FS_I(o->inode);
+
+		if (is_bad_inode(o->inode) || !S_ISREG(o->inode->i_mode)) {
+			err = -ENOENT;
+			goto unlock_inode;
+		}
+
+		err = f2fs_gc_pinned_control(o->inode, gc_type, segno);
+		if (err)
+			goto unlock_inode;
+
+		/* owners in the same file share the locks of the first */
+		for (j = 0; j < i; j++)
+			if (owners[j].inode == o->inode)
+				break;
+		if (j == i) {
+			if (!f2fs_down_write_trylock(&fi->i_gc_rwsem[READ])) {
+				sbi->skipped_gc_rwsem++;
+				err = -EAGAIN;
+				goto unlock_inode;
+			}
+			if (!f2fs_down_write_trylock(&fi->i_gc_rwsem[WRITE])) {
+				sbi->skipped_gc_rwsem++;
+				f2fs_up_write(&fi->i_gc_rwsem[READ]);
+				err = -EAGAIN;
+				goto unlock_inode;
+			}
+			o->locked = true;
+
+			/* wait for all inflight aio data */
+			inode_dio_wait(o->inode);
+		}
+
+		bidx = f2fs_start_bidx_of_node(o->nofs, o->inode) +
+							o->ofs_in_node;
+		o->page = f2fs_pagecache_get_page(o->inode->i_mapping, bidx,
+				FGP_LOCK | FGP_CREAT | FGP_NOWAIT, GFP_NOFS);
+		if (!o->page) {
+			err = -EAGAIN;
+			goto unlock_owner;
+		}
+		f2fs_wait_on_page_writeback(o->page, DATA, true, true);
+
+		set_new_dnode(&dn, o->inode, NULL, NULL, 0);
+		err = f2fs_get_dnode_of_data(&dn, bidx, LOOKUP_NODE);
+		if (err)
+			goto unlock_owner;
+		if (dn.data_blkaddr != blkaddr)
+			err = -ENOENT;
+		f2fs_put_dnode(&dn);
+		if (err)
+			goto unlock_owner;
+	}
+	return 0;
+unlock_owner:
+	unlock_shared_owners(owners, i + 1);
+	return err;
+unlock_inode:
+	iput(owners[i].inode);
+unlock:
+	unlock_shared_owners(owners, i);
+	return err;
+}
+
+/*
+ * Move the shared block at @off of @segno once, and point the dnode of
+ * each of its owners to the new copy.  The refcount entry of the block is
+ * taken out of the index meanwhile, so that nothing shares the old block,
+ * and the old block is freed together with its summary owner as for any
+ * other block moved by GC.
+ */
+static int move_shared_block(struct f2fs_sb_info *sbi,
+		struct f2fs_summary *entry, int gc_type, unsigned int segno,
+		int off)
+{
+	struct f2fs_io_info fio = {
+		.sbi = sbi,
+		.type = DATA,
+		.temp = COLD,
+		.op = REQ_OP_READ,
+		.op_flags = 0,
+		.encrypted_page = NULL,
+		.in_list = false,
+		.retry = false,
+	};
+	struct f2fs_dedup_owner *owners;
+	struct dnode_of_data dn;
+	struct f2fs_summary sum;
+	struct page *mpage;
+	block_t blkaddr = START_BLOCK(sbi, segno) + off;
+	block_t newaddr;
+	nid_t crypt_ino;
+	u32 crypt_lblk;
+	bool crypt_ctx;
+	bool lfs_mode = f2fs_lfs_mode(sbi);
+	int type = sbi->am.atgc_enabled && (gc_type == BG_GC) &&
+				(sbi->gc_mode != GC_URGENT_HIGH) ?
+				CURSEG_ALL_DATA_ATGC : CURSEG_COLD_DATA;
+	int nr, i, err;
+	u32 ref, fphash;
+
+	owners = f2fs_kmalloc(sbi, array_size(DEDUP_GC_MAX_OWNERS,
+				sizeof(struct f2fs_dedup_owner)), GFP_NOFS);
+	if (!owners)
+		return -ENOMEM;
+
+	nr = f2fs_dedup_get_owners(sbi, blkaddr, entry, owners,
+						DEDUP_GC_MAX_OWNERS);
+	if (nr < 0) {
+		if (nr == -ENOSPC)
+			set_bit(GET_SEC_FROM_SEG(sbi, segno),
+					DEDUP_I(sbi)->stuck_secmap);
+		err = nr;
+		goto out;
+	}
+
+	err = lock_shared_owners(sbi, blkaddr, owners, nr, gc_type, segno);
+	if (err)
+		goto out;
+
+	if (!check_valid_map(sbi, segno, off)) {
+		err = -ENOENT;
+		goto unlock_out;
+	}
+
+	/* an owner may have come or gone before all of them were locked */
+	ref = f2fs_dedup_detach_block(sbi, blkaddr, &fphash);
+	if (ref != nr) {
+		f2fs_dedup_attach_block(sbi, blkaddr, blkaddr, ref, fphash);
+		err = -EAGAIN;
+		goto unlock_out;
+	}
+	crypt_ctx = f2fs_dedup_drop_crypt(sbi, blkaddr, &crypt_ino, &crypt_lblk);
+
+	/* don't let age-based placement mix it with ordinary blocks */
+	if (f2fs_dedup_cold_block(sbi, ref))
+		type = CURSEG_COLD_DATA;
+
+	f2fs_wait_on_block_writeback(owners[0].inode, blkaddr);
+
+	/* read page */
+	fio.ino = owners[0].ino;
+	fio.page = owners[0].page;
+	fio.new_blkaddr = fio.old_blkaddr = blkaddr;
+
+	if (lfs_mode)
+		f2fs_down_write(&sbi->io_order_lock);
+
+	mpage = f2fs_grab_cache_page(META_MAPPING(sbi), blkaddr, false);
+	if (!mpage) {
+		err = -ENOMEM;
+		goto up_out;
+	}
+
+	fio.encrypted_page = mpage;
+
+	/* read source block in mpage */
+	if (!PageUptodate(mpage)) {
+		err = f2fs_submit_page_bio(&fio);
+		if (err) {
+			f2fs_put_page(mpage, 1);
+			goto up_out;
+		}
+
+		f2fs_update_iostat(sbi, FS_DATA_READ_IO, F2FS_BLKSIZE);
+		f2fs_update_iostat(sbi, FS_GDATA_READ_IO, F2FS_BLKSIZE);
+
+		lock_page(mpage);
+		if (unlikely(mpage->mapping != META_MAPPING(sbi) ||
+						!PageUptodate(mpage))) {
+			err = -EIO;
+			f2fs_put_page(mpage, 1);
+			goto up_out;
+		}
+	}
+
+	set_summary(&sum, owners[0].nid, owners[0].ofs_in_node,
+						owners[0].version);
+
+	/* allocate block address */
+	f2fs_allocate_data_block(sbi, NULL, blkaddr, &newaddr, &sum, type, NULL);
+
+	fio.encrypted_page = f2fs_pagecache_get_page(META_MAPPING(sbi),
+				newaddr, FGP_LOCK | FGP_CREAT, GFP_NOFS);
+	if (!fio.encrypted_page) {
+		err = -ENOMEM;
+		f2fs_put_page(mpage, 1);
+		goto recover_block;
+	}
+
+	/* write target block */
+	f2fs_wait_on_page_writeback(fio.encrypted_page, DATA, true, true);
+	memcpy(page_address(fio.encrypted_page),
+				page_address(mpage), PAGE_SIZE);
+	f2fs_put_page(mpage, 1);
+	invalidate_mapping_pages(META_MAPPING(sbi), blkaddr, blkaddr);
+	f2fs_invalidate_compress_page(sbi, blkaddr);
+
+	set_page_dirty(fio.encrypted_page);
+	if (clear_page_dirty_for_io(fio.encrypted_page))
+		dec_page_count(sbi, F2FS_DIRTY_META);
+
+	set_page_writeback(fio.encrypted_page);
+	ClearPageError(fio.page);
+
+	fio.op = REQ_OP_WRITE;
+	fio.op_flags = REQ_SYNC;
+	fio.new_blkaddr = newaddr;
+	f2fs_submit_page_write(&fio);
+	if (fio.retry) {
+		err = -EAGAIN;
+		if (PageWriteback(fio.encrypted_page))
+			end_page_writeback(fio.encrypted_page);
+		goto put_page_out;
+	}
+
+	f2fs_update_iostat(sbi, FS_GC_DATA_IO, F2FS_BLKSIZE);
+
+	for (i = 0; i < nr; i++) {
+		struct f2fs_dedup_owner *o = &owners[i];
+
+		set_new_dnode(&dn, o->inode, NULL, NULL, 0);
+		if (f2fs_get_dnode_of_data(&dn, o->page->index, LOOKUP_NODE)) {
+			/* it was read just above, this is not expected */
+			f2fs_err(sbi, "Failed to remap ino %u of shared block %u",
+				 o->ino, blkaddr);
+			set_sbi_flag(sbi, SBI_NEED_FSCK);
+			continue;
+		}
+		f2fs_update_data_blkaddr(&dn, newaddr);
+		f2fs_put_dnode(&dn);
+
+		set_inode_flag(o->inode, FI_APPEND_WRITE);
+		if (o->page->index == 0)
+			set_inode_flag(o->inode, FI_FIRST_BLOCK_WRITTEN);
+	}
+	blkaddr = newaddr;
+put_page_out:
+	f2fs_put_page(fio.encrypted_page, 1);
+recover_block:
+	if (err)
+		f2fs_do_replace_block(sbi, &sum, newaddr, fio.old_blkaddr,
+							true, true, true);
+up_out:
+	if (lfs_mode)
+		f2fs_up_write(&sbi->io_order_lock);
+	if (crypt_ctx)
+		f2fs_dedup_insert_crypt(sbi, blkaddr, crypt_ino, crypt_lblk);
+	f2fs_dedup_attach_block(sbi, fio.old_blkaddr, blkaddr, ref, fphash);
+unlock_out:
+	unlock_shared_owners(owners, nr);
+out:
+	kfree(owners);
+	return err;
+}
+
+/*
+ * Move the blocks of data segment @segno with cold_refs references or
+ * more to the cold data log.  Return the number of moved blocks, or
+ * -EAGAIN if the fs got busy or short of space in the middle.
+ */
+static int move_cold_shared_blocks(struct f2fs_sb_info *sbi,
+		unsigned int segno, struct f2fs_summary_block *sum_blk)
+{
+	struct seg_entry *se = get_seg_entry(sbi, segno);
+	block_t start_addr = START_BLOCK(sbi, segno);
+	unsigned int usable_blks = f2fs_usable_blks_in_seg(sbi, segno);
+	struct page *sum_page;
+	int off, moved = 0;
+	u32 ref;
+
+	if (!IS_DATASEG(se->type) || se->type == CURSEG_COLD_DATA ||
+						!se->valid_blocks)
+		return 0;
+
+	/* work on a copy, SSA pages are locked by block replacement */
+	sum_page = f2fs_get_sum_page(sbi, segno);
+	if (IS_ERR(sum_page))
+		return PTR_ERR(sum_page);
+	memcpy(sum_blk, page_address(sum_page), F2FS_BLKSIZE);
+	f2fs_put_page(sum_page, 1);
+
+	if (GET_SUM_TYPE(&sum_blk->footer) != SUM_TYPE_DATA)
+		return 0;
+
+	for (off = 0; off < usable_blks; off++) {
+		if (kthread_should_stop() || !is_idle(sbi, GC_TIME) ||
+				has_not_enough_free_secs(sbi, 0, 0))
+			return -EAGAIN;
+
+		if (!check_valid_map(sbi, segno, off))
+			continue;
+		ref = f2fs_dedup_block_refs(sbi, start_addr + off);
+		if (!f2fs_dedup_cold_block(sbi, ref))
+			continue;
+
+		if (!move_shared_block(sbi, &sum_blk->entries[off], BG_GC,
+								segno, off))
+			moved++;
+		cond_resched();
+	}
+	return moved;
+}
+
+/*
+ * Empty up to DEDUP_COLD_SEGMENTS segments of cold_segmap of their heavily
+ * shared blocks, called by the GC thread with gc_lock held.  A segment
+ * the fs got busy in the middle of is left marked for the next round.
+ */
+static void gc_cold_shared_blocks(struct f2fs_sb_info *sbi)
+{
+	struct f2fs_dedup_info *dm = DEDUP_I(sbi);
+	struct f2fs_summary_block *sum_blk;
+	unsigned int segno = 0;
+	int i, moved = 0;
+
+	if (!f2fs_dedup_enabled(sbi) || !READ_ONCE(dm->cold_refs) ||
+		find_first_bit(dm->cold_segmap, MAIN_SEGS(sbi)) >=
+							MAIN_SEGS(sbi))
+		return;
+
+	sum_blk = f2fs_kmalloc(sbi, F2FS_BLKSIZE, GFP_NOFS);
+	if (!sum_blk)
+		return;
+
+	for (i = 0; i < DEDUP_COLD_SEGMENTS; i++, segno++) {
+		int ret;
+
+		segno = find_next_bit(dm->cold_segmap, MAIN_SEGS(sbi), segno);
+		if (segno >= MAIN_SEGS(sbi))
+			break;
+		/* its log is still filling it, come back once it is full */
+		if (IS_CURSEG(sbi, segno))
+			continue;
+
+		clear_bit(segno, dm->cold_segmap);
+		ret = move_cold_shared_blocks(sbi, segno, sum_blk);
+		if (ret == -EAGAIN) {
+			set_bit(segno, dm->cold_segmap);
+			break;
+		}
+		if (ret > 0)
+			moved += ret;
+	}
+	kfree(sum_blk);
+
+	if (moved)
+		f2fs_submit_merged_write(sbi, DATA);
+}
+
 static int move_data_page(struct inode *inode, block_t bidx, int gc_type,
 							unsigned int segno, int off)
 {
+	struct f2fs_sb_info *sbi = F2FS_I_SB(inode);
+	u8 digest[DEDUP_FP_SIZE];
 	struct page *page;
+	bool hashed;
 	int err = 0;
 
 	page = f2fs_get_lock_data_page(inode, bidx, true);
 	if (IS_ERR(page))
 		return PTR_ERR(page);
 
-	if (!check_valid_map(F2FS_I_SB(inode), segno, off)) {
+	if (!check_valid_map(sbi, segno, off)) {
 		err = -ENOENT;
 		goto out;
 	}
@@ -1398,6 +1831,11 @@ static int move_data_page(struct inode *inode, block_t bidx, int gc_type,
 	if (err)
 		goto out;
 
+	/* a duplicate read in for migration is merged instead of copied */
+	if (f2fs_dedup_gc_merge(inode, page, START_BLOCK(sbi, segno) + off,
+							digest, &hashed))
+		goto out;
+
 	if (gc_type == BG_GC) {
 		if (PageWriteback(page)) {
 			err = -EAGAIN;
@@ -1407,7 +1845,7 @@ static int move_data_page(struct inode *inode, block_t bidx, int gc_type,
 		set_page_private_gcing(page);
 	} else {
 		struct f2fs_io_info fio = {
-			.sbi = F2FS_I_SB(inode),
+			.sbi = sbi,
 			.ino = inode->i_ino,
 			.type = DATA,
 			.temp = COLD,
@@ -1418,6 +1856,7 @@ static int move_data_page(struct inode *inode, block_t bidx, int gc_type,
 			.encrypted_page = NULL,
 			.need_lock = LOCK_REQ,
 			.io_type = FS_GC_DATA_IO,
+			.dedup_fp = hashed ? digest : NULL,
 		};
 		bool is_dirty = PageDirty(page);
 
@@ -1504,6 +1943,23 @@ next_step:
 			continue;
 		}
 
+		/* a shared block moves once, together with all of its owners */
+		if (f2fs_dedup_block_shared(sbi, start_addr + off)) {
+			int err;
+
+			if (phase != 4)
+				continue;
+			err = move_shared_block(sbi, entry, gc_type, segno, off);
+			if (!err) {
+				submitted++;
+				stat_inc_data_blk_count(sbi, 1, gc_type);
+			}
+			/* the section can't be freed, leave the rest in place */
+			if (err == -ENOSPC)
+				return submitted;
+			continue;
+		}
+
 		/* Get an inode by ino with checking validity */
 		if (!is_alive(sbi, entry, &dni, start_addr + off, &nofs))
 			continue;
@@ -2082,6 +2538,12 @@ int f2fs_resize_fs(struct f2fs_sb_info *sbi, __u64 block_count)
 	if (block_count == old_block_count)
 		return 0;
 
+	/* the dedup area sits at the end of the main area */
+	if (f2fs_dedup_enabled(sbi)) {
+		f2fs_err(sbi, "Shrinking a volume with dedup area is not supported");
+		return -EOPNOTSUPP;
+	}
+
 	if (is_sbi_flag_set(sbi, SBI_NEED_FSCK)) {
 		f2fs_err(sbi, "Should run fsck to repair first.");
 		return -EFSCORRUPTED;
@@ -14,6 +14,9 @@
 #include "iostat.h"
 #include <trace/events/f2fs.h>
 
+#define CREATE_TRACE_POINTS
+#include "dedup_trace.h"
+
 #define NUM_PREALLOC_IOSTAT_CTXS	128
 static struct kmem_cache *bio_iostat_ctx_cache;
 static mempool_t *bio_iostat_ctx_pool;
@@ -81,6 +84,8 @@ int __maybe_unused iostat_info_seq_show(struct seq_file *seq, void *offset)
 	seq_puts(seq, "[OTHER]\n");
 	seq_printf(seq, "fs discard:	%-16llu\n",
 				sbi->rw_iostat[FS_DISCARD]);
+	seq_printf(seq, "fs dedup:	%-16llu\n",
+				sbi->rw_iostat[FS_DEDUP_IO]);
 
 	return 0;
 }
@@ -112,6 +117,80 @@ static inline void __record_iostat_latency(struct f2fs_sb_info *sbi)
 	trace_f2fs_iostat_latency(sbi, iostat_lat);
 }
 
+static const char * const dedup_lat_names[NR_DEDUP_LAT] = {
+	[DEDUP_LAT_HASH]	= "hash",
+	[DEDUP_LAT_LOOKUP]	= "lookup",
+	[DEDUP_LAT_INSERT]	= "insert",
+	[DEDUP_LAT_FLUSH]	= "flush",
+	[DEDUP_LAT_WRITE]	= "write",
+};
+
+/* sum the buckets of @stage over all cpus into @cnt, return the total */
+static unsigned long long __sum_dedup_latency(struct f2fs_sb_info *sbi,
+		int stage, unsigned long long *cnt, unsigned long long *sum)
+{
+	unsigned long long total = 0;
+	int cpu, i;
+
+	memset(cnt, 0, sizeof(*cnt) * NR_DEDUP_LAT_BUCKETS);
+	*sum = 0;
+	for_each_possible_cpu(cpu) {
+		struct dedup_lat_info *pcpu = per_cpu_ptr(sbi->dedup_lat, cpu);
+
+		for (i = 0; i < NR_DEDUP_LAT_BUCKETS; i++)
+			cnt[i] += pcpu->cnt[stage][i];
+		*sum += pcpu->sum_ns[stage];
+	}
+	for (i = 0; i < NR_DEDUP_LAT_BUCKETS; i++)
+		total += cnt[i];
+	return total;
+}
+
+/* upper bound of the bucket holding the @pct percentile of @cnt */
+static unsigned long long dedup_lat_percentile(unsigned long long *cnt,
+				unsigned long long total, unsigned int pct)
+{
+	unsigned long long target = div_u64(total * pct + 99, 100);
+	unsigned long long seen = 0;
+	int i;
+
+	for (i = 0; i < NR_DEDUP_LAT_BUCKETS - 1; i++) {
+		seen += cnt[i];
+		if (seen >= target)
+			break;
+	}
+	return (1ULL << DEDUP_LAT_MIN_SHIFT) << i;
+}
+
+static inline void __record_dedup_latency(struct f2fs_sb_info *sbi)
+{
+	struct dedup_lat_info *prev = sbi->prev_dedup_lat;
+	unsigned long long cnt[NR_DEDUP_LAT_BUCKETS];
+	unsigned long long total, sum, diff;
+	int stage, i;
+
+	for (stage = 0; stage < NR_DEDUP_LAT; stage++) {
+		__sum_dedup_latency(sbi, stage, cnt, &sum);
+
+		/* only what was recorded since the last period */
+		total = 0;
+		for (i = 0; i < NR_DEDUP_LAT_BUCKETS; i++) {
+			diff = cnt[i] - prev->cnt[stage][i];
+			prev->cnt[stage][i] = cnt[i];
+			cnt[i] = diff;
+			total += diff;
+		}
+		diff = sum - prev->sum_ns[stage];
+		prev->sum_ns[stage] = sum;
+
+		if (total)
+			trace_f2fs_dedup_latency(sbi, stage, total,
+				div64_u64(diff, total),
+				dedup_lat_percentile(cnt, total, 50),
+				dedup_lat_percentile(cnt, total, 99));
+	}
+}
+
 static inline void f2fs_record_iostat(struct f2fs_sb_info *sbi)
 {
 	unsigned long long iostat_diff[NR_IO_TYPE];
@@ -140,6 +219,7 @@ static inline void f2fs_record_iostat(struct f2fs_sb_info *sbi)
 	trace_f2fs_iostat(sbi, iostat_diff);
 
 	__record_iostat_latency(sbi);
+	__record_dedup_latency(sbi);
 }
 
 void f2fs_reset_iostat(struct f2fs_sb_info *sbi)
@@ -157,6 +237,11 @@ void f2fs_reset_iostat(struct f2fs_sb_info *sbi)
 	spin_lock_irq(&sbi->iostat_lat_lock);
 	memset(io_lat, 0, sizeof(struct iostat_lat_info));
 	spin_unlock_irq(&sbi->iostat_lat_lock);
+
+	for_each_possible_cpu(i)
+		memset(per_cpu_ptr(sbi->dedup_lat, i), 0,
+					sizeof(struct dedup_lat_info));
+	memset(sbi->prev_dedup_lat, 0, sizeof(struct dedup_lat_info));
 }
 
 void f2fs_update_iostat(struct f2fs_sb_info *sbi,
@@ -181,6 +266,46 @@ void f2fs_update_iostat(struct f2fs_sb_info *sbi,
 	f2fs_record_iostat(sbi);
 }
 
+void f2fs_update_dedup_latency(struct f2fs_sb_info *sbi, int stage,
+						u64 start_ns)
+{
+	u64 lat;
+	unsigned int idx;
+
+	/* iostat was off when the stage started */
+	if (!start_ns || !sbi->iostat_enable)
+		return;
+
+	lat = ktime_get_ns() - start_ns;
+	idx = min_t(unsigned int, fls64(lat >> DEDUP_LAT_MIN_SHIFT),
+					NR_DEDUP_LAT_BUCKETS - 1);
+	this_cpu_inc(sbi->dedup_lat->cnt[stage][idx]);
+	this_cpu_add(sbi->dedup_lat->sum_ns[stage], lat);
+}
+
+/* cumulative latency of every dedup stage, for sysfs */
+int f2fs_show_dedup_latency(struct f2fs_sb_info *sbi, char *buf)
+{
+	unsigned long long cnt[NR_DEDUP_LAT_BUCKETS];
+	unsigned long long total, sum;
+	int stage, i, len = 0;
+
+	for (stage = 0; stage < NR_DEDUP_LAT; stage++) {
+		total = __sum_dedup_latency(sbi, stage, cnt, &sum);
+
+		len += sysfs_emit_at(buf, len,
+			"%-6s cnt: %llu avg: %llu p50: %llu p99: %llu buckets:",
+			dedup_lat_names[stage], total,
+			total ? div64_u64(sum, total) : 0,
+			total ? dedup_lat_percentile(cnt, total, 50) : 0,
+			total ? dedup_lat_percentile(cnt, total, 99) : 0);
+		for (i = 0; i < NR_DEDUP_LAT_BUCKETS; i++)
+			len += sysfs_emit_at(buf, len, " %llu", cnt[i]);
+		len += sysfs_emit_at(buf, len, "\n");
+	}
+	return len;
+}
+
 static inline void __update_iostat_latency(struct bio_iostat_ctx *iostat_ctx,
 				int rw, bool is_sync)
 {
@@ -279,10 +404,26 @@ int f2fs_init_iostat(struct f2fs_sb_info *sbi)
 	if (!sbi->iostat_io_lat)
 		return -ENOMEM;
 
+	sbi->dedup_lat = alloc_percpu(struct dedup_lat_info);
+	if (!sbi->dedup_lat)
+		goto free_io_lat;
+	sbi->prev_dedup_lat = f2fs_kzalloc(sbi, sizeof(struct dedup_lat_info),
+					GFP_KERNEL);
+	if (!sbi->prev_dedup_lat)
+		goto free_dedup_lat;
+
 	return 0;
+
+free_dedup_lat:
+	free_percpu(sbi->dedup_lat);
+free_io_lat:
+	kfree(sbi->iostat_io_lat);
+	return -ENOMEM;
 }
 
 void f2fs_destroy_iostat(struct f2fs_sb_info *sbi)
 {
+	kfree(sbi->prev_dedup_lat);
+	free_percpu(sbi->dedup_lat);
 	kfree(sbi->iostat_io_lat);
 }
@@ -8,6 +8,16 @@
 
 struct bio_post_read_ctx;
 
+/* stages of the dedup write path whose latency is recorded */
+enum {
+	DEDUP_LAT_HASH,		/* fingerprint a block */
+	DEDUP_LAT_LOOKUP,	/* look up and share a block */
+	DEDUP_LAT_INSERT,	/* index a block just written */
+	DEDUP_LAT_FLUSH,	/* write dirty table blocks in checkpoint */
+	DEDUP_LAT_WRITE,	/* do_write_page of a data block */
+	NR_DEDUP_LAT,
+};
+
 #ifdef CONFIG_F2FS_IOSTAT
 
 #define DEFAULT_IOSTAT_PERIOD_MS	3000
@@ -28,11 +38,33 @@ struct iostat_lat_info {
 	unsigned int bio_cnt[MAX_IO_TYPE][NR_PAGE_TYPE];	/* bio count */
 };
 
+/*
+ * Latencies are counted in power of two buckets of nanoseconds: bucket 0
+ * is below 256ns, bucket n covers [128ns << n, 256ns << n), and the last
+ * one takes everything from 67ms on.
+ */
+#define DEDUP_LAT_MIN_SHIFT	8
+#define NR_DEDUP_LAT_BUCKETS	20
+
+struct dedup_lat_info {
+	unsigned long long cnt[NR_DEDUP_LAT][NR_DEDUP_LAT_BUCKETS];
+	unsigned long long sum_ns[NR_DEDUP_LAT];	/* sum of latencies */
+};
+
 extern int __maybe_unused iostat_info_seq_show(struct seq_file *seq,
 			void *offset);
 extern void f2fs_reset_iostat(struct f2fs_sb_info *sbi);
 extern void f2fs_update_iostat(struct f2fs_sb_info *sbi,
 			enum iostat_type type, unsigned long long io_bytes);
+extern void f2fs_update_dedup_latency(struct f2fs_sb_info *sbi, int stage,
+			u64 start_ns);
+extern int f2fs_show_dedup_latency(struct f2fs_sb_info *sbi, char *buf);
+
+/* start time of a dedup stage, 0 if latencies are not recorded */
+static inline u64 f2fs_dedup_lat_start(struct f2fs_sb_info *sbi)
+{
+	return sbi->iostat_enable ? ktime_get_ns() : 0;
+}
 
 struct bio_iostat_ctx {
 	struct f2fs_sb_info *sbi;
@@ -67,6 +99,12 @@ extern void f2fs_destroy_iostat(struct f2fs_sb_info *sbi);
 #else
 static inline void f2fs_update_iostat(struct f2fs_sb_info *sbi,
 		enum iostat_type type, unsigned long long io_bytes) {}
+static inline void f2fs_update_dedup_latency(struct f2fs_sb_info *sbi,
+		int stage, u64 start_ns) {}
+static inline u64 f2fs_dedup_lat_start(struct f2fs_sb_info *sbi)
+{
+	return 0;
+}
 static inline void iostat_update_and_unbind_ctx(struct bio *bio, int rw) {}
 static inline void iostat_alloc_and_bind_ctx(struct f2fs_sb_info *sbi,
 		struct bio *bio, struct bio_post_read_ctx *ctx) {}
@@ -108,6 +108,13 @@ bool f2fs_available_free_memory(struct f2fs_sb_info *sbi, int type)
 #else
 		res = false;
 #endif
+	} else if (type == DEDUP_PAGE) {
+		unsigned long free_ram = val.freeram;
+
+		/* shared blocks are cached along with meta pages */
+		res = (free_ram > avail_ram * DEDUP_CACHE_WATERMARK / 100) &&
+			(META_MAPPING(sbi)->nrpages <
+			 free_ram * DEDUP_CACHE_PERCENT / 100);
 	} else {
 		if (!sbi->sb->s_bdi->wb.dirty_exceeded)
 			return true;
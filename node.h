@@ -149,6 +149,7 @@ enum mem_type {
 	EXTENT_CACHE,	/* indicates extent cache */
 	DISCARD_CACHE,	/* indicates memory of cached discard cmds */
 	COMPRESS_PAGE,	/* indicates memory of cached compressed pages */
+	DEDUP_PAGE,	/* indicates memory of cached shared blocks */
 	BASE_CHECK,	/* check kernel status */
 };
 
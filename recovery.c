@@ -12,6 +12,7 @@
 #include "f2fs.h"
 #include "node.h"
 #include "segment.h"
+#include "dedup.h"
 
 /*
  * Roll forward recovery scenarios.
@@ -462,33 +463,22 @@ static void destroy_fsync_dnodes(struct list_head *head, int drop)
 		del_fsync_inode(entry, drop);
 }
 
-static int check_index_in_prev_nodes(struct f2fs_sb_info *sbi,
-			block_t blkaddr, struct dnode_of_data *dn)
+/* get the summary of a block which is valid, as of the last checkpoint */
+static int get_prev_summary(struct f2fs_sb_info *sbi, block_t blkaddr,
+						struct f2fs_summary *sum)
 {
-	struct seg_entry *sentry;
 	unsigned int segno = GET_SEGNO(sbi, blkaddr);
 	unsigned short blkoff = GET_BLKOFF_FROM_SEG0(sbi, blkaddr);
 	struct f2fs_summary_block *sum_node;
-	struct f2fs_summary sum;
-	struct page *sum_page, *node_page;
-	struct dnode_of_data tdn = *dn;
-	nid_t ino, nid;
-	struct inode *inode;
-	unsigned int offset;
-	block_t bidx;
+	struct page *sum_page;
 	int i;
 
-	sentry = get_seg_entry(sbi, segno);
-	if (!f2fs_test_bit(blkoff, sentry->cur_valid_map))
-		return 0;
-
-	/* Get the previous summary */
 	for (i = CURSEG_HOT_DATA; i <= CURSEG_COLD_DATA; i++) {
 		struct curseg_info *curseg = CURSEG_I(sbi, i);
 
 		if (curseg->segno == segno) {
-			sum = curseg->sum_blk->entries[blkoff];
-			goto got_it;
+			*sum = curseg->sum_blk->entries[blkoff];
+			return 0;
 		}
 	}
 
@@ -496,9 +486,78 @@ static int check_index_in_prev_nodes(struct f2fs_sb_info *sbi,
 	if (IS_ERR(sum_page))
 		return PTR_ERR(sum_page);
 	sum_node = (struct f2fs_summary_block *)page_address(sum_page);
-	sum = sum_node->entries[blkoff];
+	*sum = sum_node->entries[blkoff];
 	f2fs_put_page(sum_page, 1);
-got_it:
+	return 0;
+}
+
+static inline bool is_valid_in_sit(struct f2fs_sb_info *sbi, block_t blkaddr)
+{
+	struct seg_entry *sentry = get_seg_entry(sbi, GET_SEGNO(sbi, blkaddr));
+
+	return f2fs_test_bit(GET_BLKOFF_FROM_SEG0(sbi, blkaddr),
+						sentry->cur_valid_map);
+}
+
+/*
+ * A block freed since the last checkpoint is not allocated again before
+ * the next one, so a block which is valid already and was not written
+ * for this index has been shared by it.  Replay the reference taken then,
+ * instead of taking the block away from its other owners, which is safe
+ * even for an index moved here by F2FS_IOC_MOVE_RANGE.  Return 1 if
+ * @blkaddr was recovered as shared.
+ */
+static int recover_shared_block(struct f2fs_sb_info *sbi,
+			struct dnode_of_data *dn, block_t blkaddr)
+{
+	struct f2fs_summary sum;
+	int err;
+
+	if (!is_valid_in_sit(sbi, blkaddr))
+		return 0;
+
+	err = get_prev_summary(sbi, blkaddr, &sum);
+	if (err)
+		return err;
+	if (le32_to_cpu(sum.nid) == dn->nid &&
+			le16_to_cpu(sum.ofs_in_node) == dn->ofs_in_node)
+		return 0;
+
+	err = f2fs_dedup_get_block(sbi, blkaddr);
+	if (err) {
+		/* other owners can't tell when the block is free any more */
+		f2fs_err(sbi, "Lost refcount of shared block %u (%d)",
+			 blkaddr, err);
+		set_sbi_flag(sbi, SBI_NEED_FSCK);
+	}
+
+	f2fs_truncate_data_blocks_range(dn, 1);
+	f2fs_i_blocks_write(dn->inode, 1, true, false);
+	f2fs_dedup_add_owner(sbi, blkaddr, dn->nid, dn->ofs_in_node);
+	f2fs_update_data_blkaddr(dn, blkaddr);
+	return 1;
+}
+
+static int check_index_in_prev_nodes(struct f2fs_sb_info *sbi,
+			block_t blkaddr, struct dnode_of_data *dn)
+{
+	struct f2fs_summary sum;
+	struct page *node_page;
+	struct dnode_of_data tdn = *dn;
+	nid_t ino, nid;
+	struct inode *inode;
+	unsigned int offset;
+	block_t bidx;
+	int err;
+
+	if (!is_valid_in_sit(sbi, blkaddr))
+		return 0;
+
+	/* Get the previous summary */
+	err = get_prev_summary(sbi, blkaddr, &sum);
+	if (err)
+		return err;
+
 	/* Use the locked dnode page and inode */
 	nid = le32_to_cpu(sum.nid);
 	if (dn->inode->i_ino == nid) {
@@ -677,6 +736,17 @@ retry_dn:
 		/* dest is valid block, try to recover from src to dest */
 		if (f2fs_is_valid_blkaddr(sbi, dest, META_POR)) {
 
+			if (f2fs_dedup_enabled(sbi)) {
+				err = recover_shared_block(sbi, &dn, dest);
+				if (err < 0)
+					goto err;
+				if (err) {
+					err = 0;
+					recovered++;
+					continue;
+				}
+			}
+
 			if (src == NULL_ADDR) {
 				err = f2fs_reserve_new_block(&dn);
 				while (err &&
@@ -23,6 +23,7 @@
 #include "node.h"
 #include "gc.h"
 #include "iostat.h"
+#include "dedup.h"
 #include <trace/events/f2fs.h>
 
 #define __reverse_ffz(x) __reverse_ffs(~(x))
@@ -32,249 +33,6 @@ static struct kmem_cache *discard_cmd_slab;
 static struct kmem_cache *sit_entry_set_slab;
 static struct kmem_cache *revoke_entry_slab;
 
-#define DEDUP_TABLE_SIZE (1024 * 1024)
-
-
-
-struct Fingeritem {
-	char fingerprint[16];
-	size_t blk_addr;
-};
-
-struct Blkrefitem {
-	size_t blk_addr;
-	size_t ref;
-};
-
-// 根据加密page的指纹获取lblk_num
-struct Fingercryptitem {
-	char fingerprint_crypt[16];
-	u64 lblk_num;
-};
-
-struct Fingeritem *hashArray[DEDUP_TABLE_SIZE];
-struct Blkrefitem *blkArray[DEDUP_TABLE_SIZE];
-struct Fingercryptitem *hashcryptArray[DEDUP_TABLE_SIZE];
-
-void read_finger_blk_table_from_file(void) {
-	struct file *finger_table = NULL;
-	struct file *finger_crypt_table = NULL;
-	struct file *block_table = NULL;
-	loff_t pos_f, pos_b, pos_c;
-	int hashIndex = 0;
-
-	finger_table = filp_open("/fingertable", O_RDWR | O_CREAT, 0);
-	finger_crypt_table = filp_open("/fingercrypttable", O_RDWR | O_CREAT, 0);
-	block_table = filp_open("/blocktable", O_RDWR | O_CREAT, 0);
-	// 给HashArray的每个元素分配空间
-	for (hashIndex = 0; hashIndex < DEDUP_TABLE_SIZE; hashIndex++) {
-		if (hashArray[hashIndex] == NULL) {
-			hashArray[hashIndex] = (struct Fingeritem *)kmalloc(sizeof(struct Fingeritem), GFP_KERNEL);
-			hashArray[hashIndex]->blk_addr = 0;
-		}
-		if (hashcryptArray[hashIndex] == NULL) {
-			hashcryptArray[hashIndex] = (struct Fingercryptitem *)kmalloc(sizeof(struct Fingercryptitem), GFP_KERNEL);
-			hashcryptArray[hashIndex]->lblk_num = -1;
-		}
-		if (blkArray[hashIndex] == NULL) {
-			blkArray[hashIndex] = (struct Blkrefitem *)kmalloc(sizeof(struct Blkrefitem), GFP_KERNEL);
-			blkArray[hashIndex]->blk_addr = 0;
-			blkArray[hashIndex]->ref = 0;
-		}
-	}
-	// 从文件中读取并存储到HashArray中
-	for (hashIndex = 0, pos_f = 0, pos_c = 0, pos_b = 0; hashIndex < DEDUP_TABLE_SIZE; hashIndex++) {
-		kernel_read(finger_table, hashArray[hashIndex], sizeof(struct Fingeritem), &pos_f);
-		kernel_read(finger_crypt_table, hashcryptArray[hashIndex], sizeof(struct Fingercryptitem), &pos_c);
-		kernel_read(block_table, blkArray[hashIndex], sizeof(struct Blkrefitem), &pos_b);
-	}
-	filp_close(finger_table, NULL);
-	filp_close(finger_crypt_table, NULL);
-	filp_close(block_table, NULL);
-}
-
-void write_finger_blk_table_to_file(void) {
-	struct file *finger_table = NULL;
-	struct file *finger_crypt_table = NULL;
-	struct file *block_table = NULL;
-	loff_t pos_f, pos_b, pos_c;
-	int hashIndex = 0;
-
-	finger_table = filp_open("/fingertable", O_RDWR | O_CREAT, 0);
-	finger_crypt_table = filp_open("/fingercrypttable", O_RDWR | O_CREAT, 0);
-	block_table = filp_open("/blocktable", O_RDWR | O_CREAT, 0);
-	// 把HashArray中所有元素写到文件中
-	for (hashIndex = 0, pos_f = 0, pos_c =0, pos_b=0; hashIndex < DEDUP_TABLE_SIZE; hashIndex++) {
-		if (hashArray[hashIndex] != NULL) {
-			kernel_write(finger_table, hashArray[hashIndex], sizeof(struct Fingeritem), &pos_f);
-		}
-		if (hashcryptArray[hashIndex] != NULL) {
-			kernel_write(finger_crypt_table, hashcryptArray[hashIndex], sizeof(struct Fingercryptitem), &pos_c);
-		}
-		if (blkArray[hashIndex] != NULL) {
-			kernel_write(block_table, blkArray[hashIndex], sizeof(struct Blkrefitem), &pos_b);
-		}
-	}
-	filp_close(finger_table, NULL);
-	filp_close(finger_crypt_table, NULL);
-	filp_close(block_table, NULL);
-}
-
-size_t hashFinger(char *finger)
-{
-	size_t hash = 0;
-	for (size_t i = 0; i < 16; i++)
-		hash += (size_t)finger[i];
-	hash = hash % DEDUP_TABLE_SIZE;
-	return hash;
-}
-
-size_t hashBlk(size_t blk_addr){
-	return blk_addr % DEDUP_TABLE_SIZE;
-}
-	
-struct Fingeritem *finger_search(char *finger)
-{
-	//get the hash
-	size_t hashIndex = hashFinger(finger);
-	int loop = 0;
-	//move in array until an empty
-	while (hashArray[hashIndex] != NULL) {
-		int ret =
-			strncmp(hashArray[hashIndex]->fingerprint, finger, 16);
-		if (!ret)
-			return hashArray[hashIndex];
-
-		//go to next cell
-		++hashIndex;
-		loop++;
-		if (loop > DEDUP_TABLE_SIZE)
-			return NULL;
-
-		//wrap around the table
-		hashIndex %= DEDUP_TABLE_SIZE;
-	}
-
-	return NULL;
-}
-
-struct Blkrefitem *block_search(size_t blk_addr)
-{
-	size_t blkIndex = hashBlk(blk_addr);
-	int loop = 0;
-	while (blkArray[blkIndex] != NULL) {
-		if (blkArray[blkIndex]->blk_addr == blk_addr &&
-		    blkArray[blkIndex]->ref != 0)
-			return blkArray[blkIndex];
-		++blkIndex;
-		loop++;
-		if (loop > DEDUP_TABLE_SIZE)
-			return NULL;
-
-		blkIndex %= DEDUP_TABLE_SIZE;
-	}
-	return NULL;
-}
-
-struct Fingercryptitem *finger_crypt_search(char *finger)
-{
-	//get the hash
-	size_t hashIndex = hashFinger(finger);
-	int loop;
-	//move in array until an empty
-	loop = 0;
-	while (hashcryptArray[hashIndex] != NULL) {
-		int ret =
-			strncmp(hashcryptArray[hashIndex]->fingerprint_crypt, finger, 16);
-		if (!ret)
-			return hashcryptArray[hashIndex];
-
-		//go to next cell
-		++hashIndex;
-		loop++;
-		if (loop > DEDUP_TABLE_SIZE)
-			return NULL;
-
-		//wrap around the table
-		hashIndex %= DEDUP_TABLE_SIZE;
-	}
-
-	return NULL;
-}
-
-int deduptable_insert(char *finger, size_t blk_addr, size_t ref)
-{
-	size_t hashIndex, blkIndex;
-	int loop;
-	struct Fingeritem *finger_item = (struct Fingeritem *)kmalloc(
-		sizeof(struct Fingeritem), GFP_KERNEL);
-	struct Blkrefitem *blk_item = (struct Blkrefitem *)kmalloc(
-		sizeof(struct Blkrefitem), GFP_KERNEL);
-	strncpy(finger_item->fingerprint, finger, 16);
-	finger_item->blk_addr = blk_addr;
-	blk_item->blk_addr = blk_addr;
-	blk_item->ref = ref;
-	//get the hash
-	hashIndex = hashFinger(finger);
-	loop = 0;
-	//move in array until an empty or deleted cell
-	// 读文件的时候给所有元素都分配了空间，需要再判断一下blk_addr
-	while (hashArray[hashIndex] != NULL && hashArray[hashIndex]->blk_addr != 0) {
-		//go to next cell
-		++hashIndex;
-
-		//wrap around the table
-		hashIndex %= DEDUP_TABLE_SIZE;
-		loop++;
-		if (loop > DEDUP_TABLE_SIZE)
-			return 1;
-	}
-	// 因为读文件的时候给所有元素都分配了空间，所以这里需要先free
-	kfree(hashArray[hashIndex]);
-	hashArray[hashIndex] = finger_item;
-
-	loop = 0;
-	blkIndex = hashBlk(blk_addr);
-	while (blkArray[blkIndex] != NULL && blkArray[blkIndex]->blk_addr !=0 && blkArray[blkIndex]->ref != 0) {
-		//go to next cell
-		++blkIndex;
-
-		//wrap around the table
-		hashIndex %= DEDUP_TABLE_SIZE;
-		loop++;
-		if (loop > DEDUP_TABLE_SIZE)
-			return 1;
-	}
-	kfree(blkArray[blkIndex]);
-	blkArray[blkIndex] = blk_item;
-
-	return 0;
-}
-
-int crypt_lblknum_insert(char* finger_crypt, u64 lblk_num) {
-	struct Fingercryptitem *finger_crypt_item = (struct Fingercryptitem *)kmalloc(
-		sizeof(struct Fingercryptitem), GFP_KERNEL);
-	int loop = 0;
-	size_t hashIndex = hashFinger(finger_crypt);
-
-	strncpy(finger_crypt_item->fingerprint_crypt, finger_crypt, 16);
-	finger_crypt_item->lblk_num = lblk_num;
-	while (hashcryptArray[hashIndex] != NULL && hashcryptArray[hashIndex]->lblk_num != -1) {
-		//go to next cell
-		++hashIndex;
-
-		//wrap around the table
-		hashIndex %= DEDUP_TABLE_SIZE;
-		loop++;
-		if (loop > DEDUP_TABLE_SIZE)
-			return 1;
-	}
-	kfree(hashcryptArray[hashIndex]);
-	hashcryptArray[hashIndex] = finger_crypt_item;
-	return 0;
-}
-
-
 static unsigned long __reverse_ulong(unsigned char *str)
 {
 	unsigned long tmp = 0;
@@ -2078,6 +1836,10 @@ static bool add_discard_addrs(struct f2fs_sb_info *sbi, struct cp_control *cpc,
 	unsigned long *dmap = SIT_I(sbi)->tmp_map;
 	unsigned int start = 0, end = -1;
 	bool force = (cpc->reason & CP_DISCARD);
+	/* see f2fs_dedup_coalesce_discard() */
+	bool coalesce = !force &&
+			f2fs_dedup_coalesce_discard(sbi, cpc->trim_start);
+	bool held = false;
 	struct discard_entry *de = NULL;
 	struct list_head *head = &SM_I(sbi)->dcc_info->entry_list;
 	int i;
@@ -2096,6 +1858,7 @@ static bool add_discard_addrs(struct f2fs_sb_info *sbi, struct cp_control *cpc,
 	/* SIT_VBLOCK_MAP_SIZE should be multiple of sizeof(unsigned long) */
 	for (i = 0; i < entries; i++)
 		dmap[i] = force ? ~ckpt_map[i] & ~discard_map[i] :
+			coalesce ? ~cur_map[i] & ~discard_map[i] :
 				  (cur_map[i] ^ ckpt_map[i]) & ckpt_map[i];
 
 	while (force || SM_I(sbi)->dcc_info->nr_discards <=
@@ -2109,6 +1872,17 @@ static bool add_discard_addrs(struct f2fs_sb_info *sbi, struct cp_control *cpc,
 		    (end - start) < cpc->trim_minlen)
 			continue;
 
+		if (coalesce) {
+			if (end - start <
+				SM_I(sbi)->dcc_info->discard_granularity) {
+				held = true;
+				continue;
+			}
+			/* nothing in it was freed since the last checkpoint */
+			if (__find_rev_next_bit(ckpt_map, end, start) >= end)
+				continue;
+		}
+
 		if (check_only)
 			return true;
 
@@ -2124,6 +1898,10 @@ static bool add_discard_addrs(struct f2fs_sb_info *sbi, struct cp_control *cpc,
 
 		SM_I(sbi)->dcc_info->nr_discards += end - start;
 	}
+
+	/* keep coalescing until no run is left behind */
+	if (coalesce && !check_only && !held && start >= max_blocks)
+		f2fs_dedup_hold_discard(sbi, cpc->trim_start, false);
 	return false;
 }
 
@@ -2518,6 +2296,26 @@ static void update_sit_entry(struct f2fs_sb_info *sbi, block_t blkaddr, int del)
 		get_sec_entry(sbi, segno)->valid_blocks += del;
 }
 
+/*
+ * Drop a reference on the data block at @addr.  Return true if other files
+ * still share it: it then stays valid in SIT, and is accounted again since
+ * callers account the block they drop as released.
+ */
+static bool f2fs_put_shared_block(struct f2fs_sb_info *sbi, block_t addr)
+{
+	if (!f2fs_dedup_enabled(sbi) ||
+		!IS_DATASEG(get_seg_entry(sbi, GET_SEGNO(sbi, addr))->type))
+		return false;
+
+	if (!f2fs_dedup_put_block(sbi, addr))
+		return false;
+
+	spin_lock(&sbi->stat_lock);
+	sbi->total_valid_block_count++;
+	spin_unlock(&sbi->stat_lock);
+	return true;
+}
+
 void f2fs_invalidate_blocks(struct f2fs_sb_info *sbi, block_t addr)
 {
 	unsigned int segno = GET_SEGNO(sbi, addr);
@@ -2527,6 +2325,9 @@ void f2fs_invalidate_blocks(struct f2fs_sb_info *sbi, block_t addr)
 	if (addr == NEW_ADDR || addr == COMPRESS_ADDR)
 		return;
 
+	if (f2fs_put_shared_block(sbi, addr))
+		return;
+
 	invalidate_mapping_pages(META_MAPPING(sbi), addr, addr);
 	f2fs_invalidate_compress_page(sbi, addr);
 
@@ -2542,6 +2343,50 @@ void f2fs_invalidate_blocks(struct f2fs_sb_info *sbi, block_t addr)
 	up_write(&sit_i->sentry_lock);
 }
 
+/*
+ * Take @count free segments starting at @start_segno out of the allocator
+ * and mark all of their blocks valid, so that GC, SSR and discard never
+ * touch them.  This is how the dedup area is carved out of the main area.
+ */
+int f2fs_claim_segments(struct f2fs_sb_info *sbi, unsigned int start_segno,
+						unsigned int count)
+{
+	struct sit_info *sit_i = SIT_I(sbi);
+	unsigned int segno, end_segno = start_segno + count;
+	int err = 0;
+
+	down_write(&sit_i->sentry_lock);
+
+	for (segno = start_segno; segno < end_segno; segno++) {
+		if (IS_CURSEC(sbi, GET_SEC_FROM_SEG(sbi, segno)) ||
+				test_bit(segno, FREE_I(sbi)->free_segmap) ||
+				get_valid_blocks(sbi, segno, false)) {
+			err = -EBUSY;
+			goto out;
+		}
+	}
+
+	for (segno = start_segno; segno < end_segno; segno++) {
+		block_t blkaddr = START_BLOCK(sbi, segno);
+		block_t end = blkaddr + sbi->blocks_per_seg;
+
+		__set_test_and_inuse(sbi, segno);
+		for (; blkaddr < end; blkaddr++)
+			update_sit_entry(sbi, blkaddr, 1);
+		get_seg_entry(sbi, segno)->type = CURSEG_COLD_DATA;
+		locate_dirty_segment(sbi, segno);
+	}
+
+	spin_lock(&sbi->stat_lock);
+	sbi->total_valid_block_count += count << sbi->log_blocks_per_seg;
+	spin_unlock(&sbi->stat_lock);
+
+	set_sbi_flag(sbi, SBI_IS_DIRTY);
+out:
+	up_write(&sit_i->sentry_lock);
+	return err;
+}
+
 bool f2fs_is_checkpointed_data(struct f2fs_sb_info *sbi, block_t blkaddr)
 {
 	struct sit_info *sit_i = SIT_I(sbi);
@@ -3481,6 +3326,11 @@ void f2fs_allocate_data_block(struct f2fs_sb_info *sbi, struct page *page,
 	unsigned long long old_mtime;
 	bool from_gc = (type == CURSEG_ALL_DATA_ATGC);
 	struct seg_entry *se = NULL;
+	bool keep_old = false;
+
+	/* decided out of the locks below, a shared old block stays valid */
+	if (!IS_NODESEG(type) && __is_valid_data_blkaddr(old_blkaddr))
+		keep_old = f2fs_put_shared_block(sbi, old_blkaddr);
 
 	f2fs_down_read(&SM_I(sbi)->curseg_lock);
 
@@ -3523,7 +3373,7 @@ void f2fs_allocate_data_block(struct f2fs_sb_info *sbi, struct page *page,
 	 * since SSR needs latest valid block information.
 	 */
 	update_sit_entry(sbi, *new_blkaddr, 1);
-	if (GET_SEGNO(sbi, old_blkaddr) != NULL_SEGNO)
+	if (GET_SEGNO(sbi, old_blkaddr) != NULL_SEGNO && !keep_old)
 		update_sit_entry(sbi, old_blkaddr, -1);
 
 	if (!__has_curseg_space(sbi, curseg)) {
@@ -3595,47 +3445,68 @@ void f2fs_update_device_state(struct f2fs_sb_info *sbi, nid_t ino,
 	}
 }
 
-void __attribute__((optimize("O0"))) hash_page_data(struct page* page, char* digest){
-	struct shash_desc* desc;
-	struct crypto_shash* item;
-	item = crypto_alloc_shash("md5",0,0);
-	desc = kmalloc(sizeof(struct shash_desc) + crypto_shash_descsize(item),GFP_NOIO);
-	desc->tfm = item;
-	crypto_shash_init(desc);
-	crypto_shash_update(desc,page_address(page),4096);
-	crypto_shash_final(desc, digest);
-	crypto_free_shash(desc->tfm);
-	kfree(desc);
+/* dedup found the data on disk already, finish the page without a bio */
+static void dedup_skip_write(struct f2fs_io_info *fio)
+{
+	fio->dedup_skipped = true;
+	f2fs_update_iostat(fio->sbi, FS_DEDUP_IO, F2FS_BLKSIZE);
+	/* no end_io is there to release the bounce page */
+	if (fio->encrypted_page)
+		fscrypt_finalize_bounce_page(&fio->encrypted_page);
+	end_page_writeback(fio->page);
 }
 
-static void __attribute__((optimize("O0"))) do_write_page(struct f2fs_summary *sum, struct f2fs_io_info *fio)
+static void do_write_page(struct f2fs_summary *sum, struct f2fs_io_info *fio)
 {
-	char digest[16], digest_c[16];
-	struct Fingeritem *finger;
-	struct Blkrefitem *blkitem;
+	u8 digest[DEDUP_FP_SIZE];
 	int type = __get_segment_type(fio);
 	bool keep_order = (f2fs_lfs_mode(fio->sbi) && type == CURSEG_COLD_DATA);
+	/* compressed clusters are shared as a whole before compressing */
+	bool dedup = (fio->io_type == FS_DATA_IO && !fio->compressed_page &&
+				f2fs_dedup_inline(fio->sbi) &&
+				f2fs_dedup_file(fio->page->mapping->host));
+	u64 start = dedup ? f2fs_dedup_lat_start(fio->sbi) : 0;
 
 	if (keep_order)
 		f2fs_down_read(&fio->sbi->io_order_lock);
-	if (fio->io_type == FS_DATA_IO) {
-		// 从文件中恢复所有hashtable
-		read_finger_blk_table_from_file();
-		hash_page_data(fio->page, digest);
-		// 计算加密page的finger
-		if (fio->encrypted_page)
-			hash_page_data(fio->encrypted_page, digest_c);
-		finger = finger_search(digest);
-		if (finger) {
-			blkitem = block_search(finger->blk_addr);
-			if (blkitem) {
-				blkitem->ref += 1;
-				fio->new_blkaddr = blkitem->blk_addr;
-				dec_valid_block_count(
-					fio->sbi, fio->page->mapping->host, 1);
-				end_page_writeback(fio->page);
-				goto skipwrite;
-			}
+
+	/* NEW_ADDR in a compressed cluster stands for a compressed block */
+	if (dedup && !f2fs_compressed_file(fio->page->mapping->host) &&
+			f2fs_dedup_zero_page(fio->page)) {
+		f2fs_dedup_zero_block(fio->sbi, fio->old_blkaddr);
+		fio->new_blkaddr = NEW_ADDR;
+		dedup_skip_write(fio);
+		goto skipwrite;
+	}
+
+	/* a hash computed by writeback is used even while bypassing */
+	if (dedup && fio->dedup_fp)
+		memcpy(digest, fio->dedup_fp, DEDUP_FP_SIZE);
+	else if (dedup && f2fs_dedup_bypass(fio->sbi, fio->page->mapping->host))
+		dedup = false;
+	else if (dedup && f2fs_dedup_fingerprint(fio->sbi, fio->page, digest))
+		dedup = false;
+	if (dedup && fio->dedup_noshare) {
+		/* a short run of hits, sharing it would split the extent */
+		f2fs_dedup_account(fio->sbi, fio->page->mapping->host, true);
+	} else if (dedup) {
+		/* only plain pages can be cached as blocks on disk */
+		struct page *plain = fio->encrypted_page ? NULL : fio->page;
+
+		bool shared = f2fs_dedup_share_block(fio->sbi, digest,
+				fio->page, !plain, &fio->new_blkaddr);
+
+		f2fs_dedup_account(fio->sbi, fio->page->mapping->host, shared);
+		if (shared) {
+			f2fs_dedup_add_owner(fio->sbi, fio->new_blkaddr,
+					le32_to_cpu(sum->nid),
+					le16_to_cpu(sum->ofs_in_node));
+			f2fs_dedup_release_block(fio->sbi, fio->old_blkaddr);
+			if (plain)
+				f2fs_dedup_cache_block(fio->sbi, plain,
+							fio->new_blkaddr);
+			dedup_skip_write(fio);
+			goto skipwrite;
 		}
 	}
 reallocate:
@@ -3654,18 +3525,25 @@ reallocate:
 		goto reallocate;
 	}
 	f2fs_update_device_state(fio->sbi, fio->ino, fio->new_blkaddr, 1);
-	if (fio->io_type == FS_DATA_IO) {
-		// 如果指纹表中找不到finger，添加一条记录到指纹表
-		if (!finger_search(digest))
-			deduptable_insert(digest, fio->new_blkaddr, 1);
-		if (!finger_crypt_search(digest_c) && fio->encrypted_page)
-			crypt_lblknum_insert(digest_c, fio->page->index);
-		// 持久化所有hashtable
-		write_finger_blk_table_to_file();
+	if (dedup) {
+		/* not found in the fingerprint table, index it for later writes */
+		f2fs_dedup_insert_block(fio->sbi, digest, fio->new_blkaddr);
+		/* later sharers decrypt it with this block's key and IV */
+		if (fio->encrypted_page)
+			f2fs_dedup_insert_crypt(fio->sbi, fio->new_blkaddr,
+						fio->ino, fio->page->index);
+	} else if (fio->io_type == FS_GC_DATA_IO && fio->dedup_fp) {
+		/* GC found no equal of the block, its copy is the first one */
+		f2fs_dedup_insert_block(fio->sbi, fio->dedup_fp,
+						fio->new_blkaddr);
+	} else if (fio->io_type == FS_DATA_IO &&
+				f2fs_dedup_offline(fio->sbi)) {
+		f2fs_dedup_log_block(fio->sbi, fio->new_blkaddr);
 	}
 skipwrite:
 	if (keep_order)
 		f2fs_up_read(&fio->sbi->io_order_lock);
+	f2fs_update_dedup_latency(fio->sbi, DEDUP_LAT_WRITE, start);
 }
 
 void f2fs_do_write_meta_page(struct f2fs_sb_info *sbi, struct page *page,
@@ -3716,7 +3594,9 @@ void f2fs_outplace_write_data(struct dnode_of_data *dn,
 	do_write_page(&sum, fio);
 	f2fs_update_data_blkaddr(dn, fio->new_blkaddr);
 
-	f2fs_update_iostat(sbi, fio->io_type, F2FS_BLKSIZE);
+	/* a write dedup saved is counted as FS_DEDUP_IO only */
+	if (!fio->dedup_skipped)
+		f2fs_update_iostat(sbi, fio->io_type, F2FS_BLKSIZE);
 }
 
 int f2fs_inplace_write_data(struct f2fs_io_info *fio)
@@ -3796,11 +3676,15 @@ void f2fs_do_replace_block(struct f2fs_sb_info *sbi, struct f2fs_summary *sum,
 	int type;
 	unsigned short old_blkoff;
 	unsigned char old_alloc_type;
+	bool keep_old = false;
 
 	segno = GET_SEGNO(sbi, new_blkaddr);
 	se = get_seg_entry(sbi, segno);
 	type = se->type;
 
+	if (__is_valid_data_blkaddr(old_blkaddr))
+		keep_old = f2fs_put_shared_block(sbi, old_blkaddr);
+
 	f2fs_down_write(&SM_I(sbi)->curseg_lock);
 
 	if (!recover_curseg) {
@@ -3851,7 +3735,8 @@ void f2fs_do_replace_block(struct f2fs_sb_info *sbi, struct f2fs_summary *sum,
 		f2fs_invalidate_compress_page(sbi, old_blkaddr);
 		if (!from_gc)
 			update_segment_mtime(sbi, old_blkaddr, 0);
-		update_sit_entry(sbi, old_blkaddr, -1);
+		if (!keep_old)
+			update_sit_entry(sbi, old_blkaddr, -1);
 	}
 
 	locate_dirty_segment(sbi, GET_SEGNO(sbi, old_blkaddr));
@@ -31,6 +31,7 @@
 #include "f2fs.h"
 #include "node.h"
 #include "segment.h"
+#include "dedup.h"
 #include "xattr.h"
 #include "gc.h"
 #include "iostat.h"
@@ -159,6 +160,9 @@ enum {
 	Opt_gc_merge,
 	Opt_nogc_merge,
 	Opt_discard_unit,
+	Opt_dedup,
+	Opt_dedup_hash,
+	Opt_dedup_cache,
 	Opt_err,
 };
 
@@ -235,6 +239,9 @@ static match_table_t f2fs_tokens = {
 	{Opt_gc_merge, "gc_merge"},
 	{Opt_nogc_merge, "nogc_merge"},
 	{Opt_discard_unit, "discard_unit=%s"},
+	{Opt_dedup, "dedup=%s"},
+	{Opt_dedup_hash, "dedup_hash=%s"},
+	{Opt_dedup_cache, "dedup_cache"},
 	{Opt_err, NULL},
 };
 
@@ -1222,6 +1229,46 @@ static int parse_options(struct super_block *sb, char *options, bool is_remount)
 			}
 			kfree(name);
 			break;
+		case Opt_dedup:
+			name = match_strdup(&args[0]);
+			if (!name)
+				return -ENOMEM;
+			if (!strcmp(name, "inline")) {
+				F2FS_OPTION(sbi).dedup_mode = DEDUP_MODE_INLINE;
+			} else if (!strcmp(name, "offline")) {
+				F2FS_OPTION(sbi).dedup_mode =
+						DEDUP_MODE_OFFLINE;
+			} else if (!strcmp(name, "off")) {
+				F2FS_OPTION(sbi).dedup_mode = DEDUP_MODE_OFF;
+			} else {
+				kfree(name);
+				return -EINVAL;
+			}
+			kfree(name);
+			break;
+		case Opt_dedup_hash:
+			name = match_strdup(&args[0]);
+			if (!name)
+				return -ENOMEM;
+			if (!strcmp(name, "md5")) {
+				F2FS_OPTION(sbi).dedup_hash = DEDUP_HASH_MD5;
+			} else if (!strcmp(name, "sha256")) {
+				F2FS_OPTION(sbi).dedup_hash = DEDUP_HASH_SHA256;
+			} else if (!strcmp(name, "blake2s")) {
+				F2FS_OPTION(sbi).dedup_hash =
+						DEDUP_HASH_BLAKE2S;
+			} else if (!strcmp(name, "xxhash64")) {
+				F2FS_OPTION(sbi).dedup_hash =
+						DEDUP_HASH_XXHASH64;
+			} else {
+				kfree(name);
+				return -EINVAL;
+			}
+			kfree(name);
+			break;
+		case Opt_dedup_cache:
+			set_opt(sbi, DEDUP_CACHE);
+			break;
 		default:
 			f2fs_err(sbi, "Unrecognized mount option \"%s\" or missing value",
 				 p);
@@ -1572,6 +1619,7 @@ static void f2fs_put_super(struct super_block *sb)
 	f2fs_destroy_stats(sbi);
 
 	/* destroy f2fs internal modules */
+	f2fs_destroy_dedup_manager(sbi);
 	f2fs_destroy_node_manager(sbi);
 	f2fs_destroy_segment_manager(sbi);
 
@@ -1993,6 +2041,17 @@ static int f2fs_show_options(struct seq_file *seq, struct dentry *root)
 	else if (F2FS_OPTION(sbi).discard_unit == DISCARD_UNIT_SECTION)
 		seq_printf(seq, ",discard_unit=%s", "section");
 
+	if (F2FS_OPTION(sbi).dedup_mode == DEDUP_MODE_INLINE)
+		seq_printf(seq, ",dedup=%s", "inline");
+	else if (F2FS_OPTION(sbi).dedup_mode == DEDUP_MODE_OFFLINE)
+		seq_printf(seq, ",dedup=%s", "offline");
+	else if (F2FS_OPTION(sbi).dedup_mode == DEDUP_MODE_OFF)
+		seq_printf(seq, ",dedup=%s", "off");
+	seq_printf(seq, ",dedup_hash=%s",
+			f2fs_dedup_hash_name(F2FS_OPTION(sbi).dedup_hash));
+	if (test_opt(sbi, DEDUP_CACHE))
+		seq_puts(seq, ",dedup_cache");
+
 	return 0;
 }
 
@@ -2014,6 +2073,8 @@ static void default_options(struct f2fs_sb_info *sbi)
 	F2FS_OPTION(sbi).compress_ext_cnt = 0;
 	F2FS_OPTION(sbi).compress_mode = COMPR_MODE_FS;
 	F2FS_OPTION(sbi).bggc_mode = BGGC_MODE_ON;
+	F2FS_OPTION(sbi).dedup_mode = DEDUP_MODE_INLINE;
+	F2FS_OPTION(sbi).dedup_hash = DEDUP_HASH_SHA256;
 
 	sbi->sb->s_flags &= ~SB_INLINECRYPT;
 
@@ -2155,6 +2216,7 @@ static int f2fs_remount(struct super_block *sb, int *flags, char *data)
 	unsigned long old_sb_flags;
 	int err;
 	bool need_restart_gc = false, need_stop_gc = false;
+	bool need_restart_dedup = false, need_stop_dedup = false;
 	bool need_restart_ckpt = false, need_stop_ckpt = false;
 	bool need_restart_flush = false, need_stop_flush = false;
 	bool need_restart_discard = false, need_stop_discard = false;
@@ -2223,6 +2285,13 @@ static int f2fs_remount(struct super_block *sb, int *flags, char *data)
 		goto restore_opts;
 	}
 
+	/* blocks may be shared with nothing left to count their owners */
+	if (!(*flags & SB_RDONLY) && !f2fs_dedup_enabled(sbi) &&
+			is_set_ckpt_flags(sbi, CP_DEDUP_AREA_FLAG)) {
+		err = -EFSCORRUPTED;
+		goto restore_opts;
+	}
+
 #ifdef CONFIG_QUOTA
 	if (!f2fs_readonly(sb) && (*flags & SB_RDONLY)) {
 		err = dquot_suspend(sb, -1);
@@ -2272,6 +2341,12 @@ static int f2fs_remount(struct super_block *sb, int *flags, char *data)
 		goto restore_opts;
 	}
 
+	if (org_mount_opt.dedup_hash != F2FS_OPTION(sbi).dedup_hash) {
+		err = -EINVAL;
+		f2fs_warn(sbi, "switch dedup_hash option is not allowed");
+		goto restore_opts;
+	}
+
 	if ((*flags & SB_RDONLY) && test_opt(sbi, DISABLE_CHECKPOINT)) {
 		err = -EINVAL;
 		f2fs_warn(sbi, "disabling checkpoint not compatible with read-only");
@@ -2297,6 +2372,20 @@ static int f2fs_remount(struct super_block *sb, int *flags, char *data)
 		need_stop_gc = true;
 	}
 
+	/* the dedup thread only runs in offline mode on a writable fs */
+	if ((*flags & SB_RDONLY) ||
+			F2FS_OPTION(sbi).dedup_mode != DEDUP_MODE_OFFLINE) {
+		if (DEDUP_I(sbi)->dedup_thread) {
+			f2fs_stop_dedup_thread(sbi);
+			need_restart_dedup = true;
+		}
+	} else if (!DEDUP_I(sbi)->dedup_thread) {
+		err = f2fs_start_dedup_thread(sbi);
+		if (err)
+			goto restore_gc;
+		need_stop_dedup = true;
+	}
+
 	if (*flags & SB_RDONLY) {
 		sync_inodes_sb(sb);
 
@@ -2316,7 +2405,7 @@ static int f2fs_remount(struct super_block *sb, int *flags, char *data)
 			f2fs_err(sbi,
 			    "Failed to start F2FS issue_checkpoint_thread (%d)",
 			    err);
-			goto restore_gc;
+			goto restore_dedup;
 		}
 		need_stop_ckpt = true;
 	}
@@ -2397,6 +2486,13 @@ restore_ckpt:
 	} else if (need_stop_ckpt) {
 		f2fs_stop_ckpt_thread(sbi);
 	}
+restore_dedup:
+	if (need_restart_dedup) {
+		if (f2fs_start_dedup_thread(sbi))
+			f2fs_warn(sbi, "background dedup thread has stopped");
+	} else if (need_stop_dedup) {
+		f2fs_stop_dedup_thread(sbi);
+	}
 restore_gc:
 	if (need_restart_gc) {
 		if (f2fs_start_gc_thread(sbi))
@@ -4218,6 +4314,13 @@ try_onemore:
 	if (err)
 		goto free_nm;
 
+	err = f2fs_build_dedup_manager(sbi);
+	if (err) {
+		f2fs_err(sbi, "Failed to initialize F2FS dedup manager (%d)",
+			 err);
+		goto free_dm;
+	}
+
 	/* For write statistics */
 	sbi->sectors_written_start = f2fs_get_sectors_written(sbi);
 
@@ -4231,7 +4334,7 @@ try_onemore:
 
 	err = f2fs_build_stats(sbi);
 	if (err)
-		goto free_nm;
+		goto free_dm;
 
 	/* get an inode for node space */
 	sbi->node_inode = f2fs_iget(sb, F2FS_NODE_INO(sbi));
@@ -4349,6 +4452,10 @@ reset_checkpoint:
 	/* f2fs_recover_fsync_data() cleared this already */
 	clear_sbi_flag(sbi, SBI_POR_DOING);
 
+	/* now that recovery is done, the dedup area can be carved out */
+	if (!test_opt(sbi, DISABLE_CHECKPOINT))
+		f2fs_create_dedup_area(sbi);
+
 	if (test_opt(sbi, DISABLE_CHECKPOINT)) {
 		err = f2fs_disable_checkpoint(sbi);
 		if (err)
@@ -4368,6 +4475,16 @@ reset_checkpoint:
 		if (err)
 			goto sync_free_meta;
 	}
+
+	/* dedup is an optimization, mount without the thread if it fails */
+	if (F2FS_OPTION(sbi).dedup_mode == DEDUP_MODE_OFFLINE &&
+			!f2fs_readonly(sb)) {
+		err = f2fs_start_dedup_thread(sbi);
+		if (err)
+			f2fs_warn(sbi, "Failed to start dedup thread (%d)",
+				  err);
+		err = 0;
+	}
 	kvfree(options);
 
 	/* recover broken superblock */
@@ -4421,6 +4538,8 @@ free_node_inode:
 	sbi->node_inode = NULL;
 free_stats:
 	f2fs_destroy_stats(sbi);
+free_dm:
+	f2fs_destroy_dedup_manager(sbi);
 free_nm:
 	/* stop discard thread before destroying node manager */
 	f2fs_stop_discard_thread(sbi);
@@ -4491,7 +4610,10 @@ static void kill_f2fs_super(struct super_block *sb)
 
 		set_sbi_flag(sbi, SBI_IS_CLOSE);
 		f2fs_stop_gc_thread(sbi);
+		f2fs_stop_dedup_thread(sbi);
+		f2fs_stop_dedup_loaders(sbi);
 		f2fs_stop_discard_thread(sbi);
+		f2fs_dedup_drop_crypt_inodes(sbi);
 
 #ifdef CONFIG_F2FS_FS_COMPRESSION
 		/*
@@ -4576,9 +4698,12 @@ static int __init init_f2fs_fs(void)
 	err = f2fs_create_garbage_collection_cache();
 	if (err)
 		goto free_extent_cache;
-	err = f2fs_init_sysfs();
+	err = f2fs_create_dedup_caches();
 	if (err)
 		goto free_garbage_collection_cache;
+	err = f2fs_init_sysfs();
+	if (err)
+		goto free_dedup_caches;
 	err = register_shrinker(&f2fs_shrinker_info);
 	if (err)
 		goto free_sysfs;
@@ -4627,6 +4752,8 @@ free_shrinker:
 	unregister_shrinker(&f2fs_shrinker_info);
 free_sysfs:
 	f2fs_exit_sysfs();
+free_dedup_caches:
+	f2fs_destroy_dedup_caches();
 free_garbage_collection_cache:
 	f2fs_destroy_garbage_collection_cache();
 free_extent_cache:
@@ -4658,6 +4785,7 @@ static void __exit exit_f2fs_fs(void)
 	unregister_filesystem(&f2fs_fs_type);
 	unregister_shrinker(&f2fs_shrinker_info);
 	f2fs_exit_sysfs();
+	f2fs_destroy_dedup_caches();
 	f2fs_destroy_garbage_collection_cache();
 	f2fs_destroy_extent_cache();
 	f2fs_destroy_recovery_cache();
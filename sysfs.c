@@ -18,6 +18,7 @@
 #include "segment.h"
 #include "gc.h"
 #include "iostat.h"
+#include "dedup.h"
 #include <trace/events/f2fs.h>
 
 static struct proc_dir_entry *f2fs_proc_root;
@@ -39,6 +40,7 @@ enum {
 	RESERVED_BLOCKS,	/* struct f2fs_sb_info */
 	CPRC_INFO,	/* struct ckpt_req_control */
 	ATGC_INFO,	/* struct atgc_management */
+	DEDUP_INFO,	/* struct f2fs_dedup_info */
 };
 
 static const char *gc_mode_names[MAX_GC_MODE] = {
@@ -89,6 +91,8 @@ static unsigned char *__struct_ptr(struct f2fs_sb_info *sbi, int struct_type)
 		return (unsigned char *)&sbi->cprc_info;
 	else if (struct_type == ATGC_INFO)
 		return (unsigned char *)&sbi->am;
+	else if (struct_type == DEDUP_INFO)
+		return (unsigned char *)DEDUP_I(sbi);
 	return NULL;
 }
 
@@ -260,6 +264,14 @@ static ssize_t avg_vblocks_show(struct f2fs_attr *a,
 }
 #endif
 
+#ifdef CONFIG_F2FS_IOSTAT
+static ssize_t dedup_latency_show(struct f2fs_attr *a,
+				struct f2fs_sb_info *sbi, char *buf)
+{
+	return f2fs_show_dedup_latency(sbi, buf);
+}
+#endif
+
 static ssize_t main_blkaddr_show(struct f2fs_attr *a,
 				struct f2fs_sb_info *sbi, char *buf)
 {
@@ -537,6 +549,27 @@ out:
 	}
 #endif
 
+	if (!strcmp(a->attr.name, "dedup_min_extent")) {
+		if (!t || t > DEDUP_BATCH_SIZE)
+			return -EINVAL;
+		*ui = (unsigned int)t;
+		return count;
+	}
+
+	if (!strcmp(a->attr.name, "dedup_bypass_ratio")) {
+		if (t > 100)
+			return -EINVAL;
+		*ui = (unsigned int)t;
+		return count;
+	}
+
+	if (!strcmp(a->attr.name, "dedup_gc_merge")) {
+		if (t > 1)
+			return -EINVAL;
+		*ui = (unsigned int)t;
+		return count;
+	}
+
 #ifdef CONFIG_F2FS_FS_COMPRESSION
 	if (!strcmp(a->attr.name, "compr_written_block") ||
 		!strcmp(a->attr.name, "compr_saved_block")) {
@@ -841,6 +874,14 @@ F2FS_RW_ATTR(ATGC_INFO, atgc_management, atgc_candidate_ratio, candidate_ratio);
 F2FS_RW_ATTR(ATGC_INFO, atgc_management, atgc_candidate_count, max_candidate_count);
 F2FS_RW_ATTR(ATGC_INFO, atgc_management, atgc_age_weight, age_weight);
 F2FS_RW_ATTR(ATGC_INFO, atgc_management, atgc_age_threshold, age_threshold);
+F2FS_RW_ATTR(DEDUP_INFO, f2fs_dedup_info, dedup_max_fp_pages, max_fp_pages);
+F2FS_RW_ATTR(DEDUP_INFO, f2fs_dedup_info, dedup_bypass_ratio, bypass_ratio);
+F2FS_RW_ATTR(DEDUP_INFO, f2fs_dedup_info, dedup_min_extent, min_extent);
+F2FS_RW_ATTR(DEDUP_INFO, f2fs_dedup_info, dedup_gc_merge, gc_merge);
+F2FS_RW_ATTR(DEDUP_INFO, f2fs_dedup_info, dedup_cold_refs, cold_refs);
+#ifdef CONFIG_F2FS_IOSTAT
+F2FS_GENERAL_RO_ATTR(dedup_latency);
+#endif
 
 F2FS_RW_ATTR(F2FS_SBI, f2fs_sb_info, seq_file_ra_mul, seq_file_ra_mul);
 F2FS_RW_ATTR(F2FS_SBI, f2fs_sb_info, gc_segment_mode, gc_segment_mode);
@@ -934,6 +975,15 @@ static struct attribute *f2fs_attrs[] = {
 	ATTR_LIST(gc_reclaimed_segments),
 	ATTR_LIST(max_fragment_chunk),
 	ATTR_LIST(max_fragment_hole),
+	/* For dedup */
+	ATTR_LIST(dedup_max_fp_pages),
+	ATTR_LIST(dedup_bypass_ratio),
+	ATTR_LIST(dedup_min_extent),
+	ATTR_LIST(dedup_gc_merge),
+	ATTR_LIST(dedup_cold_refs),
+#ifdef CONFIG_F2FS_IOSTAT
+	ATTR_LIST(dedup_latency),
+#endif
 	NULL,
 };
 ATTRIBUTE_GROUPS(f2fs);